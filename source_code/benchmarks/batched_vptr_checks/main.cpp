@@ -0,0 +1,36 @@
+#include "classes.h"
+#include <iostream>
+#include <chrono>
+
+// The inner loop calls through every element of an array of objects, so
+// each call runs the full vtable range check (six vtables, too many to
+// devirtualize). Compare the time per call of an SD build (one check per
+// call) against a BATCH=OK build (the array validated before the loop, a
+// block of vptrs per vector compare), with a NO_LTO=OK build as the
+// unchecked baseline. WIDTH=8 validates 8 vptrs per block.
+int main(int argc, char *argv[])
+{
+  const long rounds = 1000000;
+  const int count = 1024;
+  Shape* shapes[count];
+  long sum = 0;
+
+  for (int i = 0; i < count; i++)
+    shapes[i] = makeShape(i * argc + i / 7);
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (long r = 0; r < rounds; r++)
+    for (int i = 0; i < count; i++)
+      sum += shapes[i]->area(r & 0xff);
+
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+  std::cout << "sum " << sum << std::endl;
+  std::cerr << "ns per call " << ns / (rounds * count) << std::endl;
+
+  for (int i = 0; i < count; i++)
+    delete shapes[i];
+  return 0;
+}
@@ -0,0 +1,30 @@
+#include "classes.h"
+
+Left::~Left() {}
+Right::~Right() {}
+Both::~Both() {}
+RightOnly::~RightOnly() {}
+LeftOnly::~LeftOnly() {}
+
+long Left::left(long i) { return i; }
+long Right::right(long i) { return i + 1; }
+long Both::left(long i) { return i * 2; }
+long Both::right(long i) { return i * 3; }
+long RightOnly::right(long i) { return i * i; }
+long LeftOnly::left(long i) { return i ^ 5; }
+
+Left* makeLeft(int kind) {
+  switch (kind % 3) {
+  case 0: return new Left();
+  case 1: return new Both();
+  }
+  return new LeftOnly();
+}
+
+Right* makeRight(int kind) {
+  switch (kind % 3) {
+  case 0: return new Right();
+  case 1: return new Both();
+  }
+  return new RightOnly();
+}
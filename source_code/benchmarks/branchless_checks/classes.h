@@ -0,0 +1,35 @@
+#ifndef __CLASSES_H__
+#define __CLASSES_H__
+
+struct Left {
+  virtual ~Left();
+  virtual long left(long i);
+};
+
+struct Right {
+  virtual ~Right();
+  virtual long right(long i);
+};
+
+// the Right-in-Both vtable lives in the cloud of Left, so calls through
+// Right* are checked against two ranges
+struct Both : public Left, public Right {
+  virtual ~Both();
+  virtual long left(long i);
+  virtual long right(long i);
+};
+
+struct RightOnly : public Right {
+  virtual ~RightOnly();
+  virtual long right(long i);
+};
+
+struct LeftOnly : public Left {
+  virtual ~LeftOnly();
+  virtual long left(long i);
+};
+
+Left* makeLeft(int kind);
+Right* makeRight(int kind);
+
+#endif
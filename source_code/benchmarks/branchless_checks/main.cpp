@@ -0,0 +1,44 @@
+#include "classes.h"
+#include <iostream>
+#include <chrono>
+
+// Calls through Left* have one range check, calls through Right* two.
+// The objects are picked in a pseudo random order, so with branchy checks
+// the Right* calls also mispredict on which range matched. Compare the time
+// per call of an SD build against a MASK=OK build, with a NO_LTO=OK build as
+// the unchecked baseline.
+int main(int argc, char *argv[])
+{
+  const long iterations = 20000000;
+  const int count = 64;
+  Left* lefts[count];
+  Right* rights[count];
+  long sum = 0;
+
+  unsigned seed = argc;
+  for (int i = 0; i < count; i++) {
+    seed = seed * 1103515245 + 12345;
+    lefts[i] = makeLeft(seed >> 16);
+    rights[i] = makeRight(seed >> 8);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (long i = 0; i < iterations; i++) {
+    int j = (i * 37) % count;
+    sum += lefts[j]->left(i & 0xff);
+    sum += rights[j]->right(i & 0xff);
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+  std::cout << "sum " << sum << std::endl;
+  std::cerr << "ns per call " << ns / (iterations * 2) << std::endl;
+
+  for (int i = 0; i < count; i++) {
+    delete lefts[i];
+    delete rights[i];
+  }
+  return 0;
+}
@@ -0,0 +1,17 @@
+#include "classes.h"
+
+Shape::~Shape() {}
+Square::~Square() {}
+Circle::~Circle() {}
+
+long Shape::area(long i) { return i; }
+long Square::area(long i) { return i * i; }
+long Circle::area(long i) { return 3 * i * i; }
+
+Shape* makeShape(int kind) {
+  if (kind == 0)
+    return new Shape();
+  else if (kind == 1)
+    return new Square();
+  return new Circle();
+}
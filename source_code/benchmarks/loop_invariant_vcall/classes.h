@@ -0,0 +1,21 @@
+#ifndef __CLASSES_H__
+#define __CLASSES_H__
+
+struct Shape {
+  virtual ~Shape();
+  virtual long area(long i);
+};
+
+struct Square : public Shape {
+  virtual ~Square();
+  virtual long area(long i);
+};
+
+struct Circle : public Shape {
+  virtual ~Circle();
+  virtual long area(long i);
+};
+
+Shape* makeShape(int kind);
+
+#endif
@@ -0,0 +1,28 @@
+#include "classes.h"
+#include <iostream>
+#include <chrono>
+
+// The object pointer does not change inside the loop, so the vtable range
+// check of the virtual call can be done once before the loop instead of on
+// every iteration. Compare the time per iteration of an SD build against a
+// NO_LTO=OK build, with the check hoisted the two should match.
+int main(int argc, char *argv[])
+{
+  const long iterations = 100000000;
+  Shape* s = makeShape(argc);
+  long sum = 0;
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (long i = 0; i < iterations; i++)
+    sum += s->area(i & 0xff);
+
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+  std::cout << "sum " << sum << std::endl;
+  std::cerr << "ns per iteration " << ns / iterations << std::endl;
+
+  delete s;
+  return 0;
+}
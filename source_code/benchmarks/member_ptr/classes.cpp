@@ -34,3 +34,18 @@ void Derived::oneIntArg3(int a)
 {
   std::cout << "Derived::oneIntArg3(" << a << ")\n";
 }
+
+void Side::sideArg(int a)
+{
+  std::cout << "Side::sideArg(" << a << ")\n";
+}
+
+void Multi::oneIntArg2(int a)
+{
+  std::cout << "Multi::oneIntArg2(" << a << ")\n";
+}
+
+void Multi::multiArg(int a)
+{
+  std::cout << "Multi::multiArg(" << a << ")\n";
+}
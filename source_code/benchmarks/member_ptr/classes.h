@@ -26,4 +26,19 @@ public:
     virtual void oneIntArg3(int a);
 };
 
+class Side
+{
+public:
+    virtual ~Side() {}
+    virtual void sideArg(int a);
+};
+
+// Base is not the primary base, so it sits at a non-zero offset in Multi
+class Multi : public Side, public Base
+{
+public:
+    virtual void oneIntArg2(int a);
+    virtual void multiArg(int a);
+};
+
 #endif
@@ -45,6 +45,20 @@ int main()
   dFptr = &Derived::oneIntArg3;
   (derivedPointer->*dFptr)(50);
 
+  // Converting down the hierarchy gives a negative adjustment: the Base
+  // subobject of Multi is not at offset 0
+  Base* baseMultiPointer = new Multi();
+  bFptr = static_cast<void (Base::*)(int)>(&Multi::multiArg);
+  // This should be Multi::multiArg
+  (baseMultiPointer->*bFptr)(51);
+  bFptr = static_cast<void (Base::*)(int)>(
+      static_cast<void (Multi::*)(int)>(&Side::sideArg));
+  // This should be Side::sideArg
+  (baseMultiPointer->*bFptr)(52);
+  bFptr = &Base::oneIntArg2;
+  // This should be Multi::oneIntArg2
+  (baseMultiPointer->*bFptr)(53);
+
 
   return 0;
 }
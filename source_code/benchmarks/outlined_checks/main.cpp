@@ -0,0 +1,36 @@
+#include "classes.h"
+#include <iostream>
+#include <chrono>
+
+extern long (*sites[32])(Shape**, long);
+
+// The 128 call sites in sites.cpp are outside of loops, so with OUTLINE=OK
+// each of their checks becomes a call to a thunk shared by all sites of the
+// same class. Compare "make size" and the time per call of an SD build
+// against an OUTLINE=OK build, with a NO_LTO=OK build as the unchecked
+// baseline. The outlined build should have a smaller .text and pay a call
+// and return per checked call.
+int main(int argc, char *argv[])
+{
+  const long iterations = 10000000;
+  Shape* shapes[4];
+  long sum = 0;
+
+  for (int i = 0; i < 4; i++)
+    shapes[i] = makeShape(i * argc + i / 3);
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (long i = 0; i < iterations; i++)
+    sum += sites[i % 32](shapes, i & 0xff);
+
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+  std::cout << "sum " << sum << std::endl;
+  std::cerr << "ns per call " << ns / (iterations * 4) << std::endl;
+
+  for (int i = 0; i < 4; i++)
+    delete shapes[i];
+  return 0;
+}
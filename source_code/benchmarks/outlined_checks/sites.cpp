@@ -0,0 +1,21 @@
+#include "classes.h"
+
+// Many cold call sites, each with its own inline check unless the checks
+// are outlined. SITES(n) defines site<n>, calling through four objects.
+#define SITES(n)                                                          \
+  long site##n(Shape** s, long i) {                                       \
+    return s[0]->area(i + n) + s[1]->area(i * n) + s[2]->area(i - n) +    \
+           s[3]->area(i ^ n);                                             \
+  }
+
+SITES(0)  SITES(1)  SITES(2)  SITES(3)  SITES(4)  SITES(5)  SITES(6)  SITES(7)
+SITES(8)  SITES(9)  SITES(10) SITES(11) SITES(12) SITES(13) SITES(14) SITES(15)
+SITES(16) SITES(17) SITES(18) SITES(19) SITES(20) SITES(21) SITES(22) SITES(23)
+SITES(24) SITES(25) SITES(26) SITES(27) SITES(28) SITES(29) SITES(30) SITES(31)
+
+long (*sites[32])(Shape**, long) = {
+  site0,  site1,  site2,  site3,  site4,  site5,  site6,  site7,
+  site8,  site9,  site10, site11, site12, site13, site14, site15,
+  site16, site17, site18, site19, site20, site21, site22, site23,
+  site24, site25, site26, site27, site28, site29, site30, site31,
+};
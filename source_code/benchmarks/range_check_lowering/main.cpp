@@ -0,0 +1,34 @@
+#include "classes.h"
+#include <iostream>
+#include <chrono>
+
+// Every iteration calls through a different object, so each call runs the
+// full vtable range check (six vtables, too many to devirtualize). Compare
+// the time per iteration of an SD build (checks expanded in IR) against a
+// NATIVE=OK build (checks lowered by the x86-64 backend to sub; ror; cmp),
+// with a NO_LTO=OK build as the unchecked baseline.
+int main(int argc, char *argv[])
+{
+  const long iterations = 100000000;
+  const int count = 64;
+  Shape* shapes[count];
+  long sum = 0;
+
+  for (int i = 0; i < count; i++)
+    shapes[i] = makeShape(i * argc + i / 7);
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (long i = 0; i < iterations; i++)
+    sum += shapes[i % count]->area(i & 0xff);
+
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+  std::cout << "sum " << sum << std::endl;
+  std::cerr << "ns per iteration " << ns / iterations << std::endl;
+
+  for (int i = 0; i < count; i++)
+    delete shapes[i];
+  return 0;
+}
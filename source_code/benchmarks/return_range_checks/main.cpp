@@ -0,0 +1,54 @@
+#include "classes.h"
+#include <iostream>
+#include <chrono>
+
+// The calls go to small virtual functions, so the check before each of
+// their returns is a large part of the work: it loads the marker behind the
+// return address and compares the callee's ID against the call site's ID
+// range. Compare the time per call of an SD build against a NO_RET=OK build
+// (vptr checks only), with a NO_LTO=OK build as the unchecked baseline.
+//
+// bothArms makes the same virtual call in both arms of an if. SimplifyCFG
+// merges the two calls into one and drops their metadata, the merged call
+// must still be marked or the callee traps on return.
+static long __attribute__((noinline)) bothArms(Shape* shape, long i)
+{
+  long area;
+  if (i & 1) {
+    area = shape->area(i & 0xff);
+    area += i;
+  } else {
+    area = shape->area(i & 0xff);
+    area -= i;
+  }
+  return area;
+}
+
+int main(int argc, char *argv[])
+{
+  const long iterations = 100000000;
+  const int count = 64;
+  Shape* shapes[count];
+  long sum = 0;
+
+  for (int i = 0; i < count; i++)
+    shapes[i] = makeShape(i * argc + i / 7);
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (long i = 0; i < iterations; i++)
+    sum += shapes[i % count]->area(i & 0xff);
+
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+  for (long i = 0; i < count; i++)
+    sum += bothArms(shapes[i], i);
+
+  std::cout << "sum " << sum << std::endl;
+  std::cerr << "ns per call " << ns / iterations << std::endl;
+
+  for (int i = 0; i < count; i++)
+    delete shapes[i];
+  return 0;
+}
@@ -0,0 +1,20 @@
+#include "helpers.h"
+
+__attribute__((noinline)) long mix(long x) {
+  return (x ^ (x >> 7)) * 31;
+}
+
+__attribute__((noinline)) long fold(long x, long y) {
+  return mix(x) + mix(y);
+}
+
+__attribute__((noinline)) long scale(long x) {
+  return fold(x, x + 1) & 0xffff;
+}
+
+__attribute__((noinline)) static long stepA(long x) { return x + 3; }
+__attribute__((noinline)) static long stepB(long x) { return x * 5; }
+__attribute__((noinline)) static long stepC(long x) { return x - 1; }
+__attribute__((noinline)) static long stepD(long x) { return x ^ 0x55; }
+
+step_t steps[4] = { stepA, stepB, stepC, stepD };
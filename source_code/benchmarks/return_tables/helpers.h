@@ -0,0 +1,12 @@
+#ifndef HELPERS_H
+#define HELPERS_H
+
+typedef long (*step_t)(long);
+
+extern step_t steps[4];
+
+long mix(long x);
+long fold(long x, long y);
+long scale(long x);
+
+#endif
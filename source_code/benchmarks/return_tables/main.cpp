@@ -0,0 +1,29 @@
+#include "helpers.h"
+#include <iostream>
+#include <chrono>
+
+// Small non-virtual functions, called directly and through a table of
+// function pointers. Each checked return loads the call site ID behind the
+// return address and compares it against the two runs in the callee's
+// return table. The link prints the number of checked functions, call sites
+// and table bytes. Compare an SD build against a NO_RET=OK build, and an
+// INDIRECT=OK build to also check the functions in the table.
+int main(int argc, char *argv[])
+{
+  const long iterations = 100000000;
+  long sum = argc;
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (long i = 0; i < iterations; i++) {
+    sum += scale(i);
+    sum = steps[i & 3](sum);
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+  std::cout << "sum " << sum << std::endl;
+  std::cerr << "ns per iteration " << ns / iterations << std::endl;
+  return 0;
+}
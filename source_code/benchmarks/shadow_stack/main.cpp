@@ -0,0 +1,66 @@
+#include <iostream>
+#include <chrono>
+#include <stdexcept>
+#include <csetjmp>
+
+// Calls small functions in a loop, then unwinds through protected frames
+// with exceptions and longjmp to make sure the shadow stack stays in sync.
+// Compare the time per call of an SD build (range based return checks)
+// against a SHADOW=OK build (shadow stack) and a NO_LTO=OK build.
+
+static std::jmp_buf env;
+
+__attribute__((noinline)) long leaf(long x) {
+  return (x * 7) ^ (x >> 3);
+}
+
+__attribute__((noinline)) long middle(long x) {
+  return leaf(x) + leaf(x + 1);
+}
+
+__attribute__((noinline)) long thrower(int depth) {
+  if (depth == 0)
+    throw std::runtime_error("unwind");
+  return thrower(depth - 1) + 1;
+}
+
+__attribute__((noinline)) long jumper(int depth) {
+  if (depth == 0)
+    std::longjmp(env, 1);
+  return jumper(depth - 1) + 1;
+}
+
+int main(int argc, char *argv[])
+{
+  const long iterations = 100000000;
+  long sum = argc;
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (long i = 0; i < iterations; i++)
+    sum += middle(i);
+
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+  long unwound = 0;
+  for (int i = 0; i < 1000; i++) {
+    try {
+      sum += thrower(i % 50);
+    } catch (const std::runtime_error&) {
+      unwound++;
+    }
+
+    if (setjmp(env) == 0)
+      sum += jumper(i % 50);
+    else
+      unwound++;
+
+    // returns after the unwinding must still match
+    sum += middle(i);
+  }
+
+  std::cout << "sum " << sum << " unwound " << unwound << std::endl;
+  std::cerr << "ns per call " << ns / (iterations * 3) << std::endl;
+  return 0;
+}
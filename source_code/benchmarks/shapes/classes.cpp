@@ -0,0 +1,26 @@
+#include "classes.h"
+
+Shape::~Shape() {}
+Square::~Square() {}
+Circle::~Circle() {}
+Triangle::~Triangle() {}
+Hexagon::~Hexagon() {}
+Octagon::~Octagon() {}
+
+long Shape::area(long i) { return i; }
+long Square::area(long i) { return i * i; }
+long Circle::area(long i) { return 3 * i * i; }
+long Triangle::area(long i) { return i * i / 2; }
+long Hexagon::area(long i) { return 5 * i * i / 2; }
+long Octagon::area(long i) { return 5 * i * i; }
+
+Shape* makeShape(int kind) {
+  switch (kind % 6) {
+  case 0: return new Shape();
+  case 1: return new Square();
+  case 2: return new Circle();
+  case 3: return new Triangle();
+  case 4: return new Hexagon();
+  }
+  return new Octagon();
+}
@@ -0,0 +1,40 @@
+#ifndef __CLASSES_H__
+#define __CLASSES_H__
+
+// The Shape hierarchy shared by range_check_lowering, batched_vptr_checks,
+// outlined_checks and return_range_checks: six vtables, too many to
+// devirtualize a call. Only the drivers (main.cpp) differ.
+
+struct Shape {
+  virtual ~Shape();
+  virtual long area(long i);
+};
+
+struct Square : public Shape {
+  virtual ~Square();
+  virtual long area(long i);
+};
+
+struct Circle : public Shape {
+  virtual ~Circle();
+  virtual long area(long i);
+};
+
+struct Triangle : public Shape {
+  virtual ~Triangle();
+  virtual long area(long i);
+};
+
+struct Hexagon : public Shape {
+  virtual ~Hexagon();
+  virtual long area(long i);
+};
+
+struct Octagon : public Shape {
+  virtual ~Octagon();
+  virtual long area(long i);
+};
+
+Shape* makeShape(int kind);
+
+#endif
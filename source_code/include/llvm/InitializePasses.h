@@ -314,6 +314,24 @@ void initializeSDLayoutBuilderPass(PassRegistry&);
 //this pass is used to update the indices of the new layout of the v tables
 void initializeSDUpdateIndicesPass(PassRegistry&);
 
+//this pass is used to hoist loop invariant vptr checks to the loop preheader
+void initializeSDCheckHoistPass(PassRegistry&);
+
+//this pass is used to remove vptr checks dominated by an equivalent check
+void initializeSDCheckElimPass(PassRegistry&);
+
+//this pass is used to devirtualize checked virtual calls with few possible targets
+void initializeSDDevirtPass(PassRegistry&);
+
+//this pass is used to remove vptr checks on objects whose dynamic type is known
+void initializeSDKnownTypePass(PassRegistry&);
+
+//this pass is used to remove vptr checks in callees on objects their callers already checked
+void initializeSDCheckedThisPass(PassRegistry&);
+
+//this pass is used to validate the vptrs of loops over object arrays before the loop, in batches
+void initializeSDBatchCheckPass(PassRegistry&);
+
 //this pass is used for updating the annotated instructions with the new indices
 void initializeSDMoveBasicBlocksPass(PassRegistry&);
 
@@ -323,6 +341,15 @@ void initializeSDSubstModulePass(PassRegistry&);
 //TODO MATT: write docs
 void initializeSDAnalysisPass(PassRegistry&);
 
+//this pass is used to check returns of virtual functions against the function ID range of the call site
+void initializeSDReturnRangePass(PassRegistry&);
+
+//this pass is used to check returns of non-virtual functions against per function tables of call site IDs
+void initializeSDReturnTablePass(PassRegistry&);
+
+//this pass is used to protect returns with a thread local shadow stack
+void initializeSDShadowStackPass(PassRegistry&);
+
 void initializeSDCleanupPass(PassRegistry&);
 }
 
@@ -191,8 +191,17 @@ namespace {
       (void) llvm::createSDBuildCHAPass();
       (void) llvm::createSDLayoutBuilderPass();
       (void) llvm::createSDUpdateIndicesPass();
+      (void) llvm::createSDCheckHoistPass();
+      (void) llvm::createSDCheckElimPass();
+      (void) llvm::createSDDevirtPass();
+      (void) llvm::createSDKnownTypePass();
+      (void) llvm::createSDCheckedThisPass();
+      (void) llvm::createSDBatchCheckPass();
       (void) llvm::createSDCleanupPass();
       (void) llvm::createSDAnalysisPass();
+      (void) llvm::createSDReturnRangePass();
+      (void) llvm::createSDReturnTablePass();
+      (void) llvm::createSDShadowStackPass();
       (void) llvm::createSDMoveBasicBlocksPass();
       (void) llvm::createSDSubstModulePass();
     }
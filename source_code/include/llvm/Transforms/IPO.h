@@ -210,11 +210,20 @@ this are the safedispatch passes*/
 ModulePass* createSDFixPass();
 ModulePass* createSDBuildCHAPass();
 ModulePass* createSDLayoutBuilderPass(bool interleave = false);
-ModulePass* createSDUpdateIndicesPass();
+ModulePass* createSDUpdateIndicesPass(bool bitsetChecks = false);
+ModulePass* createSDCheckHoistPass();
+ModulePass* createSDCheckElimPass();
+ModulePass* createSDDevirtPass();
+ModulePass* createSDKnownTypePass();
+ModulePass* createSDCheckedThisPass();
+ModulePass* createSDBatchCheckPass();
 ModulePass* createSDCleanupPass();
 ModulePass* createSDMoveBasicBlocksPass();
 ModulePass* createSDSubstModulePass();
 ModulePass* createSDAnalysisPass();
+ModulePass* createSDReturnRangePass(bool markSites = false);
+ModulePass* createSDReturnTablePass();
+ModulePass* createSDShadowStackPass();
 
 } // End llvm namespace
 
@@ -124,6 +124,10 @@ public:
   bool EmitIVTBLs; //Paul: flag variable used for interleaving the v tables
   bool EmitOVTBLs; //Paul: flag variable used for ordering the v tables
   bool EmitReturnChecks; //Matt: flag variable used for backward edge checks
+  bool EmitReturnRangeChecks; //flag variable used for the return range checks of virtual functions
+  bool EmitReturnTableChecks; //flag variable used for the return table checks of direct calls
+  bool EmitBitsetChecks; //flag variable used for span+bitset checks of multi-range call sites
+  bool EmitShadowStack; //flag variable used for shadow stack return protection
 
 private:
   /// ExtensionList - This is list of all of the extensions that are registered.
@@ -459,5 +459,43 @@ namespace llvm {
       return currentID;
     }
 
+    bool hasFunctionInfo() {
+      return currentID != (uint64_t) -1;
+    }
+
+    /**
+     * The IDs buildFunctionInfo gave the functions in the vtables.
+     */
+    const function_id_map_t& getFunctionIDs() {
+      assert(hasFunctionInfo() && "buildFunctionInfo was not executed first!");
+      return functionIDMap;
+    }
+
+    /**
+     * The IDs of all functions a call to the function name in the vtable of
+     * className can reach, i.e. the function and its overriders.
+     */
+    bool getFunctionRange(const func_name_t& name, const vtbl_name_t& className, range_t& range) {
+      assert(hasFunctionInfo() && "buildFunctionInfo was not executed first!");
+      auto entries = functionMap.find(func_and_class_t(name, className));
+      if (entries == functionMap.end())
+        return false;
+
+      bool found = false;
+      for (auto &function : entries->second) {
+        auto functionRange = functionRangeMap.find(function);
+        if (functionRange == functionRangeMap.end())
+          continue;
+
+        if (!found)
+          range = functionRange->second;
+        range.first = std::min(range.first, functionRange->second.first);
+        range.second = std::max(range.second, functionRange->second.second);
+        found = true;
+      }
+
+      return found;
+    }
+
   };
 }
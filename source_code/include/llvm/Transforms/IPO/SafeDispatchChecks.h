@@ -0,0 +1,355 @@
+#ifndef LLVM_TRANSFORMS_IPO_SAFEDISPATCH_CHECKS_H
+#define LLVM_TRANSFORMS_IPO_SAFEDISPATCH_CHECKS_H
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Transforms/IPO/SafeDispatchMD.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include <limits>
+#include <set>
+#include <stdio.h>
+#include <vector>
+
+/*
+helpers for recognizing the vptr checks emitted by SDUpdateIndices (P4).
+Between P4 and SDSubstModule (P5) every checked virtual call looks like this:
+
+  head:
+    %1 = bitcast %vptr to i8*
+    %2 = call i1 @llvm.sd.subst.check.range(i8* %1, start0, width0, align)
+    br i1 %2, label %sd.vptr_check.success, label %sd.fastcheck.fail.0
+  sd.fastcheck.fail.0:
+    %3 = call i1 @llvm.sd.subst.check.range(i8* %1, start1, width1, align)
+    br i1 %3, label %sd.vptr_check.success, label %sd.fastcheck.fail.1
+  ...
+  sd.fastcheck.fail.N:
+    call void @llvm.trap()
+    unreachable
+
+with llvm.sd.subst.check.bitset in place of the range checks for span+bitset sites.
+*/
+
+typedef std::pair<llvm::GlobalVariable*, uint64_t> sd_vptr_loc_t;
+
+// metadata holding the module wide id of the call site a check belongs to
+#define SD_MD_CHECK_SITE "sd.check.site"
+
+// metadata holding the class and the precise class of the checked call site
+#define SD_MD_CHECK_CLASS "sd.check.class"
+
+// named metadata listing the call sites P4 emitted checks for, with the site
+// key (see sd_getCheckSiteKey), class, precise class and number of ranges
+#define SD_MD_CHECK_SITES "sd.check.sites"
+
+struct sd_check_chain_t {
+  llvm::BasicBlock* head;                 // block holding the first check
+  llvm::BasicBlock* success;              // block reached when any check passes
+  llvm::Value* vptr;                      // checked vptr, pointer casts stripped
+  std::vector<llvm::CallInst*> checks;    // check intrinsics in emission order
+  std::vector<llvm::BasicBlock*> fails;   // fail blocks, the last one traps
+};
+
+/*
+return the check intrinsic call if V is a call to llvm.sd.subst.check.range
+or llvm.sd.subst.check.bitset, NULL otherwise
+*/
+static inline llvm::CallInst* sd_getCheckIntrinsic(llvm::Value* V) {
+  llvm::IntrinsicInst* II = llvm::dyn_cast_or_null<llvm::IntrinsicInst>(V);
+
+  if (II && (II->getIntrinsicID() == llvm::Intrinsic::sd_subst_check_range ||
+             II->getIntrinsicID() == llvm::Intrinsic::sd_subst_check_bitset))
+    return II;
+
+  return NULL;
+}
+
+static inline llvm::CallInst* sd_getChainCheck(llvm::BasicBlock* BB, llvm::BasicBlock* success) {
+  llvm::BranchInst* BI = llvm::dyn_cast<llvm::BranchInst>(BB->getTerminator());
+
+  if (!BI || !BI->isConditional() || BI->getSuccessor(0) != success)
+    return NULL;
+
+  return sd_getCheckIntrinsic(BI->getCondition());
+}
+
+/*
+does the SD_MD_FINAL node clang attached to a call site (and P4 copies to its
+checks) say that what ("class" or "method") is final
+*/
+static inline bool sd_isFinal(const llvm::MDNode* finalMD, llvm::StringRef what) {
+  if (!finalMD)
+    return false;
+
+  for (const llvm::MDOperand& op : finalMD->operands())
+    if (llvm::MDString* str = llvm::dyn_cast_or_null<llvm::MDString>(op.get()))
+      if (str->getString() == what)
+        return true;
+
+  return false;
+}
+
+/*
+a range start is either ptrtoint(_SD<root>) or add(ptrtoint(_SD<root>), off)
+*/
+static inline bool sd_getRangeStartOffset(llvm::Constant* start, llvm::GlobalVariable*& gv, uint64_t& off) {
+  llvm::ConstantExpr* CE = llvm::dyn_cast<llvm::ConstantExpr>(start);
+  off = 0;
+
+  if (CE && CE->getOpcode() == llvm::Instruction::Add) {
+    llvm::ConstantInt* offC = llvm::dyn_cast<llvm::ConstantInt>(CE->getOperand(1));
+    if (!offC)
+      return false;
+    off = offC->getZExtValue();
+    CE = llvm::dyn_cast<llvm::ConstantExpr>(CE->getOperand(0));
+  }
+
+  if (!CE || CE->getOpcode() != llvm::Instruction::PtrToInt)
+    return false;
+
+  gv = llvm::dyn_cast<llvm::GlobalVariable>(CE->getOperand(0));
+  return gv != NULL;
+}
+
+/*
+read the bits of a llvm.sd.subst.check.bitset call, bit i lives in byte i/8
+of the constant array passed as the last argument
+*/
+static inline bool sd_getBitSetBits(llvm::CallInst* check, std::set<uint64_t>& bits) {
+  llvm::GlobalVariable* bitsGV =
+    llvm::dyn_cast<llvm::GlobalVariable>(check->getArgOperand(4)->stripPointerCasts());
+  llvm::ConstantInt* width = llvm::dyn_cast<llvm::ConstantInt>(check->getArgOperand(2));
+
+  if (!bitsGV || !bitsGV->hasInitializer() || !width)
+    return false;
+
+  llvm::ConstantDataArray* bytes = llvm::dyn_cast<llvm::ConstantDataArray>(bitsGV->getInitializer());
+  if (!bytes)
+    return false;
+
+  for (uint64_t i = 0; i < width->getZExtValue(); i++)
+    if (bytes->getElementAsInteger(i / 8) & (1 << (i % 8)))
+      bits.insert(i);
+
+  return true;
+}
+
+/*
+collect every vptr location a check accepts. This mirrors the lowering done
+in SDSubstModule, including the inclusive upper bound of the range checks.
+With exact set, only the vtables the range was built from are collected.
+*/
+static inline bool sd_getCheckLocations(llvm::CallInst* check, std::set<sd_vptr_loc_t>& locs,
+                                        bool exact = false) {
+  llvm::Constant* start        = llvm::dyn_cast<llvm::Constant>(check->getArgOperand(1));
+  llvm::ConstantInt* width     = llvm::dyn_cast<llvm::ConstantInt>(check->getArgOperand(2));
+  llvm::ConstantInt* alignment = llvm::dyn_cast<llvm::ConstantInt>(check->getArgOperand(3));
+  llvm::GlobalVariable* gv;
+  uint64_t off;
+
+  if (!start || !width || !alignment || !sd_getRangeStartOffset(start, gv, off))
+    return false;
+
+  uint64_t align = alignment->getZExtValue();
+
+  if (llvm::cast<llvm::IntrinsicInst>(check)->getIntrinsicID() == llvm::Intrinsic::sd_subst_check_bitset) {
+    std::set<uint64_t> bits;
+    if (!sd_getBitSetBits(check, bits))
+      return false;
+
+    for (uint64_t bit : bits)
+      locs.insert(sd_vptr_loc_t(gv, off + bit * align));
+  } else if (width->getSExtValue() > 1) {
+    uint64_t last = exact ? width->getZExtValue() - 1 : width->getZExtValue();
+    for (uint64_t k = 0; k <= last; k++)
+      locs.insert(sd_vptr_loc_t(gv, off + k * align));
+  } else {
+    locs.insert(sd_vptr_loc_t(gv, off));
+  }
+
+  return true;
+}
+
+static inline bool sd_getChainLocations(const sd_check_chain_t& chain, std::set<sd_vptr_loc_t>& locs,
+                                        bool exact = false) {
+  for (llvm::CallInst* check : chain.checks)
+    if (!sd_getCheckLocations(check, locs, exact))
+      return false;
+  return true;
+}
+
+/*
+decompose a constant vptr into its vtable and byte offset. Constructors store
+the new vptrs as constant expressions over _SD<root>, either as a GEP or as
+inttoptr(add(ptrtoint(_SD<root>), off)).
+*/
+static inline bool sd_getConstVptrLoc(llvm::Value* V, const llvm::DataLayout& DL, sd_vptr_loc_t& loc) {
+  int64_t off = 0;
+
+  while (llvm::ConstantExpr* CE = llvm::dyn_cast<llvm::ConstantExpr>(V)) {
+    if (CE->isCast()) {
+      V = CE->getOperand(0);
+    } else if (CE->getOpcode() == llvm::Instruction::Add &&
+               llvm::isa<llvm::ConstantInt>(CE->getOperand(1))) {
+      off += llvm::cast<llvm::ConstantInt>(CE->getOperand(1))->getSExtValue();
+      V = CE->getOperand(0);
+    } else if (CE->getOpcode() == llvm::Instruction::GetElementPtr) {
+      llvm::APInt gepOff(DL.getPointerSizeInBits(0), 0);
+      if (!llvm::cast<llvm::GEPOperator>(CE)->accumulateConstantOffset(DL, gepOff))
+        return false;
+      off += gepOff.getSExtValue();
+      V = CE->getOperand(0);
+    } else {
+      return false;
+    }
+  }
+
+  llvm::GlobalVariable* gv = llvm::dyn_cast<llvm::GlobalVariable>(V);
+  if (!gv || off < 0)
+    return false;
+
+  loc = sd_vptr_loc_t(gv, off);
+  return true;
+}
+
+static inline void sd_setCheckSiteId(llvm::CallInst* check, uint32_t id) {
+  llvm::LLVMContext& C = check->getContext();
+  check->setMetadata(SD_MD_CHECK_SITE, llvm::MDNode::get(C, llvm::ConstantAsMetadata::get(
+                     llvm::ConstantInt::get(llvm::Type::getInt32Ty(C), id))));
+}
+
+static inline bool sd_getCheckSiteId(const llvm::Instruction* check, uint32_t& id) {
+  llvm::MDNode* MD = check->getMetadata(SD_MD_CHECK_SITE);
+  if (!MD)
+    return false;
+
+  id = llvm::mdconst::extract<llvm::ConstantInt>(MD->getOperand(0))->getZExtValue();
+  return true;
+}
+
+/*
+find all check chains in F. A chain starts at a block whose conditional branch
+tests a check intrinsic and which is not itself a fail block of another chain.
+*/
+static inline void sd_collectCheckChains(llvm::Function& F, std::vector<sd_check_chain_t>& chains) {
+  std::set<llvm::BasicBlock*> failBlocks;
+  std::vector<sd_check_chain_t> candidates;
+
+  for (llvm::BasicBlock& BB : F) {
+    llvm::BranchInst* BI = llvm::dyn_cast<llvm::BranchInst>(BB.getTerminator());
+    if (!BI || !BI->isConditional() || !sd_getCheckIntrinsic(BI->getCondition()))
+      continue;
+
+    sd_check_chain_t chain;
+    chain.head = &BB;
+    chain.success = BI->getSuccessor(0);
+    chain.vptr = sd_getCheckIntrinsic(BI->getCondition())->getArgOperand(0)->stripPointerCasts();
+
+    llvm::BasicBlock* cur = &BB;
+    llvm::CallInst* check;
+    bool wellFormed = true;
+
+    while ((check = sd_getChainCheck(cur, chain.success))) {
+      if (check->getArgOperand(0)->stripPointerCasts() != chain.vptr) {
+        wellFormed = false;
+        break;
+      }
+
+      chain.checks.push_back(check);
+      cur = llvm::cast<llvm::BranchInst>(cur->getTerminator())->getSuccessor(1);
+
+      if (!cur->getSinglePredecessor()) {
+        wellFormed = false;
+        break;
+      }
+      chain.fails.push_back(cur);
+    }
+
+    // the chain has to end in the trap block
+    if (!wellFormed || !llvm::isa<llvm::UnreachableInst>(cur->getTerminator()))
+      continue;
+
+    failBlocks.insert(chain.fails.begin(), chain.fails.end());
+    candidates.push_back(chain);
+  }
+
+  for (const sd_check_chain_t& chain : candidates)
+    if (!failBlocks.count(chain.head))
+      chains.push_back(chain);
+}
+
+/*
+make the head of the chain branch straight to the success block. The fail
+blocks become unreachable and are left for removeUnreachableBlocks, the
+returned first check is dead once they are gone.
+*/
+static inline llvm::CallInst* sd_bypassCheckChain(sd_check_chain_t& chain) {
+  llvm::TerminatorInst* oldTerminator = chain.head->getTerminator();
+
+  llvm::BranchInst::Create(chain.success, oldTerminator);
+  oldTerminator->eraseFromParent();
+
+  return chain.checks[0];
+}
+
+/*
+emit a copy of the checks of chain on vptr in front of insertPt, in the same
+shape SDUpdateIndices produces: one conditional branch per check, all leading
+to the block starting at insertPt, and a trap at the end. Returns the head.
+*/
+static inline llvm::BasicBlock* sd_emitCheckChain(const sd_check_chain_t& chain, llvm::Value* vptr,
+                                                  llvm::Instruction* insertPt) {
+  llvm::BasicBlock* head = insertPt->getParent();
+  llvm::Function* F = head->getParent();
+  llvm::Module* M = F->getParent();
+  llvm::LLVMContext& C = M->getContext();
+
+  llvm::BasicBlock* successBB = llvm::SplitBlock(head, insertPt);
+  llvm::TerminatorInst* oldTerminator = head->getTerminator();
+  llvm::IRBuilder<> builder(oldTerminator);
+  llvm::Value* castVptr = builder.CreateBitCast(vptr, llvm::IntegerType::getInt8PtrTy(C));
+  int i = 0;
+
+  for (llvm::CallInst* check : chain.checks) {
+    llvm::SmallVector<llvm::Value*, 5> args(check->arg_operands().begin(), check->arg_operands().end());
+    args[0] = castVptr;
+
+    llvm::CallInst* success = builder.CreateCall(check->getCalledFunction(), args);
+
+    // keep the annotations of the original check (range index, site id)
+    llvm::SmallVector<std::pair<unsigned, llvm::MDNode*>, 4> MDs;
+    check->getAllMetadataOtherThanDebugLoc(MDs);
+    for (auto& MD : MDs)
+      success->setMetadata(MD.first, MD.second);
+    success->setDebugLoc(check->getDebugLoc());
+
+    char blockName[256];
+    snprintf(blockName, sizeof(blockName), "sd.fastcheck.fail.%d", i++);
+
+    llvm::BasicBlock* fastCheckFailed = llvm::BasicBlock::Create(C, blockName, F);
+    llvm::BranchInst* BI = builder.CreateCondBr(success, successBB, fastCheckFailed);
+    llvm::MDBuilder MDB(C);
+    BI->setMetadata(llvm::LLVMContext::MD_prof, MDB.createBranchWeights(
+                                                std::numeric_limits<uint32_t>::max(),
+                                                std::numeric_limits<uint32_t>::min()));
+    builder.SetInsertPoint(fastCheckFailed);
+  }
+
+  builder.CreateCall(llvm::Intrinsic::getDeclaration(M, llvm::Intrinsic::trap));
+  builder.CreateUnreachable();
+  oldTerminator->eraseFromParent();
+
+  return head;
+}
+
+#endif
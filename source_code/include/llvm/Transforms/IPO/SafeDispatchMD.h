@@ -21,11 +21,21 @@
 #define SD_MD_MEMPTR2    "sd.memptr2"     // class name, annotate the member pointer 2 
 #define SD_MD_MEMPTR_OPT "sd.memptr3"     // class name, annotate the member pointer 3
 #define SD_MD_CHECK      "sd.check"       // class name, annotate the check 
+#define SD_MD_FINAL      "sd.final"       // "class" and/or "method", what is final at a checked call
+#define SD_MD_RET_SITE   "sd.ret.site"    // lowest and highest function ID a call site may return from
+#define SD_MD_RET_SITE_ID "sd.ret.site.id" // call site ID looked up in the return tables
+#define SD_MD_CALL_SITE  "sd.call.site"   // distinct node shared by sd_get_checked_vptr and its virtual call
 
 /**
  * named md used to store the vtable info
  */
 #define SD_MD_CLASSINFO  "sd.class_info." 
 
+/**
+ * function attribute holding the first function ID of a function whose
+ * returns SDReturnRange checks, read again when the call sites are marked
+ */
+#define SD_ATTR_RET_RANGE "sd.ret.range"
+
 #endif
 
@@ -0,0 +1,95 @@
+#ifndef LLVM_TRANSFORMS_IPO_SAFEDISPATCH_PROFILE_H
+#define LLVM_TRANSFORMS_IPO_SAFEDISPATCH_PROFILE_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+per call site profile of which range of a range check chain matched. The
+profile is a text file with one line per checked call site:
+
+  <function> <file>:<line>:<col> <hits of range 0> <hits of range 1> ...
+
+ranges are numbered in width order (widest first), which is the order the
+chain is emitted in without a profile. Lines starting with '#' are comments.
+A site inlined into another function gets the call it was inlined at
+appended, innermost first, as <file>:<line>:<col>@<file>:<line>:<col>..., so
+the copies of a site inlined at different calls get their own lines.
+Sites without debug info are keyed as <function> ?#<n>, n counts the
+sd_get_checked_vptr calls of the function in instruction order.
+*/
+
+typedef std::map<std::string, std::vector<uint64_t> > sd_check_profile_t;
+
+// metadata attached to every range check, holding its width order index
+#define SD_MD_RANGE_INDEX "sd.range.index"
+
+// metadata attached to sd_get_checked_vptr and its checks, holding the
+// ordinal of the site in its function
+#define SD_MD_SITE_ORDINAL "sd.site.ordinal"
+
+static inline std::string sd_getCheckSiteKey(const llvm::Instruction* I) {
+  std::string key;
+  llvm::raw_string_ostream os(key);
+
+  os << I->getParent()->getParent()->getName() << " ";
+
+  if (llvm::MDLocation* loc = I->getDebugLoc().get()) {
+    os << loc->getFilename() << ":" << loc->getLine() << ":" << loc->getColumn();
+    for (loc = loc->getInlinedAt(); loc; loc = loc->getInlinedAt())
+      os << "@" << loc->getFilename() << ":" << loc->getLine() << ":" << loc->getColumn();
+  } else if (llvm::MDNode* ordinal = I->getMetadata(SD_MD_SITE_ORDINAL))
+    os << "?#" << llvm::mdconst::extract<llvm::ConstantInt>(ordinal->getOperand(0))->getZExtValue();
+  else
+    os << "?:0:0";
+
+  return os.str();
+}
+
+static inline bool sd_readCheckProfile(llvm::StringRef path, sd_check_profile_t& profile) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > buf = llvm::MemoryBuffer::getFile(path);
+  if (!buf)
+    return false;
+
+  llvm::SmallVector<llvm::StringRef, 16> lines;
+  (*buf)->getBuffer().split(lines, "\n", -1, false);
+
+  for (llvm::StringRef line : lines) {
+    line = line.trim();
+    if (line.empty() || line.startswith("#"))
+      continue;
+
+    llvm::SmallVector<llvm::StringRef, 8> fields;
+    line.split(fields, " ", -1, false);
+    if (fields.size() < 3)
+      continue;
+
+    std::vector<uint64_t>& counts = profile[(fields[0] + " " + fields[1]).str()];
+
+    for (unsigned i = 2; i < fields.size(); i++) {
+      uint64_t count;
+      if (fields[i].getAsInteger(10, count))
+        count = 0;
+
+      // the same site may show up more than once, e.g. from several runs
+      if (counts.size() <= i - 2)
+        counts.push_back(0);
+      counts[i - 2] += count;
+    }
+  }
+
+  return true;
+}
+
+#endif
@@ -1,13 +1,17 @@
 #ifndef LLVM_TRANSFORMS_IPO_SAFEDISPATCH_TOOLS_H
 #define LLVM_TRANSFORMS_IPO_SAFEDISPATCH_TOOLS_H
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Constants.h"
 
 #include <string>
 
 #include "SafeDispatchLog.h"
+#include "SafeDispatchMD.h"
 
 /*Paul:
 helper method from the one underneath
@@ -37,5 +41,54 @@ static bool sd_isVtableName(std::string& className) {
 
   return sd_isVtableName_ref(name);
 }
+/**
+ * The virtual calls that clang linked to their sd_get_checked_vptr intrinsic
+ * with a shared sd.call.site node, by function and node. A node that is found
+ * twice in a function (the vcall was duplicated by an optimization) maps to
+ * NULL, the passes fall back to searching the users of those intrinsics.
+ */
+typedef llvm::DenseMap<std::pair<const llvm::Function*, const llvm::MDNode*>,
+                       llvm::Instruction*> sd_linked_calls_t;
+
+/**
+ * Fills linkedCalls, only the functions that call the intrinsic are scanned.
+ */
+static inline void sd_collectLinkedCalls(const llvm::Function* intrinsic,
+                                         sd_linked_calls_t& linkedCalls) {
+  llvm::SmallPtrSet<const llvm::Function*, 64> functions;
+  for (const llvm::User* U : intrinsic->users())
+    if (const llvm::CallInst* CI = llvm::dyn_cast<llvm::CallInst>(U))
+      if (CI->getMetadata(SD_MD_CALL_SITE))
+        functions.insert(CI->getParent()->getParent());
+
+  for (const llvm::Function* F : functions) {
+    for (const llvm::BasicBlock& BB : *F) {
+      for (const llvm::Instruction& I : BB) {
+        if (!llvm::isa<llvm::CallInst>(&I) && !llvm::isa<llvm::InvokeInst>(&I))
+          continue;
+        const llvm::MDNode* site = I.getMetadata(SD_MD_CALL_SITE);
+        if (!site || llvm::isa<llvm::IntrinsicInst>(&I))
+          continue;
+
+        auto inserted = linkedCalls.insert(std::make_pair(std::make_pair(F, site),
+                                           const_cast<llvm::Instruction*>(&I)));
+        if (!inserted.second)
+          inserted.first->second = NULL;
+      }
+    }
+  }
+}
+
+/**
+ * The virtual call linked to the sd_get_checked_vptr call CI, or NULL.
+ */
+static inline llvm::Instruction* sd_getLinkedCall(const llvm::CallInst* CI,
+                                                  const sd_linked_calls_t& linkedCalls) {
+  const llvm::MDNode* site = CI->getMetadata(SD_MD_CALL_SITE);
+  if (!site)
+    return NULL;
+  return linkedCalls.lookup(std::make_pair(CI->getParent()->getParent(), site));
+}
+
 #endif
 
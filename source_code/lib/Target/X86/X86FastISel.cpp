@@ -2807,6 +2807,12 @@ bool X86FastISel::fastLowerCall(CallLoweringInfo &CLI) {
   bool Is64Bit        = Subtarget->is64Bit();
   bool IsWin64        = Subtarget->isCallingConvWin64(CC);
 
+  // SafeDispatch return sites need the marker X86TargetLowering::LowerCall
+  // glues to the call.
+  if (CLI.CS && (CLI.CS->getInstruction()->getMetadata("sd.ret.site") ||
+                 CLI.CS->getInstruction()->getMetadata("sd.ret.site.id")))
+    return false;
+
   // Handle only C, fastcc, and webkit_js calling conventions for now.
   switch (CC) {
   default: return false;
@@ -1487,6 +1487,9 @@ X86TargetLowering::X86TargetLowering(const X86TargetMachine &TM,
   setOperationAction(ISD::INTRINSIC_VOID, MVT::Other, Custom);
   if (!Subtarget->is64Bit())
     setOperationAction(ISD::INTRINSIC_W_CHAIN, MVT::i64, Custom);
+  // SafeDispatch range checks left in the IR by -sd-native-checks.
+  if (Subtarget->is64Bit())
+    setOperationAction(ISD::INTRINSIC_WO_CHAIN, MVT::i1, Custom);
 
   // Only custom-lower 64-bit SADDO and friends on 64-bit because we don't
   // handle type legalization for these operations here.
@@ -2708,6 +2711,15 @@ X86TargetLowering::LowerCall(TargetLowering::CallLoweringInfo &CLI,
   if (MF.getTarget().Options.DisableTailCalls)
     isTailCall = false;
 
+  // A SafeDispatch return site, see SD_MD_RET_SITE and SD_MD_RET_SITE_ID in
+  // SafeDispatchMD.h, has to return here to find the markers after the call.
+  MDNode *SDRetSite = CLI.CS && Is64Bit ?
+    CLI.CS->getInstruction()->getMetadata("sd.ret.site") : nullptr;
+  MDNode *SDRetSiteID = CLI.CS && Is64Bit ?
+    CLI.CS->getInstruction()->getMetadata("sd.ret.site.id") : nullptr;
+  if (SDRetSite || SDRetSiteID)
+    isTailCall = false;
+
   bool IsMustTail = CLI.CS && CLI.CS->isMustTailCall();
   if (IsMustTail) {
     // Force this to be a tail call.  The verifier rules are enough to ensure
@@ -3125,6 +3137,27 @@ X86TargetLowering::LowerCall(TargetLowering::CallLoweringInfo &CLI,
   Chain = DAG.getNode(X86ISD::CALL, dl, NodeTys, Ops);
   InFlag = Chain.getValue(1);
 
+  // Glue the return site marker to the call, so nothing is scheduled between
+  // them. It holds the lowest and highest function ID the call may reach.
+  if (SDRetSite) {
+    uint64_t Lo = mdconst::extract<ConstantInt>(SDRetSite->getOperand(0))->getZExtValue();
+    uint64_t Hi = mdconst::extract<ConstantInt>(SDRetSite->getOperand(1))->getZExtValue();
+    SDValue MarkerOps[] = { DAG.getTargetConstant(Lo | (Hi << 32), MVT::i64),
+                            Chain, InFlag };
+    SDNode *Marker = DAG.getMachineNode(X86::SD_RET_SITE, dl, MVT::Other,
+                                        MVT::Glue, MarkerOps);
+    Chain = SDValue(Marker, 0);
+    InFlag = SDValue(Marker, 1);
+  }
+  if (SDRetSiteID) {
+    uint64_t ID = mdconst::extract<ConstantInt>(SDRetSiteID->getOperand(0))->getZExtValue();
+    SDValue MarkerOps[] = { DAG.getTargetConstant(ID, MVT::i32), Chain, InFlag };
+    SDNode *Marker = DAG.getMachineNode(X86::SD_RET_SITE_ID, dl, MVT::Other,
+                                        MVT::Glue, MarkerOps);
+    Chain = SDValue(Marker, 0);
+    InFlag = SDValue(Marker, 1);
+  }
+
   // Create the CALLSEQ_END node.
   unsigned NumBytesForCalleeToPop;
   if (X86::isCalleePop(CallConv, Is64Bit, isVarArg,
@@ -13482,6 +13515,9 @@ static bool isX86LogicalCmp(SDValue Op) {
   if (Op.getResNo() == 2 && Opc == X86ISD::UMUL)
     return true;
 
+  if (Op.getResNo() == 1 && Opc == X86ISD::SD_CHECK_RANGE)
+    return true;
+
   return false;
 }
 
@@ -15156,6 +15192,43 @@ static SDValue LowerINTRINSIC_WO_CHAIN(SDValue Op, const X86Subtarget *Subtarget
   }
 }
 
+/// Lower llvm.sd.subst.check.range(vptr, start, width, alignment), i.e.
+/// rotr(vptr - start, log2(alignment)) <= width, or vptr == start for a
+/// single vtable. The range check becomes the SD_CHECK_RANGE pseudo, so the
+/// compare that sets the flags stays the last instruction before the branch
+/// and can be fused with it.
+static SDValue LowerSDCheckRange(SDValue Op, SelectionDAG &DAG) {
+  SDLoc dl(Op);
+  SDValue Vptr = Op.getOperand(1);
+  SDValue Start = Op.getOperand(2);
+  uint64_t Width = cast<ConstantSDNode>(Op.getOperand(3))->getZExtValue();
+  uint64_t Alignment = cast<ConstantSDNode>(Op.getOperand(4))->getZExtValue();
+  unsigned Shift = Log2_64(Alignment);
+  SDValue Flags;
+  X86::CondCode Cond = X86::COND_BE;
+
+  if (Width <= 1) {
+    Flags = DAG.getNode(X86ISD::CMP, dl, MVT::i32, Vptr, Start);
+    Cond = X86::COND_E;
+  } else if (isInt<32>(Width)) {
+    SDVTList VTs = DAG.getVTList(MVT::i64, MVT::i32);
+    Flags = DAG.getNode(X86ISD::SD_CHECK_RANGE, dl, VTs, Vptr, Start,
+                        DAG.getConstant(Shift, MVT::i8),
+                        DAG.getConstant(Width, MVT::i64)).getValue(1);
+  } else {
+    // The width does not fit the compare immediate.
+    SDValue Diff = DAG.getNode(ISD::SUB, dl, MVT::i64, Vptr, Start);
+    SDValue Rot = DAG.getNode(ISD::ROTR, dl, MVT::i64, Diff,
+                              DAG.getConstant(Shift, MVT::i8));
+    Flags = DAG.getNode(X86ISD::CMP, dl, MVT::i32, Rot,
+                        DAG.getConstant(Width, MVT::i64));
+  }
+
+  SDValue SetCC = DAG.getNode(X86ISD::SETCC, dl, MVT::i8,
+                              DAG.getConstant(Cond, MVT::i8), Flags);
+  return DAG.getNode(ISD::TRUNCATE, dl, Op.getValueType(), SetCC);
+}
+
 static SDValue getGatherNode(unsigned Opc, SDValue Op, SelectionDAG &DAG,
                               SDValue Src, SDValue Mask, SDValue Base,
                               SDValue Index, SDValue ScaleOp, SDValue Chain,
@@ -17518,6 +17591,12 @@ void X86TargetLowering::ReplaceNodeResults(SDNode *N,
     Results.push_back(V);
     return;
   }
+  case ISD::INTRINSIC_WO_CHAIN: {
+    unsigned IntNo = cast<ConstantSDNode>(N->getOperand(0))->getZExtValue();
+    if (IntNo == Intrinsic::sd_subst_check_range)
+      Results.push_back(LowerSDCheckRange(SDValue(N, 0), DAG));
+    return;
+  }
   case ISD::INTRINSIC_W_CHAIN: {
     unsigned IntNo = cast<ConstantSDNode>(N->getOperand(1))->getZExtValue();
     switch (IntNo) {
@@ -17757,6 +17836,7 @@ const char *X86TargetLowering::getTargetNodeName(unsigned Opcode) const {
   case X86ISD::AND:                return "X86ISD::AND";
   case X86ISD::BEXTR:              return "X86ISD::BEXTR";
   case X86ISD::MUL_IMM:            return "X86ISD::MUL_IMM";
+  case X86ISD::SD_CHECK_RANGE:     return "X86ISD::SD_CHECK_RANGE";
   case X86ISD::PTEST:              return "X86ISD::PTEST";
   case X86ISD::TESTP:              return "X86ISD::TESTP";
   case X86ISD::TESTM:              return "X86ISD::TESTM";
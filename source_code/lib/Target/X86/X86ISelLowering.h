@@ -323,6 +323,12 @@ namespace llvm {
       // X86-specific multiply by immediate.
       MUL_IMM,
 
+      // SafeDispatch vptr range check, TMP, EFLAGS = sd_check_range VPTR,
+      // START, SHIFT, WIDTH. Expanded after register allocation into
+      // sub START, TMP; ror SHIFT, TMP; cmp WIDTH, TMP. The vptr is in the
+      // range when the flags say below or equal.
+      SD_CHECK_RANGE,
+
       // Vector bitwise comparisons.
       PTEST,
 
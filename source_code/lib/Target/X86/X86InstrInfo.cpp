@@ -4656,6 +4656,34 @@ static void expandLoadStackGuard(MachineInstrBuilder &MIB,
   MIB.addReg(Reg, RegState::Kill).addImm(1).addReg(0).addImm(0).addReg(0);
 }
 
+/// Expand the SafeDispatch range check pseudo into
+///   sub  start, tmp
+///   ror  shift, tmp
+///   cmp  width, tmp
+/// tmp holds the vptr on entry (tied operand). The rotate is left out for
+/// vtables aligned to a single byte.
+static bool expandSDCheckRange(MachineInstrBuilder &MIB,
+                               const TargetInstrInfo &TII) {
+  MachineInstr *MI = MIB;
+  MachineBasicBlock &MBB = *MI->getParent();
+  DebugLoc DL = MI->getDebugLoc();
+  unsigned Reg = MI->getOperand(0).getReg();
+  bool RegDead = MI->getOperand(0).isDead();
+  int64_t Shift = MI->getOperand(3).getImm();
+  int64_t Width = MI->getOperand(4).getImm();
+
+  BuildMI(MBB, MI, DL, TII.get(X86::SUB64rr), Reg)
+    .addReg(Reg).addOperand(MI->getOperand(2));
+  if (Shift != 0)
+    BuildMI(MBB, MI, DL, TII.get(X86::ROR64ri), Reg)
+      .addReg(Reg).addImm(Shift);
+  BuildMI(MBB, MI, DL, TII.get(isInt<8>(Width) ? X86::CMP64ri8 : X86::CMP64ri32))
+    .addReg(Reg, getKillRegState(RegDead)).addImm(Width);
+
+  MI->eraseFromParent();
+  return true;
+}
+
 bool X86InstrInfo::expandPostRAPseudo(MachineBasicBlock::iterator MI) const {
   bool HasAVX = Subtarget.hasAVX();
   MachineInstrBuilder MIB(*MI->getParent()->getParent(), MI);
@@ -4693,6 +4721,8 @@ bool X86InstrInfo::expandPostRAPseudo(MachineBasicBlock::iterator MI) const {
   case TargetOpcode::LOAD_STACK_GUARD:
     expandLoadStackGuard(MIB, *this);
     return true;
+  case X86::SD_CHECK_RANGE64:
+    return expandSDCheckRange(MIB, *this);
   }
   return false;
 }
@@ -1117,6 +1117,20 @@ void X86AsmPrinter::EmitInstruction(const MachineInstr *MI) {
   case TargetOpcode::PATCHPOINT:
     return LowerPATCHPOINT(*MI, MCInstLowering);
 
+  case X86::SD_RET_SITE:
+    OutStreamer->AddComment("SafeDispatch return site");
+    EmitAndCountInstruction(MCInstBuilder(X86::MOV64ri)
+                            .addReg(X86::R11)
+                            .addImm(MI->getOperand(0).getImm()));
+    return;
+
+  case X86::SD_RET_SITE_ID:
+    OutStreamer->AddComment("SafeDispatch return site ID");
+    EmitAndCountInstruction(MCInstBuilder(X86::MOV32ri)
+                            .addReg(X86::R11D)
+                            .addImm(MI->getOperand(0).getImm()));
+    return;
+
   case X86::MORESTACK_RET:
     EmitAndCountInstruction(MCInstBuilder(getRetOpcode(*Subtarget)));
     return;
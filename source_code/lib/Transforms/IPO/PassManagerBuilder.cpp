@@ -105,6 +105,10 @@ PassManagerBuilder::PassManagerBuilder() {
     EmitIVTBLs = false;
     EmitOVTBLs = false;
     EmitReturnChecks = false;
+    EmitReturnRangeChecks = false;
+    EmitReturnTableChecks = false;
+    EmitBitsetChecks = false;
+    EmitShadowStack = false;
 }
 
 PassManagerBuilder::~PassManagerBuilder() {
@@ -531,7 +535,7 @@ void PassManagerBuilder::populateLTOPassManager(legacy::PassManagerBase &PM) {
     addLTOOptimizationPasses(PM);
 
   //Paul: emit interleaved or ordered v tables
-  if (EmitIVTBLs || EmitOVTBLs || EmitReturnChecks) {
+  if (EmitIVTBLs || EmitOVTBLs || EmitReturnChecks || EmitReturnRangeChecks) {
     // Lets get the sd passes out of the way
     // Remove unused vtables (pure virtual or unrereferenced) before interleaving
     PM.add(createGlobalDCEPass());
@@ -540,16 +544,35 @@ void PassManagerBuilder::populateLTOPassManager(legacy::PassManagerBase &PM) {
     PM.add(llvm::createSDFixPass());
     PM.add(llvm::createSDBuildCHAPass());
 
-    if (EmitReturnChecks) {
+    if (EmitReturnChecks)
       PM.add(llvm::createSDAnalysisPass());
-    }
+    //check on return that the call site may call the returning virtual function,
+    //the call sites are marked at the end
+    if (EmitReturnRangeChecks)
+      PM.add(llvm::createSDReturnRangePass());
     if (EmitIVTBLs || EmitOVTBLs) {
       PM.add(llvm::createSDLayoutBuilderPass(EmitIVTBLs));
-      PM.add(llvm::createSDUpdateIndicesPass());
+      PM.add(llvm::createSDUpdateIndicesPass(EmitBitsetChecks));
+      //move loop invariant checks out of loops, then remove checks
+      //dominated by an equivalent check before lowering them
+      PM.add(llvm::createSDCheckHoistPass());
+      PM.add(llvm::createSDCheckElimPass());
+      //turn checked calls with only a few possible targets into direct calls
+      PM.add(llvm::createSDDevirtPass());
+      //drop the checks on objects whose vtable is known from their constructor
+      PM.add(llvm::createSDKnownTypePass());
+      //drop the checks callees repeat on objects their callers already checked,
+      //after SDDevirt: only direct calls are followed into the callee
+      PM.add(llvm::createSDCheckedThisPass());
+      //validate the vptrs of loops over object arrays before the loop, a block at a time
+      PM.add(llvm::createSDBatchCheckPass());
       //Paul: this pass adds the checks
       PM.add(llvm::createSDSubstModulePass());
     }
   }
+  //protect the returns with a shadow stack, the baseline for the return checks
+  if (EmitShadowStack)
+    PM.add(llvm::createSDShadowStackPass());
   PM.add(createSDCleanupPass());
 
   // Lower bit sets to globals. This pass supports Clang's control flow
@@ -560,11 +583,19 @@ void PassManagerBuilder::populateLTOPassManager(legacy::PassManagerBase &PM) {
   if (OptLevel != 0)
     addLateLTOOptimizationPasses(PM);
 
-  if (EmitIVTBLs || EmitOVTBLs || EmitReturnChecks) {
+  if (EmitIVTBLs || EmitOVTBLs || EmitReturnChecks || EmitReturnRangeChecks) {
      //Paul: this pass moves some bb
     PM.add(llvm::createSDMoveBasicBlocksPass());
   }
 
+  //the return site markers go on the calls code generation gets, no later
+  //pass may merge two calls and drop a marker
+  if (EmitReturnRangeChecks)
+    PM.add(llvm::createSDReturnRangePass(true));
+  //check on return that a non-virtual function returns to one of its call sites
+  if (EmitReturnTableChecks)
+    PM.add(llvm::createSDReturnTablePass());
+
   if (VerifyOutput)
     PM.add(createVerifierPass());
 }
@@ -11,19 +11,42 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "llvm/ADT/SparseBitVector.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/Demangle/Demangle.h"
 #include "llvm/IR/DebugInfo.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/Mutex.h"
 #include "llvm/Transforms/IPO/SafeDispatchLayoutBuilder.h"
 #include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
 #include "llvm/Transforms/IPO/SafeDispatchTools.h"
 
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Path.h>
+#include <array>
+#include <chrono>
 #include <fstream>
 #include <sstream>
+#if LLVM_ENABLE_THREADS
+#include <atomic>
+#include <thread>
+#endif
 
 using namespace llvm;
 
+static cl::opt<bool>
+SDAnalysisCompact("sd-analysis-compact", cl::init(false),
+                  cl::desc("Write the SDAnalysis metric results with every target set stored once "
+                           "(read with scripts/sd_analysis_to_csv.py)"));
+
+static cl::opt<unsigned>
+SDAnalysisThreads("sd-analysis-threads", cl::init(0),
+                  cl::desc("Number of threads SDAnalysis analyses the CallSites on "
+                           "(0: one per hardware thread)"));
+
 static const std::string itaniumConstructorTokens[3] = {"C0Ev", "C1Ev", "C2Ev"};
 
 static StringRef sd_getClassNameFromMD(llvm::MDNode *MDNode, unsigned operandNo = 0) {
@@ -217,9 +240,11 @@ private:
         int64_t HierarchyIslandMatches = -1;
     };
 
-    typedef std::set<SDBuildCHA::func_name_t> func_name_set;
-    typedef std::map<uint64_t, SDBuildCHA::func_name_t> offset_to_func_name;
-    typedef std::map<uint64_t, std::set<SDBuildCHA::func_name_t>> offset_to_func_name_set;
+    /** target sets hold the IDs of interned function names, see internFunctionNames */
+    typedef unsigned func_id_t;
+    typedef SparseBitVector<> func_name_set;
+    typedef std::map<uint64_t, func_id_t> offset_to_func_name;
+    typedef std::map<uint64_t, func_name_set> offset_to_func_name_set;
     typedef std::pair<std::string, uint64_t> preciseFunctionSignature_t;
 
     SDBuildCHA *CHA{};
@@ -232,6 +257,91 @@ private:
     std::map<float, std::vector<CallSiteInfo>> MetricVirtual{};
     std::map<float, std::vector<CallSiteInfo>> MetricIndirect{};
 
+    // function names by ID, IDs are given out in name order so target sets iterate sorted by name
+    std::vector<SDBuildCHA::func_name_t> FunctionNames{};
+    StringMap<func_id_t> FunctionIDs{};
+
+    /**
+     * Memoizes the function name part of demangled names for all phases.
+     * Interned names are cached by ID, other names (e.g. from the metadata
+     * of a call site) by name. Lookups may come from the analysis threads,
+     * the demangling itself runs outside the lock.
+     */
+    class DemangleCache {
+    public:
+        void reset(const StringMap<func_id_t> &_FunctionIDs, size_t Count) {
+            FunctionIDs = &_FunctionIDs;
+            ByID.assign(Count, "");
+            KnownByID.assign(Count, false);
+            ByName.clear();
+            Hits = Misses = 0;
+            DemangleTime = std::chrono::nanoseconds(0);
+        }
+
+        /** the demangled function name of Name, or Name if it does not demangle */
+        const std::string &get(StringRef Name) {
+            auto Interned = FunctionIDs->find(Name);
+            bool IsInterned = Interned != FunctionIDs->end();
+            {
+                sys::ScopedLock Lock(CacheMutex);
+                if (IsInterned && KnownByID[Interned->second]) {
+                    Hits++;
+                    return ByID[Interned->second];
+                }
+                auto Known = ByName.find(Name);
+                if (!IsInterned && Known != ByName.end()) {
+                    Hits++;
+                    return Known->second;
+                }
+            }
+
+            auto Start = std::chrono::steady_clock::now();
+            std::string Demangled = Name;
+            int Status = 0;
+            if (Name.startswith("_")) {
+                auto DemangledPair = itaniumDemanglePair(Name, Status);
+                if (Status == 0 && DemangledPair.second != "") {
+                    Demangled = DemangledPair.second;
+                }
+            }
+            auto Time = std::chrono::steady_clock::now() - Start;
+
+            sys::ScopedLock Lock(CacheMutex);
+            Misses++;
+            DemangleTime += std::chrono::duration_cast<std::chrono::nanoseconds>(Time);
+            if (IsInterned) {
+                if (!KnownByID[Interned->second]) {
+                    ByID[Interned->second] = Demangled;
+                    KnownByID[Interned->second] = true;
+                }
+                return ByID[Interned->second];
+            }
+            return ByName.insert(std::make_pair(Name, Demangled)).first->second;
+        }
+
+        void report() const {
+            uint64_t Lookups = Hits + Misses;
+            double Milliseconds = DemangleTime.count() / 1e6;
+            double Saved = Misses ? Milliseconds * Hits / Misses : 0;
+            sdLog::stream() << "Demangle cache: " << Lookups << " lookups, " << Hits << " hits ("
+                            << (Lookups ? Hits * 100 / Lookups : 0) << "%), "
+                            << Misses << " names demangled in " << format("%.1f", Milliseconds)
+                            << " ms, about " << format("%.1f", Saved) << " ms saved\n";
+        }
+
+    private:
+        const StringMap<func_id_t> *FunctionIDs = nullptr;
+        std::vector<std::string> ByID;
+        std::vector<bool> KnownByID;
+        StringMap<std::string> ByName;
+        sys::Mutex CacheMutex;
+        uint64_t Hits = 0;
+        uint64_t Misses = 0;
+        std::chrono::nanoseconds DemangleTime{0};
+    };
+
+    mutable DemangleCache Demangled{};
+
     func_name_set AllFunctions{};           // baseline
     func_name_set AllVFunctions{};          // baseline virtual functions
 
@@ -272,6 +382,7 @@ private:
 
         // setup CHA info
         CHA = &getAnalysis<SDBuildCHA>();
+        internFunctionNames(M);
         analyseCHA();
         computeVTableIslands();
         findAllVFunctions();
@@ -288,12 +399,225 @@ private:
         applyCallSiteMetric();
         // store the analysis data
         storeData(M);
+        Demangled.report();
 
         sdLog::stream() << sdLog::newLine << "P7a. Finished running the SDAnalysis pass ..." << "\n";
         sdLog::blankLine();
         return false;
     }
 
+    /** function name interning */
+
+    void internFunctionNames(Module &M) {
+        std::set<SDBuildCHA::func_name_t> Names;
+        for (auto &className : CHA->topoSort()) {
+            auto vTableCount = CHA->getSubVTables(className).size();
+            for (uint64_t vTableIndex = 0; vTableIndex < vTableCount; ++vTableIndex) {
+                for (auto &functionEntry : CHA->getFunctionEntries(SDBuildCHA::vtbl_t(className, vTableIndex)))
+                    Names.insert(functionEntry.functionName);
+            }
+        }
+        for (auto &F : M) {
+            if (!isBlackListed(F))
+                Names.insert(F.getName());
+        }
+
+        FunctionNames.assign(Names.begin(), Names.end());
+        for (func_id_t ID = 0; ID < FunctionNames.size(); ++ID)
+            FunctionIDs[FunctionNames[ID]] = ID;
+        Demangled.reset(FunctionIDs, FunctionNames.size());
+        sdLog::stream() << "Interned " << FunctionNames.size() << " function names\n";
+    }
+
+    func_id_t getFunctionID(StringRef Name) const {
+        auto I = FunctionIDs.find(Name);
+        assert(I != FunctionIDs.end() && "function name was not interned");
+        return I->second;
+    }
+
+    /** metric output */
+
+    typedef std::vector<const func_name_set*> target_list_t;
+
+    /**
+     * Receives the metric rows: a header, then for every call site the
+     * counters (Prefix) and the labelled target columns. A column lists the
+     * functions of its sets one set after the other.
+     */
+    struct MetricSink {
+        virtual ~MetricSink() = default;
+        virtual void header(const std::string &Header) = 0;
+        virtual void beginRow(const std::string &Prefix) = 0;
+        virtual void column(const char *Label, int64_t Shown, const target_list_t &Targets) = 0;
+        virtual void endRow() = 0;
+        virtual void finish() = 0;
+    };
+
+    /** the CSV with the quoted function names of every column */
+    struct CSVMetricSink : public MetricSink {
+        CSVMetricSink(raw_ostream &_Out, const std::vector<SDBuildCHA::func_name_t> &_Names) :
+                Out(_Out), Names(_Names) {}
+
+        void header(const std::string &Header) override {
+            Out << Header;
+        }
+
+        void beginRow(const std::string &Prefix) override {
+            Out << Prefix;
+        }
+
+        void column(const char *Label, int64_t Shown, const target_list_t &Targets) override {
+            Out << ", " << Label << "(" << Shown << "):";
+            for (const func_name_set *Set : Targets) {
+                for (func_id_t ID : *Set)
+                    Out << ",\"" << Names[ID] << "\"";
+            }
+        }
+
+        void endRow() override {
+            Out << "\n";
+        }
+
+        void finish() override {}
+
+    private:
+        raw_ostream &Out;
+        const std::vector<SDBuildCHA::func_name_t> &Names;
+    };
+
+    /**
+     * The compact form of the CSV. Every distinct target set is stored once
+     * and the rows refer to the sets by ID:
+     *
+     *   "SDASET01"
+     *   names:   count, then (length, bytes) per function name
+     *   sets:    count, then per set its size and the sorted function IDs,
+     *            each as the difference to the previous one
+     *   header:  length, bytes
+     *   labels:  count, then (length, bytes) per column label
+     *   rows:    count, then per row (length, bytes) of the counters and
+     *            per column its label, shown count (signed), and set IDs
+     *
+     * All numbers are LEB128 encoded.
+     */
+    struct CompactMetricSink : public MetricSink {
+        CompactMetricSink(raw_ostream &_Out, const std::vector<SDBuildCHA::func_name_t> &_Names) :
+                Out(_Out), Names(_Names) {}
+
+        void header(const std::string &Header) override {
+            HeaderText = Header;
+        }
+
+        void beginRow(const std::string &Prefix) override {
+            Rows.push_back(Row{Prefix, {}});
+        }
+
+        void column(const char *Label, int64_t Shown, const target_list_t &Targets) override {
+            Column C{getLabelID(Label), Shown, {}};
+            for (const func_name_set *Set : Targets)
+                C.Sets.push_back(getSetID(Set));
+            Rows.back().Columns.push_back(C);
+        }
+
+        void endRow() override {}
+
+        void finish() override {
+            Out << "SDASET01";
+
+            encodeULEB128(Names.size(), Out);
+            for (auto &Name : Names)
+                writeString(Name);
+
+            encodeULEB128(Sets.size(), Out);
+            for (const func_name_set *Set : Sets) {
+                encodeULEB128(Set->count(), Out);
+                func_id_t Previous = 0;
+                for (func_id_t ID : *Set) {
+                    encodeULEB128(ID - Previous, Out);
+                    Previous = ID;
+                }
+            }
+
+            writeString(HeaderText);
+
+            encodeULEB128(Labels.size(), Out);
+            for (auto &Label : Labels)
+                writeString(Label);
+
+            encodeULEB128(Rows.size(), Out);
+            for (auto &R : Rows) {
+                writeString(R.Prefix);
+                encodeULEB128(R.Columns.size(), Out);
+                for (auto &C : R.Columns) {
+                    encodeULEB128(C.Label, Out);
+                    encodeSLEB128(C.Shown, Out);
+                    encodeULEB128(C.Sets.size(), Out);
+                    for (unsigned SetID : C.Sets)
+                        encodeULEB128(SetID, Out);
+                }
+            }
+
+            sdLog::stream() << "Compact metric output: " << Rows.size() << " rows, "
+                            << Sets.size() << " distinct target sets\n";
+        }
+
+    private:
+        struct Column {
+            unsigned Label;
+            int64_t Shown;
+            std::vector<unsigned> Sets;
+        };
+
+        struct Row {
+            std::string Prefix;
+            std::vector<Column> Columns;
+        };
+
+        raw_ostream &Out;
+        const std::vector<SDBuildCHA::func_name_t> &Names;
+        std::string HeaderText;
+        std::vector<std::string> Labels;
+        std::map<std::string, unsigned> LabelIDs;
+        std::vector<const func_name_set*> Sets;
+        std::map<const func_name_set*, unsigned> SetIDsByAddress;
+        std::map<std::vector<func_id_t>, unsigned> SetIDsByContent;
+        std::vector<Row> Rows;
+
+        unsigned getLabelID(const std::string &Label) {
+            auto I = LabelIDs.find(Label);
+            if (I != LabelIDs.end())
+                return I->second;
+            Labels.push_back(Label);
+            return LabelIDs[Label] = Labels.size() - 1;
+        }
+
+        // the same set object is only compared by content once
+        unsigned getSetID(const func_name_set *Set) {
+            auto I = SetIDsByAddress.find(Set);
+            if (I != SetIDsByAddress.end())
+                return I->second;
+
+            std::vector<func_id_t> Content;
+            for (func_id_t ID : *Set)
+                Content.push_back(ID);
+            auto J = SetIDsByContent.find(Content);
+            unsigned SetID;
+            if (J != SetIDsByContent.end()) {
+                SetID = J->second;
+            } else {
+                Sets.push_back(Set);
+                SetID = Sets.size() - 1;
+                SetIDsByContent[Content] = SetID;
+            }
+            return SetIDsByAddress[Set] = SetID;
+        }
+
+        void writeString(StringRef Str) {
+            encodeULEB128(Str.size(), Out);
+            Out << Str;
+        }
+    };
+
     /** hierarchy analysis functions */
 
     void analyseCHA() {
@@ -308,8 +632,8 @@ private:
         sdLog::log() << "VTable hierarchy:\n";
         for (auto &entry : VTableSubHierarchyPerFunction) {
             sdLog::log() << entry.first.second << ", " << entry.first.first << ":";
-            for (auto name : entry.second) {
-                sdLog::logNoToken() << " " << name;
+            for (auto ID : entry.second) {
+                sdLog::logNoToken() << " " << FunctionNames[ID];
             }
             sdLog::logNoToken() << "\n";
         }
@@ -317,8 +641,8 @@ private:
         sdLog::log() << "Class hierarchy:\n";
         for (auto &entry : ClassSubHierarchyPerFunction) {
             sdLog::log() << entry.first.second << ", " << entry.first.first << ":";
-            for (auto name : entry.second) {
-                sdLog::log() << " " << name;
+            for (auto ID : entry.second) {
+                sdLog::log() << " " << FunctionNames[ID];
             }
             sdLog::log() << "\n";
         }
@@ -339,8 +663,9 @@ private:
 
                 for (auto functionEntry : CHA->getFunctionEntries(vTable)) {
                     sdLog::log() << "\t\t" << functionEntry.functionName << "@" << functionEntry.offsetInVTable << "\n";
-                    FunctionNameInVTableAtOffset[vTable][functionEntry.offsetInVTable] = functionEntry.functionName;
-                    FunctionNamesInClassAtOffset[vTable.first][functionEntry.offsetInVTable].insert(functionEntry.functionName);
+                    auto functionID = getFunctionID(functionEntry.functionName);
+                    FunctionNameInVTableAtOffset[vTable][functionEntry.offsetInVTable] = functionID;
+                    FunctionNamesInClassAtOffset[vTable.first][functionEntry.offsetInVTable].set(functionID);
                 }
 
                 std::set<SDBuildCHA::vtbl_t> vTableChildren;
@@ -371,13 +696,16 @@ private:
             for (auto &functionNameEntry : FunctionNameInVTableAtOffset[rootVTable]) {
                 auto offsetInVTable = functionNameEntry.first;
 
-                std::set<SDBuildCHA::func_name_t> functionNames;
+                func_name_set functionNames;
                 for (auto &vTable : subHierarchy.second) {
                     if (CHA->isDefined(vTable.first)) {
-                        functionNames.insert(FunctionNameInVTableAtOffset[vTable][offsetInVTable]);
+                        auto &functionsAtOffset = FunctionNameInVTableAtOffset[vTable];
+                        auto functionEntry = functionsAtOffset.find(offsetInVTable);
+                        if (functionEntry != functionsAtOffset.end())
+                            functionNames.set(functionEntry->second);
                     }
                 }
-                VTableSubHierarchyPerFunction[SDBuildCHA::func_and_class_t(functionNameEntry.second, rootVTable.first)]
+                VTableSubHierarchyPerFunction[SDBuildCHA::func_and_class_t(FunctionNames[functionNameEntry.second], rootVTable.first)]
                         = functionNames;
             }
         }
@@ -394,15 +722,14 @@ private:
             for (auto &functionNameEntry : FunctionNamesInClassAtOffset[rootClassName]) {
                 auto offsetInVTable = functionNameEntry.first;
 
-                std::set<SDBuildCHA::func_name_t> functionNames;
+                func_name_set functionNames;
                 for (auto &className : subHierarchy.second) {
                     if (CHA->isDefined(className)) {
-                        auto &functionNamesInChild  = FunctionNamesInClassAtOffset[className][offsetInVTable];
-                        functionNames.insert(functionNamesInChild.begin(), functionNamesInChild.end());
+                        functionNames |= FunctionNamesInClassAtOffset[className][offsetInVTable];
                     }
                 }
-                for (auto &functionName : functionNameEntry.second) {
-                    ClassSubHierarchyPerFunction[SDBuildCHA::func_and_class_t(functionName, rootClassName)]
+                for (auto functionID : functionNameEntry.second) {
+                    ClassSubHierarchyPerFunction[SDBuildCHA::func_and_class_t(FunctionNames[functionID], rootClassName)]
                             = functionNames;
                 }
             }
@@ -413,11 +740,11 @@ private:
         for (auto &classEntries : FunctionNamesInClassAtOffset) {
             if (CHA->isDefined(classEntries.first)) {
                 for (auto &functionEntries : classEntries.second) {
-                    AllVFunctions.insert(functionEntries.second.begin(), functionEntries.second.end());
+                    AllVFunctions |= functionEntries.second;
                 }
             }
         }
-        AllVFunctionsInVTables = AllVFunctions.size();
+        AllVFunctionsInVTables = AllVFunctions.count();
     }
 
     void computeVTableIslands() {
@@ -450,7 +777,7 @@ private:
             for (auto &className : island.second) {
                 if (CHA->isDefined(className)) {
                     for (auto &entry : FunctionNamesInClassAtOffset[className]) {
-                        islandToFunctionsAtOffset[island.first][entry.first].insert(entry.second.begin(), entry.second.end());
+                        islandToFunctionsAtOffset[island.first][entry.first] |= entry.second;
                     }
                 }
             }
@@ -459,8 +786,8 @@ private:
         for(auto &entry : classToIslandRoot) {
             for (auto &functionNameEntry : FunctionNamesInClassAtOffset[entry.first]) {
                 auto offsetInVTable = functionNameEntry.first;
-                for (auto &functionName : functionNameEntry.second) {
-                    ClassToIsland[{functionName, entry.first}] = islandToFunctionsAtOffset[entry.second][offsetInVTable];
+                for (auto functionID : functionNameEntry.second) {
+                    ClassToIsland[{FunctionNames[functionID], entry.first}] = islandToFunctionsAtOffset[entry.second][offsetInVTable];
                 }
             }
         }
@@ -470,46 +797,59 @@ private:
 
     /** function type matching functions */
 
+    /** the encodings and demangled name of a function, computed in parallel */
+    struct CalleeInfo {
+        unsigned NumOfParams = 0;
+        Encodings Encode{};
+        std::string DemangledFunctionName = "";
+    };
+
     void analyseCallees(Module &M) {
         sdLog::stream() << "\n";
         sdLog::stream() << "Processing functions...\n";
 
+        std::vector<Function*> Functions;
         for (auto &F : M) {
-            if (isBlackListed(F))
-                continue;
+            if (!isBlackListed(F))
+                Functions.push_back(&F);
+        }
 
-            auto NumOfParams = F.getFunctionType()->getNumParams();
-            if (NumOfParams > 7)
-                NumOfParams = 7;
+        std::vector<CalleeInfo> Callees(Functions.size());
+        parallelFor(Functions.size(), [&](size_t Index) {
+            Function &F = *Functions[Index];
+            CalleeInfo &Callee = Callees[Index];
 
-            auto Encode = Encodings::encode(F.getFunctionType());
-            std::string FunctionName = F.getName();
+            Callee.NumOfParams = F.getFunctionType()->getNumParams();
+            if (Callee.NumOfParams > 7)
+                Callee.NumOfParams = 7;
 
-            std::string DemangledFunctionName = FunctionName;
-            int Status = 0;
-            if (F.getName().startswith("_")) {
-                auto DemangledPair = itaniumDemanglePair(F.getName(), Status);
-                if (Status == 0 && DemangledPair.second != "") {
-                    DemangledFunctionName = DemangledPair.second;
-                }
-            }
+            Callee.Encode = Encodings::encode(F.getFunctionType());
+            Callee.DemangledFunctionName = Demangled.get(F.getName());
+        });
 
-            AllFunctions.insert(F.getName());
+        for (size_t Index = 0; Index < Functions.size(); ++Index) {
+            Function &F = *Functions[Index];
+            auto NumOfParams = Callees[Index].NumOfParams;
+            auto &Encode = Callees[Index].Encode;
+            auto &DemangledFunctionName = Callees[Index].DemangledFunctionName;
+
+            auto FunctionID = getFunctionID(F.getName());
+            AllFunctions.set(FunctionID);
             NumberOfParameters[NumOfParams]++;
-            NumberOfParametersList[NumOfParams].insert(F.getName());
-            TargetSignature[Encode.Normal].insert(F.getName());
-            ShortTargetSignature[Encode.Short].insert(F.getName());
+            NumberOfParametersList[NumOfParams].set(FunctionID);
+            TargetSignature[Encode.Normal].set(FunctionID);
+            ShortTargetSignature[Encode.Short].set(FunctionID);
             PreciseTargetSignature[preciseFunctionSignature_t(DemangledFunctionName, Encode.Precise)]
-                    .insert(FunctionName);
+                    .set(FunctionID);
 
             if (isVirtualFunction(F)) {
-                AllVFunctions.insert(F.getName());
+                AllVFunctions.set(FunctionID);
                 NumberOfParameters_virtual[NumOfParams]++;
-                NumberOfParametersList_virtual[NumOfParams].insert(F.getName());
-                TargetSignature_virtual[Encode.Normal].insert(F.getName());
-                ShortTargetSignature_virtual[Encode.Short].insert(F.getName());
+                NumberOfParametersList_virtual[NumOfParams].set(FunctionID);
+                TargetSignature_virtual[Encode.Normal].set(FunctionID);
+                ShortTargetSignature_virtual[Encode.Short].set(FunctionID);
                 PreciseTargetSignature_virtual[preciseFunctionSignature_t(DemangledFunctionName, Encode.Precise)]
-                        .insert(FunctionName);
+                        .set(FunctionID);
             }
         }
 
@@ -525,30 +865,80 @@ private:
 
     /** CallSite analysis functions */
 
+    /**
+     * The CallSites are analysed in parallel once the CHA and signature
+     * tables are complete, the tables are only read from then on. Every
+     * function (or virtual CallSite) gets its own result list, the lists are
+     * appended to Data in module order so the output does not depend on the
+     * number of threads.
+     */
+    typedef std::vector<std::vector<CallSiteInfo>> call_site_results_t;
+
+    void addResults(const call_site_results_t &Results) {
+        for (auto &List : Results) {
+            for (auto &Info : List) {
+                Data.push_back(Info);
+                CallSiteCount++;
+            }
+        }
+    }
+
     void processIndirectCallSites(Module &M) {
-        int64_t countIndirect = 0;
+        std::vector<Function*> Functions;
+        for (auto &F : M) {
+            if (!F.isDeclaration())
+                Functions.push_back(&F);
+        }
 
         sdLog::stream() << "\n";
         sdLog::stream() << "Processing indirect CallSites...\n";
-        for (auto &F : M) {
-            for(auto &MBB : F) {
+        call_site_results_t Results(Functions.size());
+        parallelFor(Functions.size(), [&](size_t Index) {
+            for(auto &MBB : *Functions[Index]) {
                 for (auto &I : MBB) {
                     CallSite Call(&I);
                     // Try to use I as a CallInst or a InvokeInst
                     if (Call.getInstruction()) {
                         if (CallSite(Call).isIndirectCall() && VirtualCallSites.find(Call) == VirtualCallSites.end()) {
                             CallSiteInfo Info(Call.getFunctionType()->getNumParams(), false);
-                            analyseCall(Call, Info);
-                            ++countIndirect;
+                            Results[Index].push_back(analyseCall(Call, Info));
                         }
                     }
                 }
             }
-        }
+        });
+
+        int64_t countIndirect = 0;
+        for (auto &List : Results)
+            countIndirect += List.size();
+        addResults(Results);
+
         sdLog::stream() << "Found indirect CallSites: " << countIndirect << "\n";
         sdLog::stream() << "\n";
     }
 
+    /** the virtual call through the vptr checked by IntrinsicCall, for intrinsics without a link */
+    static CallSite findVirtualCallByUsers(CallInst *IntrinsicCall) {
+        if (IntrinsicCall->user_empty())
+            return CallSite();
+
+        User *User = *(IntrinsicCall->users().begin());
+        CallSite VCall;
+        for (int i = 0; i < 4; ++i) {
+            // User was not found, this should not happen...
+            VCall = CallSite(User);
+            if (VCall.getInstruction()) {
+                break;
+            }
+
+            for (auto *NextUser : User->users()) {
+                User = NextUser;
+                break;
+            }
+        }
+        return VCall;
+    }
+
     void processVirtualCallSites(Module &M) {
         Function *IntrinsicFunction = M.getFunction(Intrinsic::getName(Intrinsic::sd_get_checked_vptr));
 
@@ -559,43 +949,52 @@ private:
 
         sdLog::stream() << "\n";
         sdLog::stream() << "Processing virtual CallSites...\n";
+        sd_linked_calls_t LinkedCalls;
+        sd_collectLinkedCalls(IntrinsicFunction, LinkedCalls);
+
         int count = 0;
+        int countUnlinked = 0;
+        std::vector<std::pair<const CallInst*, CallSite>> VirtualCalls;
         for (const Use &U : IntrinsicFunction->uses()) {
 
             // get the intrinsic call instruction
             CallInst *IntrinsicCall = dyn_cast<CallInst>(U.getUser());
             assert(IntrinsicCall && "Intrinsic was not wrapped in a CallInst?");
 
-            // Find the CallSite that is associated with the intrinsic call.
-            User *User = *(IntrinsicCall->users().begin());
-            CallSite *VCall = nullptr;
-            for (int i = 0; i < 4; ++i) {
-                // User was not found, this should not happen...
-                VCall = new CallSite(User);
-                if (VCall->getInstruction()) {
-                    break;
-                }
+            // calls through pointers to virtual member functions have no function name
+            MetadataAsValue *FunctionNameArg = dyn_cast<MetadataAsValue>(IntrinsicCall->getArgOperand(3));
+            if (FunctionNameArg && sd_getFunctionNameFromMD(cast<MDNode>(FunctionNameArg->getMetadata())).empty())
+                continue;
 
-                for (auto *NextUser : User->users()) {
-                    User = NextUser;
-                    break;
-                }
+            // Find the CallSite that is associated with the intrinsic call.
+            CallSite VCall(sd_getLinkedCall(IntrinsicCall, LinkedCalls));
+            if (!VCall.getInstruction()) {
+                VCall = findVirtualCallByUsers(IntrinsicCall);
+                countUnlinked++;
             }
 
-            if (VCall != nullptr && VCall->getInstruction()) {
+            if (VCall.getInstruction()) {
                 // valid CallSite
-                extractVirtualCallSiteInfo(IntrinsicCall, *VCall);
-                VirtualCallSites.insert(*VCall);
+                VirtualCalls.push_back({IntrinsicCall, VCall});
+                VirtualCallSites.insert(VCall);
             } else {
                 sdLog::warn() << "CallSite for intrinsic was not found.\n";
                 IntrinsicCall->getParent()->dump();
             }
             ++count;
         }
-        sdLog::stream() << "Found virtual CallSites: " << count << "\n";
+
+        call_site_results_t Results(VirtualCalls.size());
+        parallelFor(VirtualCalls.size(), [&](size_t Index) {
+            Results[Index].push_back(extractVirtualCallSiteInfo(VirtualCalls[Index].first, VirtualCalls[Index].second));
+        });
+        addResults(Results);
+
+        sdLog::stream() << "Found virtual CallSites: " << count << " (" << countUnlinked
+                        << " without a " << SD_MD_CALL_SITE << " link)\n";
     }
 
-    void extractVirtualCallSiteInfo(const CallInst *IntrinsicCall, CallSite CallSite) {
+    CallSiteInfo extractVirtualCallSiteInfo(const CallInst *IntrinsicCall, CallSite CallSite) const {
         // Extract Metadata from Intrinsic.
         MetadataAsValue *Arg2 = dyn_cast<MetadataAsValue>(IntrinsicCall->getArgOperand(1));
         assert(Arg2);
@@ -617,11 +1016,17 @@ private:
         const StringRef FunctionName = sd_getFunctionNameFromMD(FunctionNameNode);
 
         CallSiteInfo Info(FunctionName, ClassName, PreciseName, CallSite.getFunctionType()->getNumParams());
-        analyseCall(CallSite, Info);
+        return analyseCall(CallSite, Info);
+    }
+
+    /** size of the target set of Key in Sets, without adding an empty set to Sets */
+    template <typename KeyT>
+    static int64_t countTargets(const std::map<KeyT, func_name_set> &Sets, const KeyT &Key) {
+        auto I = Sets.find(Key);
+        return I == Sets.end() ? 0 : I->second.count();
     }
 
-    void analyseCall(CallSite CallSite, CallSiteInfo Info) {
-        CallSiteCount++;
+    CallSiteInfo analyseCall(CallSite CallSite, CallSiteInfo Info) const {
         const DebugLoc &Loc = CallSite.getInstruction()->getDebugLoc();
         std::string Dwarf;
         if (Loc) {
@@ -636,16 +1041,16 @@ private:
 
         auto Encode = Encodings::encode(CallSite.getFunctionType());
         Info.Encoding = Encode;
-        Info.TargetSignatureMatches = TargetSignature[Encode.Normal].size();
-        Info.ShortTargetSignatureMatches = ShortTargetSignature[Encode.Short].size();
+        Info.TargetSignatureMatches = countTargets(TargetSignature, Encode.Normal);
+        Info.ShortTargetSignatureMatches = countTargets(ShortTargetSignature, Encode.Short);
 
         Info.NumberOfParamMatches = 0;
         for (int i = 0; i <= NumberOfParam; ++i) {
             Info.NumberOfParamMatches += NumberOfParameters[i];
         }
 
-        Info.TargetSignatureMatches_virtual = TargetSignature_virtual[Encode.Normal].size();
-        Info.ShortTargetSignatureMatches_virtual = ShortTargetSignature_virtual[Encode.Short].size();
+        Info.TargetSignatureMatches_virtual = countTargets(TargetSignature_virtual, Encode.Normal);
+        Info.ShortTargetSignatureMatches_virtual = countTargets(ShortTargetSignature_virtual, Encode.Short);
 
         Info.NumberOfParamMatches_virtual = 0;
         for (int i = 0; i <= NumberOfParam; ++i) {
@@ -655,33 +1060,60 @@ private:
         if (Info.isVirtual) {
             auto func_and_class = SDBuildCHA::func_and_class_t(Info.FunctionName, Info.PreciseName);
 
-            Info.SubHierarchyMatches = ClassSubHierarchyPerFunction[func_and_class].size();
-            Info.PreciseSubHierarchyMatches = VTableSubHierarchyPerFunction[func_and_class].size();
-            Info.HierarchyIslandMatches = ClassToIsland[func_and_class].size();
-
-            std::string DemangledFunctionName = Info.FunctionName;
-            int Status = 0;
-            auto DemangledPair = itaniumDemanglePair(Info.FunctionName, Status);
-            if (Status == 0 && DemangledPair.second != "") {
-                DemangledFunctionName = DemangledPair.second;
-            }
+            Info.SubHierarchyMatches = countTargets(ClassSubHierarchyPerFunction, func_and_class);
+            Info.PreciseSubHierarchyMatches = countTargets(VTableSubHierarchyPerFunction, func_and_class);
+            Info.HierarchyIslandMatches = countTargets(ClassToIsland, func_and_class);
 
+            const std::string &DemangledFunctionName = Demangled.get(Info.FunctionName);
 
             Info.PreciseTargetSignatureMatches =
-                    PreciseTargetSignature[preciseFunctionSignature_t(DemangledFunctionName,Encode.Precise)].size();
+                    countTargets(PreciseTargetSignature, preciseFunctionSignature_t(DemangledFunctionName,Encode.Precise));
 
             Info.PreciseTargetSignatureMatches_virtual =
-                    PreciseTargetSignature_virtual[preciseFunctionSignature_t(DemangledFunctionName,Encode.Precise)].size();
+                    countTargets(PreciseTargetSignature_virtual, preciseFunctionSignature_t(DemangledFunctionName,Encode.Precise));
         } else {
             Info.DisplayName = CallSite.getCaller()->getName();
         }
 
-        Data.push_back(Info);
+        return Info;
+    }
+
+    /**
+     * Calls Body(Index) for every Index in [0, Count) on -sd-analysis-threads
+     * threads. Body may only write to state owned by its Index.
+     */
+    template <typename BodyT>
+    static void parallelFor(size_t Count, BodyT Body) {
+#if LLVM_ENABLE_THREADS
+        unsigned Threads = SDAnalysisThreads;
+        if (Threads == 0)
+            Threads = std::max(1u, std::thread::hardware_concurrency());
+
+        if (Threads > 1 && Count > 1) {
+            const size_t BlockSize = 16;
+            std::atomic<size_t> Next(0);
+            std::vector<std::thread> Workers;
+            for (unsigned T = 0; T < Threads && T * BlockSize < Count; ++T) {
+                Workers.emplace_back([&]() {
+                    for (size_t Begin = Next.fetch_add(BlockSize); Begin < Count; Begin = Next.fetch_add(BlockSize)) {
+                        for (size_t Index = Begin; Index < std::min(Count, Begin + BlockSize); ++Index)
+                            Body(Index);
+                    }
+                });
+            }
+            for (auto &Worker : Workers)
+                Worker.join();
+            return;
+        }
+#endif
+        for (size_t Index = 0; Index < Count; ++Index)
+            Body(Index);
     }
 
     /** Helper functions */
 
     void applyCallSiteMetric() {
+        auto BaseLine = AllFunctions.count();
         for (auto& entry : Data) {
             if (entry.isVirtual) {
                 float metric = entry.TargetSignatureMatches - entry.PreciseSubHierarchyMatches;
@@ -690,7 +1122,7 @@ private:
                 }
                 MetricVirtual[metric].push_back(entry);
             } else {
-                float metric = entry.TargetSignatureMatches / (float) (AllFunctions.size());
+                float metric = entry.TargetSignatureMatches / (float) (BaseLine);
                 MetricIndirect[metric].push_back(entry);
             }
         }
@@ -721,8 +1153,9 @@ private:
 
         // write metric
 
-        std::string MetricFileNameVirtual = FileNames.first.substr(0, FileNames.first.size() - 4) + "-metric.csv";
-        std::string MetricFileNameIndirect = FileNames.second.substr(0, FileNames.second.size() - 4) + "-metric.csv";
+        std::string MetricExtension = SDAnalysisCompact ? "-metric.sda" : "-metric.csv";
+        std::string MetricFileNameVirtual = FileNames.first.substr(0, FileNames.first.size() - 4) + MetricExtension;
+        std::string MetricFileNameIndirect = FileNames.second.substr(0, FileNames.second.size() - 4) + MetricExtension;
 
         raw_fd_ostream OutfileMetricVirtual(MetricFileNameVirtual, ECVirtual, sys::fs::OpenFlags::F_None);
         raw_fd_ostream OutfileMetricIndirect(MetricFileNameIndirect, ECIndirect, sys::fs::OpenFlags::F_None);
@@ -733,16 +1166,27 @@ private:
         sdLog::stream() << "Writing metric results to "
                         << MetricFileNameVirtual << ", " << MetricFileNameIndirect << ".\n";
 
-        writeMetricVirtual(OutfileMetricVirtual);
-        writeMetricIndirect(OutfileMetricIndirect);
+        std::unique_ptr<MetricSink> MetricVirtualSink, MetricIndirectSink;
+        if (SDAnalysisCompact) {
+            MetricVirtualSink.reset(new CompactMetricSink(OutfileMetricVirtual, FunctionNames));
+            MetricIndirectSink.reset(new CompactMetricSink(OutfileMetricIndirect, FunctionNames));
+        } else {
+            MetricVirtualSink.reset(new CSVMetricSink(OutfileMetricVirtual, FunctionNames));
+            MetricIndirectSink.reset(new CSVMetricSink(OutfileMetricIndirect, FunctionNames));
+        }
+
+        writeMetricVirtual(*MetricVirtualSink);
+        writeMetricIndirect(*MetricIndirectSink);
+        OutfileMetricVirtual.close();
+        OutfileMetricIndirect.close();
     }
 
     void writeAnalysisData(raw_fd_ostream &OutfileVirtual, raw_fd_ostream &OutfileIndirect) {
         writeHeader(OutfileVirtual, true);
         writeHeader(OutfileIndirect, false);
 
-        auto BaseLine = AllFunctions.size();
-        auto BaseLineVirtual = AllVFunctions.size();
+        auto BaseLine = AllFunctions.count();
+        auto BaseLineVirtual = AllVFunctions.count();
         for (auto &Info : Data) {
             if (Info.isVirtual) {
                 OutfileVirtual
@@ -781,7 +1225,7 @@ private:
                         << "," << Info.TargetSignatureMatches
                         << "," << Info.ShortTargetSignatureMatches
                         << "," << Info.NumberOfParamMatches
-                        << "," << AllFunctions.size()
+                        << "," << BaseLine
                         << ","
                         << ","
                         << "," << Info.TargetSignatureMatches_virtual
@@ -797,14 +1241,17 @@ private:
         OutfileIndirect.close();
     }
 
-    void writeMetricVirtual(raw_fd_ostream &Out) {
+    void writeMetricVirtual(MetricSink &Out) {
         if (MetricVirtual.empty())
             return;
 
-        writeHeader(Out, true);
+        std::string Header;
+        raw_string_ostream HeaderOut(Header);
+        writeHeader(HeaderOut, true);
+        Out.header(HeaderOut.str());
 
-        auto BaseLine = AllFunctions.size();
-        auto BaseLineVirtual = AllVFunctions.size();
+        auto BaseLine = AllFunctions.count();
+        auto BaseLineVirtual = AllVFunctions.count();
         std::set<std::string> ExportedLines;
 
         int i = 0;
@@ -814,7 +1261,9 @@ private:
                     continue;
 
                 ExportedLines.insert(Info.Dwarf);
-                Out << Info.Dwarf
+                std::string Prefix;
+                raw_string_ostream Row(Prefix);
+                Row << Info.Dwarf
                     << "," << Info.FunctionName
                     << "," << Info.ClassName
                     << "," << Info.PreciseName
@@ -836,127 +1285,63 @@ private:
                     << "," << Info.SubHierarchyMatches
                     << "," << Info.HierarchyIslandMatches
                     << "," << AllVFunctionsInVTables;
+                Out.beginRow(Row.str());
 
-                std::set<std::string> vTrust, IFCC, IFCCSafe, Typearmor, vTrustVirtual, IFCCVirtual, IFCCSafeVirtual, TypearmorVirtual, ShrinkWrap, VTV, Marx, vTint;
-                // std::map<preciseFunctionSignature_t, func_name_set> PreciseTargetSignature{};
-                // std::map<SDBuildCHA::func_and_class_t, func_name_set> VTableSubHierarchyPerFunction{};
-
-                std::string DemangledFunctionName = Info.FunctionName;
-                int Status = 0;
-                auto DemangledPair = itaniumDemanglePair(Info.FunctionName, Status);
-                if (Status == 0 && DemangledPair.second != "") {
-                    DemangledFunctionName = DemangledPair.second;
-                }
+                const std::string &DemangledFunctionName = Demangled.get(Info.FunctionName);
 
-                vTrust = PreciseTargetSignature[preciseFunctionSignature_t(DemangledFunctionName,Info.Encoding.Precise)];
-                IFCC = TargetSignature[Info.Encoding.Normal];
-                IFCCSafe = ShortTargetSignature[Info.Encoding.Normal];
+                const func_name_set &vTrust = PreciseTargetSignature[preciseFunctionSignature_t(DemangledFunctionName,Info.Encoding.Precise)];
+                const func_name_set &IFCC = TargetSignature[Info.Encoding.Normal];
+                const func_name_set &IFCCSafe = ShortTargetSignature[Info.Encoding.Normal];
 
-                vTrustVirtual = PreciseTargetSignature_virtual[preciseFunctionSignature_t(DemangledFunctionName,Info.Encoding.Precise)];
-                IFCCVirtual = TargetSignature_virtual[Info.Encoding.Normal];
-                IFCCSafeVirtual = ShortTargetSignature_virtual[Info.Encoding.Normal];
+                const func_name_set &vTrustVirtual = PreciseTargetSignature_virtual[preciseFunctionSignature_t(DemangledFunctionName,Info.Encoding.Precise)];
+                const func_name_set &IFCCVirtual = TargetSignature_virtual[Info.Encoding.Normal];
+                const func_name_set &IFCCSafeVirtual = ShortTargetSignature_virtual[Info.Encoding.Normal];
 
                 auto func_and_class = SDBuildCHA::func_and_class_t(Info.FunctionName, Info.PreciseName);
-                ShrinkWrap = VTableSubHierarchyPerFunction[func_and_class];
-                VTV = ClassSubHierarchyPerFunction[func_and_class];
-                Marx = ClassToIsland[func_and_class];
-                vTint = AllVFunctions;
-
-                Out << ", vTrust(" << vTrust.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : vTrust) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+                const func_name_set &ShrinkWrap = VTableSubHierarchyPerFunction[func_and_class];
+                const func_name_set &VTV = ClassSubHierarchyPerFunction[func_and_class];
+                const func_name_set &Marx = ClassToIsland[func_and_class];
+                const func_name_set &vTint = AllVFunctions;
 
-                Out << ", IFCC(" << IFCC.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : IFCC) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+                Out.column("vTrust", vTrust.count(), {&vTrust});
 
-                Out << ", IFCCSafe(" << IFCCSafe.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : IFCCSafe) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+                Out.column("IFCC", IFCC.count(), {&IFCC});
+
+                Out.column("IFCCSafe", IFCCSafe.count(), {&IFCCSafe});
 
                 int NumberOfParams = Info.Params;
                 if (NumberOfParams >= 7)
                     NumberOfParams = 7;
 
-                Out << ", TypeArmor(" << NumberOfParams << "):";
-                for (int j = 0; j <= Info.Params; ++j) {
-                    for (const SDBuildCHA::func_name_t &Target : NumberOfParametersList[j]) {
-                        auto FunctionName = Target;
-                        FunctionName = StringRef(FunctionName);
-                        Out << ",\"" << FunctionName << "\"";
-                    }
+                target_list_t TypeArmor;
+                for (int j = 0; j <= NumberOfParams; ++j) {
+                    TypeArmor.push_back(&NumberOfParametersList[j]);
                 }
+                Out.column("TypeArmor", NumberOfParams, TypeArmor);
 
                 // virtual versions
 
-                Out << ", vTrustVirtual(" << vTrustVirtual.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : vTrustVirtual) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+                Out.column("vTrustVirtual", vTrustVirtual.count(), {&vTrustVirtual});
 
-                Out << ", IFCCVirtual(" << IFCCVirtual.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : IFCCVirtual) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+                Out.column("IFCCVirtual", IFCCVirtual.count(), {&IFCCVirtual});
 
-                Out << ", IFCCSafeVirtual(" << IFCCSafeVirtual.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : IFCCSafeVirtual) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+                Out.column("IFCCSafeVirtual", IFCCSafeVirtual.count(), {&IFCCSafeVirtual});
 
-                Out << ", TypeArmorVirtual(" << Info.NumberOfParamMatches_virtual << "):";
+                target_list_t TypeArmorVirtual;
                 for (int j = 0; j <= NumberOfParams; ++j) {
-                    for (const SDBuildCHA::func_name_t &Target : NumberOfParametersList_virtual[j]) {
-                        auto FunctionName = Target;
-                        FunctionName = StringRef(FunctionName);
-                        Out << ",\"" << FunctionName << "\"";
-                    }
+                    TypeArmorVirtual.push_back(&NumberOfParametersList_virtual[j]);
                 }
+                Out.column("TypeArmorVirtual", Info.NumberOfParamMatches_virtual, TypeArmorVirtual);
 
-                Out << ", ShrinkWrap(" << ShrinkWrap.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : ShrinkWrap) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+                Out.column("ShrinkWrap", ShrinkWrap.count(), {&ShrinkWrap});
 
-                Out << ", VTV(" << VTV.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : VTV) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+                Out.column("VTV", VTV.count(), {&VTV});
 
-                Out << ", Marx(" << Marx.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : Marx) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+                Out.column("Marx", Marx.count(), {&Marx});
 
-                Out << ", vTint(" << vTint.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : vTint) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+                Out.column("vTint", vTint.count(), {&vTint});
 
-                Out << "\n";
+                Out.endRow();
                 i++;
             }
 
@@ -964,18 +1349,21 @@ private:
                 break;
             }
         }
-        Out.close();
+        Out.finish();
 
     }
 
-    void writeMetricIndirect(raw_fd_ostream &Out) {
+    void writeMetricIndirect(MetricSink &Out) {
         if (MetricIndirect.empty())
             return;
 
-        writeHeader(Out, false);
+        std::string Header;
+        raw_string_ostream HeaderOut(Header);
+        writeHeader(HeaderOut, false);
+        Out.header(HeaderOut.str());
 
-        auto BaseLine = AllFunctions.size();
-        auto BaseLineVirtual = AllVFunctions.size();
+        auto BaseLine = AllFunctions.count();
+        auto BaseLineVirtual = AllVFunctions.count();
         std::set<std::string> ExportedLines;
 
         int i = 0;
@@ -985,7 +1373,9 @@ private:
                     continue;
 
                 ExportedLines.insert(Info.Dwarf);
-                Out << Info.Dwarf
+                std::string Prefix;
+                raw_string_ostream Row(Prefix);
+                Row << Info.Dwarf
                     << "," << Info.DisplayName
                     << ","
                     << ","
@@ -995,65 +1385,38 @@ private:
                     << "," << Info.TargetSignatureMatches
                     << "," << Info.ShortTargetSignatureMatches
                     << "," << Info.NumberOfParamMatches
-                    << "," << AllFunctions.size()
+                    << "," << BaseLine
                     << ","
                     << ","
                     << "," << Info.TargetSignatureMatches_virtual
                     << "," << Info.ShortTargetSignatureMatches_virtual
                     << "," << Info.NumberOfParamMatches_virtual
                     << "," << BaseLineVirtual;
+                Out.beginRow(Row.str());
 
-                std::set<std::string> vTrust, IFCC, IFCCSafe, Typearmor;
-                // std::map<preciseFunctionSignature_t, func_name_set> PreciseTargetSignature{};
-                // std::map<SDBuildCHA::func_and_class_t, func_name_set> VTableSubHierarchyPerFunction{};
+                const std::string &DemangledFunctionName = Demangled.get(Info.FunctionName);
 
-                std::string DemangledFunctionName = Info.FunctionName;
-                int Status = 0;
-                auto DemangledPair = itaniumDemanglePair(Info.FunctionName, Status);
-                if (Status == 0 && DemangledPair.second != "") {
-                    DemangledFunctionName = DemangledPair.second;
-                }
+                const func_name_set &vTrust = PreciseTargetSignature[preciseFunctionSignature_t(DemangledFunctionName,Info.Encoding.Precise)];
+                const func_name_set &IFCC = TargetSignature[Info.Encoding.Normal];
+                const func_name_set &IFCCSafe = ShortTargetSignature[Info.Encoding.Normal];
 
-                vTrust = PreciseTargetSignature[preciseFunctionSignature_t(DemangledFunctionName,Info.Encoding.Precise)];
-                IFCC = TargetSignature[Info.Encoding.Normal];
-                IFCCSafe = ShortTargetSignature[Info.Encoding.Normal];
+                Out.column("vTrust", vTrust.count(), {&vTrust});
 
+                Out.column("IFCC", IFCC.count(), {&IFCC});
 
-                Out << ", vTrust(" << vTrust.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : vTrust) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
-
-                Out << ", IFCC(" << IFCC.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : IFCC) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
-
-                Out << ", IFCCSafe(" << IFCCSafe.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : IFCCSafe) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+                Out.column("IFCCSafe", IFCCSafe.count(), {&IFCCSafe});
 
                 int NumberOfParams = Info.Params;
                 if (NumberOfParams >= 7)
                     NumberOfParams = 7;
 
-                Out << ", TypeArmor(" << Info.NumberOfParamMatches << "):";
+                target_list_t TypeArmor;
                 for (int j = 0; j <= NumberOfParams; ++j) {
-                    for (const SDBuildCHA::func_name_t &Target : NumberOfParametersList[j]){
-                        auto FunctionName = Target;
-                        FunctionName = StringRef(FunctionName);
-                        Out << ",\"" << FunctionName << "\"";
-                    }
+                    TypeArmor.push_back(&NumberOfParametersList[j]);
                 }
+                Out.column("TypeArmor", Info.NumberOfParamMatches, TypeArmor);
 
-                Out << "\n";
+                Out.endRow();
                 i++;
             }
 
@@ -1061,7 +1424,7 @@ private:
                 break;
             }
         }
-        Out.close();
+        Out.finish();
 
     }
 
@@ -1157,7 +1520,8 @@ private:
     };
 
     bool isVirtualFunction(const Function &F) {
-        return AllVFunctions.find(F.getName()) != AllVFunctions.end() || F.getName().startswith("_ZTh");
+        auto I = FunctionIDs.find(F.getName());
+        return (I != FunctionIDs.end() && AllVFunctions.test(I->second)) || F.getName().startswith("_ZTh");
     }
 
     bool isBlackListed(const Function &F) {
@@ -0,0 +1,553 @@
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/SafeDispatch.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include "llvm/Transforms/IPO/SafeDispatchLog.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+#include "llvm/Transforms/IPO/SafeDispatchChecks.h"
+
+#include <vector>
+#include <limits>
+
+// you have to modify the following 4 files for each additional LLVM pass
+// 1. include/llvm/IPO.h
+// 2. lib/Transforms/IPO/IPO.cpp
+// 3. include/llvm/LinkAllPasses.h
+// 4. include/llvm/InitializePasses.h
+// 5. lib/Transforms/IPO/PassManagerBuilder.cpp
+
+using namespace llvm;
+
+static cl::opt<bool>
+SDBatchChecks("sd-batch-checks", cl::init(false),
+              cl::desc("Validate the vptrs of the array elements a loop calls through "
+                       "before the loop, several at a time with vector instructions"));
+
+static cl::opt<unsigned>
+SDBatchCheckWidth("sd-batch-check-width", cl::init(4),
+                  cl::desc("Number of vptrs SDBatchCheck validates per vector operation"));
+
+namespace {
+  /**
+   * Validates the vptrs of the objects a loop makes checked virtual calls on
+   * before the loop runs, when the objects are the elements of an array:
+   *
+   *   for (i = 0; i < n; i++)
+   *     a[i]->f();
+   *
+   * The range checks of the call are done for a[0] .. a[n-1] by an outlined
+   * function in the preheader, on a block of vptrs at a time with vector
+   * sub/rotate/compare and one branch to a trap per block, and the loop then
+   * runs without its checks. On x86-64 the function is also built for AVX2
+   * and SSE4.2 and the preheader calls the best one the CPU supports.
+   *
+   * Only range checks are batched, on loops with a computable trip count that
+   * run the check once per iteration and leave through the latch. Nothing in
+   * the loop may write the array or the elements, which AA has to prove for
+   * the calls too, the virtual calls themselves included: the loop
+   * dispatches through the vptrs it loads, so they have to be the ones
+   * validated in the preheader. A loop left early by an exception or exit()
+   * may trap on an element it would not have reached.
+   */
+  struct SDBatchCheck : public ModulePass {
+    static char ID; // Pass identification, replacement for typeid
+
+    SDBatchCheck() : ModulePass(ID) {
+      sd_print("initializing SDBatchCheck pass\n");
+      initializeSDBatchCheckPass(*PassRegistry::getPassRegistry());
+    }
+
+    virtual ~SDBatchCheck() {
+      sd_print("deleting SDBatchCheck pass\n");
+    }
+
+    bool runOnModule(Module &M) override {
+      uint64_t batchedChecks = 0;
+      uint64_t validations = 0;
+
+      if (!SDBatchChecks)
+        return false;
+
+      width = SDBatchCheckWidth;
+      if (width < 2 || !isPowerOf2_32(width))
+        report_fatal_error("-sd-batch-check-width has to be a power of 2 larger than 1");
+
+      AA = &getAnalysis<AliasAnalysis>();
+      DL = &M.getDataLayout();
+      cpuDispatch = Triple(M.getTargetTriple()).getArch() == Triple::x86_64;
+      cpuLevel = NULL;
+
+      sd_print("\n P4f. Started running the SDBatchCheck pass ...\n");
+
+      for (Function &F : M) {
+        if (F.isDeclaration())
+          continue;
+
+        std::vector<sd_check_chain_t> chains;
+        sd_collectCheckChains(F, chains);
+
+        if (chains.empty())
+          continue;
+
+        // the three analyses are recomputed together for F on every request,
+        // so only the references are kept and SE is asked for last
+        LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+        DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>(F).getDomTree();
+        ScalarEvolution &SE = getAnalysis<ScalarEvolution>(F);
+
+        // validations are emitted before any chain is removed, so the loops
+        // stay intact while SE is in use
+        std::vector<batch_t> batches;
+        std::vector<sd_check_chain_t*> validated;
+
+        for (sd_check_chain_t &chain : chains) {
+          batch_t batch;
+          if (!getBatch(chain, LI, DT, SE, batch))
+            continue;
+
+          // another call on the same elements with the same checks
+          bool done = false;
+          for (batch_t &other : batches)
+            done |= sameValidation(batch, other);
+
+          if (!done) {
+            emitValidation(M, batch, SE);
+            batches.push_back(batch);
+            validations++;
+          }
+
+          validated.push_back(&chain);
+        }
+
+        if (validated.empty())
+          continue;
+
+        std::vector<CallInst*> headChecks;
+        for (sd_check_chain_t* chain : validated)
+          headChecks.push_back(sd_bypassCheckChain(*chain));
+
+        removeUnreachableBlocks(F);
+        for (CallInst* check : headChecks)
+          RecursivelyDeleteTriviallyDeadInstructions(check);
+        batchedChecks += headChecks.size();
+      }
+
+      sdLog::stream() << "SDBatchCheck: moved " << batchedChecks << " vptr checks out of loops into "
+                      << validations << " batched validations in " << M.getModuleIdentifier() << "\n";
+
+      sd_print("\n P4f. Finished running the SDBatchCheck pass ...\n");
+      return batchedChecks > 0;
+    }
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+      AU.addRequired<AliasAnalysis>();
+      AU.addRequired<DominatorTreeWrapperPass>();
+      AU.addRequired<LoopInfoWrapperPass>();
+      AU.addRequired<ScalarEvolution>();
+    }
+
+  private:
+    // a chain checking a[i] in loop L, for i = 0 .. count - 1
+    struct batch_t {
+      Loop* L;
+      LoadInst* elemLD;                   // loads a[i]
+      LoadInst* vptrLD;                   // loads the vptr of a[i]
+      int64_t vptrOff;                    // offset of the vptr field in a[i]
+      const SCEVAddRecExpr* elemAddr;     // &a[i]
+      const SCEV* count;
+      std::vector<CallInst*> checks;
+    };
+
+    AliasAnalysis* AA;
+    const DataLayout* DL;
+    unsigned width;
+    bool cpuDispatch;
+    GlobalVariable* cpuLevel;
+
+    bool getBatch(const sd_check_chain_t &chain, LoopInfo &LI, DominatorTree &DT,
+                  ScalarEvolution &SE, batch_t &batch) {
+      for (CallInst* check : chain.checks) {
+        if (cast<IntrinsicInst>(check)->getIntrinsicID() != Intrinsic::sd_subst_check_range ||
+            !isa<Constant>(check->getArgOperand(1)) ||
+            !isa<ConstantInt>(check->getArgOperand(2)) ||
+            !isa<ConstantInt>(check->getArgOperand(3)))
+          return false;
+      }
+
+      // the check has to run exactly once on every iteration
+      Loop* L = LI.getLoopFor(chain.head);
+      if (!L || !L->getLoopPreheader() || !L->getLoopLatch() ||
+          L->getExitingBlock() != L->getLoopLatch() ||
+          !DT.dominates(chain.head, L->getLoopLatch()))
+        return false;
+
+      batch.L = L;
+      batch.vptrLD = dyn_cast<LoadInst>(chain.vptr);
+      if (!batch.vptrLD || !batch.vptrLD->isSimple() || !L->contains(batch.vptrLD))
+        return false;
+
+      Value* obj = GetPointerBaseWithConstantOffset(batch.vptrLD->getPointerOperand(), batch.vptrOff, *DL);
+      batch.elemLD = dyn_cast<LoadInst>(obj);
+      if (!batch.elemLD || !batch.elemLD->isSimple() || !L->contains(batch.elemLD))
+        return false;
+
+      batch.elemAddr = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(batch.elemLD->getPointerOperand()));
+      if (!batch.elemAddr || batch.elemAddr->getLoop() != L || !batch.elemAddr->isAffine() ||
+          !isSafeToExpand(batch.elemAddr->getStart(), SE) ||
+          !isSafeToExpand(batch.elemAddr->getStepRecurrence(SE), SE))
+        return false;
+
+      const SCEV* backedges = SE.getBackedgeTakenCount(L);
+      if (isa<SCEVCouldNotCompute>(backedges) || !isSafeToExpand(backedges, SE))
+        return false;
+
+      Type* IntPtrTy = DL->getIntPtrType(chain.head->getContext(), 0);
+      batch.count = SE.getAddExpr(SE.getTruncateOrZeroExtend(backedges, IntPtrTy),
+                                  SE.getConstant(IntPtrTy, 1));
+
+      if (mayModifyElements(batch))
+        return false;
+
+      batch.checks = chain.checks;
+      return true;
+    }
+
+    bool mayModifyElements(const batch_t &batch) {
+      // the array has to be an object AA can tell apart from the rest
+      Value* array = GetUnderlyingObject(batch.elemLD->getPointerOperand(), *DL);
+      if (!isIdentifiedObject(array))
+        return true;
+
+      AliasAnalysis::Location slots(array, AliasAnalysis::UnknownSize);
+      AliasAnalysis::Location objects(batch.elemLD, AliasAnalysis::UnknownSize);
+
+      for (Loop::block_iterator BI = batch.L->block_begin(); BI != batch.L->block_end(); BI++) {
+        for (Instruction &I : **BI) {
+          if (!I.mayWriteToMemory() || isa<DbgInfoIntrinsic>(I) || sd_getCheckIntrinsic(&I))
+            continue;
+
+          if (AA->getModRefInfo(&I, slots) & AliasAnalysis::Mod)
+            return true;
+
+          if (AA->getModRefInfo(&I, objects) & AliasAnalysis::Mod)
+            return true;
+        }
+      }
+
+      return false;
+    }
+
+    bool sameValidation(const batch_t &a, const batch_t &b) {
+      if (a.elemLD != b.elemLD || a.vptrOff != b.vptrOff || a.checks.size() != b.checks.size())
+        return false;
+
+      for (unsigned i = 0; i < a.checks.size(); i++)
+        for (unsigned arg = 1; arg < 4; arg++)
+          if (a.checks[i]->getArgOperand(arg) != b.checks[i]->getArgOperand(arg))
+            return false;
+
+      return true;
+    }
+
+    /**
+     * Call the validation of a[0] .. a[count - 1] in the preheader, through
+     * the version matching the CPU on x86-64.
+     */
+    void emitValidation(Module &M, const batch_t &batch, ScalarEvolution &SE) {
+      LLVMContext &C = M.getContext();
+      Type* Int8PtrTy = Type::getInt8PtrTy(C);
+      Type* IntPtrTy = DL->getIntPtrType(C, 0);
+      Instruction* insertPt = batch.L->getLoopPreheader()->getTerminator();
+
+      Function* validateF = createValidateFunction(M, batch);
+
+      SCEVExpander expander(SE, *DL, "sd.batch");
+      Value* args[] = {
+        expander.expandCodeFor(batch.elemAddr->getStart(), Int8PtrTy, insertPt),
+        expander.expandCodeFor(batch.elemAddr->getStepRecurrence(SE), IntPtrTy, insertPt),
+        expander.expandCodeFor(batch.count, IntPtrTy, insertPt)
+      };
+
+      IRBuilder<> builder(insertPt);
+      Value* callee = validateF;
+
+      if (cpuDispatch) {
+        Function* sse42F = cloneForFeatures(M, validateF, "sse42", "+sse4.2");
+        Function* avx2F = cloneForFeatures(M, validateF, "avx2", "+avx2");
+
+        Value* level = builder.CreateLoad(getCpuLevel(M), "sd.batch.cpu");
+        callee = builder.CreateSelect(builder.CreateICmpEQ(level, builder.getInt32(1)), sse42F, callee);
+        callee = builder.CreateSelect(builder.CreateICmpEQ(level, builder.getInt32(2)), avx2F, callee);
+      }
+
+      builder.CreateCall(callee, args);
+    }
+
+    /**
+     * void validate(i8* base, i64 stride, i64 count) checks the vptr of the
+     * object at base + i * stride for every i < count. Blocks of width vptrs
+     * are checked with vector operations, the rest one at a time.
+     */
+    Function* createValidateFunction(Module &M, const batch_t &batch) {
+      LLVMContext &C = M.getContext();
+      Type* Int8PtrTy = Type::getInt8PtrTy(C);
+      Type* IntPtrTy = DL->getIntPtrType(C, 0);
+      Type* argTys[] = {Int8PtrTy, IntPtrTy, IntPtrTy};
+
+      Function* F = Function::Create(FunctionType::get(Type::getVoidTy(C), argTys, false),
+                                     GlobalValue::InternalLinkage, "sd.batch.validate", &M);
+      F->addFnAttr(Attribute::NoUnwind);
+      F->addFnAttr(Attribute::NoInline);
+
+      Function::arg_iterator arg = F->arg_begin();
+      Value* base = arg++;
+      Value* stride = arg++;
+      Value* count = arg++;
+
+      BasicBlock* entryBB = BasicBlock::Create(C, "entry", F);
+      BasicBlock* vectorBB = BasicBlock::Create(C, "sd.batch.vector", F);
+      BasicBlock* vectorNextBB = BasicBlock::Create(C, "sd.batch.vector.next", F);
+      BasicBlock* restCheckBB = BasicBlock::Create(C, "sd.batch.rest.check", F);
+      BasicBlock* restBB = BasicBlock::Create(C, "sd.batch.rest", F);
+      BasicBlock* restNextBB = BasicBlock::Create(C, "sd.batch.rest.next", F);
+      BasicBlock* exitBB = BasicBlock::Create(C, "sd.batch.exit", F);
+      BasicBlock* trapBB = BasicBlock::Create(C, "sd.batch.trap", F);
+
+      IRBuilder<> builder(entryBB);
+      Value* vectorCount = builder.CreateAnd(count, ~(uint64_t)(width - 1));
+      builder.CreateCondBr(builder.CreateICmpNE(vectorCount, ConstantInt::get(IntPtrTy, 0)),
+                           vectorBB, restCheckBB);
+
+      // whole blocks
+      builder.SetInsertPoint(vectorBB);
+      PHINode* i = builder.CreatePHI(IntPtrTy, 2, "sd.batch.i");
+      Value* vptrs = UndefValue::get(VectorType::get(IntPtrTy, width));
+      for (unsigned lane = 0; lane < width; lane++) {
+        Value* index = builder.CreateAdd(i, ConstantInt::get(IntPtrTy, lane));
+        vptrs = builder.CreateInsertElement(vptrs, loadVptr(builder, batch, base, stride, index),
+                                             builder.getInt32(lane));
+      }
+      Value* nextI = builder.CreateAdd(i, ConstantInt::get(IntPtrTy, width));
+      createTrapBranch(builder, anyLane(builder, emitInvalid(builder, batch, vptrs)), trapBB, vectorNextBB);
+
+      builder.SetInsertPoint(vectorNextBB);
+      builder.CreateCondBr(builder.CreateICmpNE(nextI, vectorCount), vectorBB, restCheckBB);
+      i->addIncoming(ConstantInt::get(IntPtrTy, 0), entryBB);
+      i->addIncoming(nextI, vectorNextBB);
+
+      // the vptrs that do not fill a block
+      builder.SetInsertPoint(restCheckBB);
+      builder.CreateCondBr(builder.CreateICmpNE(vectorCount, count), restBB, exitBB);
+
+      builder.SetInsertPoint(restBB);
+      PHINode* j = builder.CreatePHI(IntPtrTy, 2, "sd.batch.j");
+      Value* vptr = loadVptr(builder, batch, base, stride, j);
+      Value* nextJ = builder.CreateAdd(j, ConstantInt::get(IntPtrTy, 1));
+      createTrapBranch(builder, emitInvalid(builder, batch, vptr), trapBB, restNextBB);
+
+      builder.SetInsertPoint(restNextBB);
+      builder.CreateCondBr(builder.CreateICmpNE(nextJ, count), restBB, exitBB);
+      j->addIncoming(vectorCount, restCheckBB);
+      j->addIncoming(nextJ, restNextBB);
+
+      builder.SetInsertPoint(exitBB);
+      builder.CreateRetVoid();
+
+      builder.SetInsertPoint(trapBB);
+      builder.CreateCall(Intrinsic::getDeclaration(&M, Intrinsic::trap));
+      builder.CreateUnreachable();
+
+      return F;
+    }
+
+    // the vptr of the element at base + index * stride, as an integer
+    Value* loadVptr(IRBuilder<> &builder, const batch_t &batch, Value* base, Value* stride, Value* index) {
+      LLVMContext &C = builder.getContext();
+      Type* Int8PtrTy = Type::getInt8PtrTy(C);
+      Type* IntPtrTy = DL->getIntPtrType(C, 0);
+
+      Value* slot = builder.CreateGEP(base, builder.CreateMul(index, stride));
+      LoadInst* elem = builder.CreateLoad(builder.CreateBitCast(slot, Int8PtrTy->getPointerTo()));
+      elem->setAlignment(batch.elemLD->getAlignment());
+
+      Value* field = builder.CreateGEP(elem, ConstantInt::get(IntPtrTy, batch.vptrOff));
+      LoadInst* vptr = builder.CreateLoad(builder.CreateBitCast(field, IntPtrTy->getPointerTo()));
+      vptr->setAlignment(batch.vptrLD->getAlignment());
+      return vptr;
+    }
+
+    /**
+     * true in every lane whose vptr none of the checks accepts. Each range is
+     * tested the way SDSubstModule lowers it: a rotated difference compared
+     * against the width, or an equality for ranges of width 0 or 1.
+     */
+    Value* emitInvalid(IRBuilder<> &builder, const batch_t &batch, Value* vptrs) {
+      Type* Ty = vptrs->getType();
+      unsigned bits = Ty->getScalarSizeInBits();
+      Value* valid = NULL;
+
+      for (CallInst* check : batch.checks) {
+        Constant* start = cast<Constant>(check->getArgOperand(1));
+        int64_t widthInt = cast<ConstantInt>(check->getArgOperand(2))->getSExtValue();
+        uint64_t alignment = cast<ConstantInt>(check->getArgOperand(3))->getZExtValue();
+
+        if (Ty->isVectorTy())
+          start = ConstantVector::getSplat(Ty->getVectorNumElements(), start);
+
+        Value* inRange;
+        if (widthInt > 1) {
+          Value* diff = builder.CreateSub(vptrs, start);
+          unsigned alignmentBits = Log2_64(alignment);
+
+          if (alignmentBits > 0)
+            diff = builder.CreateOr(builder.CreateLShr(diff, alignmentBits),
+                                    builder.CreateShl(diff, bits - alignmentBits));
+
+          inRange = builder.CreateICmpULE(diff, ConstantInt::get(Ty, widthInt));
+        } else {
+          inRange = builder.CreateICmpEQ(vptrs, start);
+        }
+
+        valid = valid ? builder.CreateOr(valid, inRange) : inRange;
+      }
+
+      return builder.CreateNot(valid, "sd.batch.invalid");
+    }
+
+    // or of all lanes, by folding the upper half onto the lower one
+    Value* anyLane(IRBuilder<> &builder, Value* lanes) {
+      LLVMContext &C = builder.getContext();
+      Type* Int32Ty = Type::getInt32Ty(C);
+
+      for (unsigned half = width / 2; half > 0; half /= 2) {
+        std::vector<Constant*> mask;
+        for (unsigned lane = 0; lane < width; lane++)
+          mask.push_back(lane < half ? (Constant*) ConstantInt::get(Int32Ty, lane + half)
+                                     : UndefValue::get(Int32Ty));
+
+        Value* upper = builder.CreateShuffleVector(lanes, UndefValue::get(lanes->getType()),
+                                                   ConstantVector::get(mask));
+        lanes = builder.CreateOr(lanes, upper);
+      }
+
+      return builder.CreateExtractElement(lanes, builder.getInt32(0));
+    }
+
+    void createTrapBranch(IRBuilder<> &builder, Value* invalid, BasicBlock* trapBB, BasicBlock* nextBB) {
+      MDBuilder MDB(builder.getContext());
+      builder.CreateCondBr(invalid, trapBB, nextBB,
+                           MDB.createBranchWeights(std::numeric_limits<uint32_t>::min(),
+                                                   std::numeric_limits<uint32_t>::max()));
+    }
+
+    Function* cloneForFeatures(Module &M, Function* F, StringRef suffix, StringRef features) {
+      ValueToValueMapTy VMap;
+      Function* clone = CloneFunction(F, VMap, false);
+      clone->setName(F->getName() + "." + suffix);
+      clone->addFnAttr("target-features", features);
+      M.getFunctionList().push_back(clone);
+      return clone;
+    }
+
+    /**
+     * i32 global holding 2 on CPUs with AVX2, 1 with SSE4.2 and 0 otherwise,
+     * set by a constructor. Validations running before it use the baseline.
+     */
+    GlobalVariable* getCpuLevel(Module &M) {
+      if (cpuLevel)
+        return cpuLevel;
+
+      LLVMContext &C = M.getContext();
+      Type* Int32Ty = Type::getInt32Ty(C);
+
+      cpuLevel = new GlobalVariable(M, Int32Ty, false, GlobalValue::InternalLinkage,
+                                    ConstantInt::get(Int32Ty, 0), "sd.batch.cpu");
+
+      Type* cpuidResult[] = {Int32Ty, Int32Ty, Int32Ty, Int32Ty};
+      Type* cpuidArgs[] = {Int32Ty, Int32Ty};
+      InlineAsm* cpuid = InlineAsm::get(
+        FunctionType::get(StructType::get(C, ArrayRef<Type*>(cpuidResult)), cpuidArgs, false), "cpuid",
+        "={ax},={bx},={cx},={dx},{ax},{cx},~{dirflag},~{fpsr},~{flags}", false);
+
+      Type* xgetbvResult[] = {Int32Ty, Int32Ty};
+      InlineAsm* xgetbv = InlineAsm::get(
+        FunctionType::get(StructType::get(C, ArrayRef<Type*>(xgetbvResult)), Int32Ty, false), ".byte 0x0f, 0x01, 0xd0",
+        "={ax},={dx},{cx},~{dirflag},~{fpsr},~{flags}", false);
+
+      Function* ctorF = Function::Create(FunctionType::get(Type::getVoidTy(C), false),
+                                         GlobalValue::InternalLinkage, "sd.batch.cpu.init", &M);
+      BasicBlock* entryBB = BasicBlock::Create(C, "entry", ctorF);
+      BasicBlock* avxBB = BasicBlock::Create(C, "avx", ctorF);
+      BasicBlock* doneBB = BasicBlock::Create(C, "done", ctorF);
+
+      // SSE4.2 is bit 20 of ecx of leaf 1, OSXSAVE and AVX are bits 27 and 28
+      IRBuilder<> builder(entryBB);
+      Value* maxLeaf = builder.CreateExtractValue(
+        builder.CreateCall2(cpuid, builder.getInt32(0), builder.getInt32(0)), 0);
+      Value* ecx = builder.CreateExtractValue(
+        builder.CreateCall2(cpuid, builder.getInt32(1), builder.getInt32(0)), 2);
+      Value* sse42 = builder.CreateICmpNE(builder.CreateAnd(ecx, 1 << 20), builder.getInt32(0));
+      Value* sseLevel = builder.CreateSelect(sse42, builder.getInt32(1), builder.getInt32(0));
+      Value* avx = builder.CreateICmpEQ(builder.CreateAnd(ecx, 3 << 27), builder.getInt32(3 << 27));
+      builder.CreateCondBr(builder.CreateAnd(avx, builder.CreateICmpUGE(maxLeaf, builder.getInt32(7))),
+                           avxBB, doneBB);
+
+      // AVX2 is bit 5 of ebx of leaf 7, and the OS has to save the ymm registers
+      builder.SetInsertPoint(avxBB);
+      Value* xcr0 = builder.CreateExtractValue(builder.CreateCall(xgetbv, builder.getInt32(0)), 0);
+      Value* ymm = builder.CreateICmpEQ(builder.CreateAnd(xcr0, 6), builder.getInt32(6));
+      Value* ebx = builder.CreateExtractValue(
+        builder.CreateCall2(cpuid, builder.getInt32(7), builder.getInt32(0)), 1);
+      Value* avx2 = builder.CreateICmpNE(builder.CreateAnd(ebx, 1 << 5), builder.getInt32(0));
+      Value* avxLevel = builder.CreateSelect(builder.CreateAnd(ymm, avx2), builder.getInt32(2), sseLevel);
+      builder.CreateBr(doneBB);
+
+      builder.SetInsertPoint(doneBB);
+      PHINode* level = builder.CreatePHI(Int32Ty, 2);
+      level->addIncoming(sseLevel, entryBB);
+      level->addIncoming(avxLevel, avxBB);
+      builder.CreateStore(level, cpuLevel);
+      builder.CreateRetVoid();
+
+      appendToGlobalCtors(M, ctorF, 0);
+      return cpuLevel;
+    }
+  };
+}
+
+char SDBatchCheck::ID = 0;
+
+INITIALIZE_PASS_BEGIN(SDBatchCheck, "sdbatchcheck", "Validate the vptrs of loops over object arrays in batches", false, false)
+INITIALIZE_AG_DEPENDENCY(AliasAnalysis)
+INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(LoopInfoWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(ScalarEvolution)
+INITIALIZE_PASS_END(SDBatchCheck, "sdbatchcheck", "Validate the vptrs of loops over object arrays in batches", false, false)
+
+ModulePass* llvm::createSDBatchCheckPass() {
+  return new SDBatchCheck();
+}
@@ -0,0 +1,137 @@
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/SafeDispatch.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/Pass.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+#include "llvm/Transforms/IPO/SafeDispatchLog.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+#include "llvm/Transforms/IPO/SafeDispatchChecks.h"
+
+#include <vector>
+#include <set>
+#include <map>
+#include <algorithm>
+
+// you have to modify the following 4 files for each additional LLVM pass
+// 1. include/llvm/IPO.h
+// 2. lib/Transforms/IPO/IPO.cpp
+// 3. include/llvm/LinkAllPasses.h
+// 4. include/llvm/InitializePasses.h
+// 5. lib/Transforms/IPO/PassManagerBuilder.cpp
+
+using namespace llvm;
+
+namespace {
+  /**
+   * Removes vptr checks that are dominated by a check on the same vptr value
+   * accepting no more vtables. Runs between SDUpdateIndices (P4) and
+   * SDSubstModule (P5), while the checks are still intrinsic chains, e.g. for
+   * two virtual calls on the same object within one function.
+   */
+  struct SDCheckElim : public ModulePass {
+    static char ID; // Pass identification, replacement for typeid
+
+    SDCheckElim() : ModulePass(ID) {
+      sd_print("initializing SDCheckElim pass\n");
+      initializeSDCheckElimPass(*PassRegistry::getPassRegistry());
+    }
+
+    virtual ~SDCheckElim() {
+      sd_print("deleting SDCheckElim pass\n");
+    }
+
+    bool runOnModule(Module &M) override {
+      uint64_t totalChecks = 0;
+      uint64_t eliminated = 0;
+
+      sd_print("\n P4b. Started running the SDCheckElim pass ...\n");
+
+      for (Function &F : M) {
+        if (F.isDeclaration())
+          continue;
+
+        std::vector<sd_check_chain_t> chains;
+        sd_collectCheckChains(F, chains);
+        totalChecks += chains.size();
+
+        if (chains.size() > 1)
+          eliminated += eliminateRedundantChecks(F, chains);
+      }
+
+      sdLog::stream() << "SDCheckElim: eliminated " << eliminated << " of " << totalChecks
+                      << " vptr checks in " << M.getModuleIdentifier() << "\n";
+
+      sd_print("\n P4b. Finished running the SDCheckElim pass ...\n");
+      return eliminated > 0;
+    }
+
+  private:
+    /**
+     * A check B is redundant if another check A on the same vptr dominates it
+     * through its success block, and every vtable accepted by A is also
+     * accepted by B. The decisions are taken on the unmodified CFG. Removing
+     * edges keeps the dominance relation among reachable blocks, and the
+     * implication is transitive, so a check can be dropped even when the check
+     * that made it redundant is dropped too.
+     */
+    uint64_t eliminateRedundantChecks(Function &F, std::vector<sd_check_chain_t> &chains) {
+      DominatorTree DT;
+      DT.recalculate(F);
+
+      std::vector<std::set<sd_vptr_loc_t> > locations(chains.size());
+      std::vector<bool> known(chains.size());
+      for (unsigned i = 0; i < chains.size(); i++)
+        known[i] = sd_getChainLocations(chains[i], locations[i]);
+
+      std::vector<unsigned> redundant;
+      for (unsigned b = 0; b < chains.size(); b++) {
+        if (!known[b])
+          continue;
+
+        for (unsigned a = 0; a < chains.size(); a++) {
+          if (a == b || !known[a] || chains[a].vptr != chains[b].vptr)
+            continue;
+
+          if (!DT.dominates(chains[a].success, chains[b].head))
+            continue;
+
+          if (std::includes(locations[b].begin(), locations[b].end(),
+                            locations[a].begin(), locations[a].end())) {
+            redundant.push_back(b);
+            break;
+          }
+        }
+      }
+
+      std::vector<CallInst*> headChecks;
+      for (unsigned b : redundant)
+        headChecks.push_back(sd_bypassCheckChain(chains[b]));
+
+      if (redundant.empty())
+        return 0;
+
+      // drop the fail blocks together with their checks and the trap, then the
+      // first check and the vptr cast left in the head block
+      removeUnreachableBlocks(F);
+      for (CallInst *check : headChecks)
+        RecursivelyDeleteTriviallyDeadInstructions(check);
+
+      return redundant.size();
+    }
+  };
+}
+
+char SDCheckElim::ID = 0;
+
+INITIALIZE_PASS(SDCheckElim, "sdcheckelim", "Remove dominated duplicate vptr checks", false, false)
+
+ModulePass* llvm::createSDCheckElimPass() {
+  return new SDCheckElim();
+}
@@ -0,0 +1,254 @@
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/SafeDispatch.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+#include "llvm/Transforms/IPO/SafeDispatchLog.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+#include "llvm/Transforms/IPO/SafeDispatchChecks.h"
+
+#include <vector>
+
+// you have to modify the following 4 files for each additional LLVM pass
+// 1. include/llvm/IPO.h
+// 2. lib/Transforms/IPO/IPO.cpp
+// 3. include/llvm/LinkAllPasses.h
+// 4. include/llvm/InitializePasses.h
+// 5. lib/Transforms/IPO/PassManagerBuilder.cpp
+
+using namespace llvm;
+
+static cl::opt<bool>
+SDHoistChecks("sd-check-hoist", cl::init(true),
+              cl::desc("Hoist loop invariant vptr checks to the loop preheader"));
+
+namespace {
+  /**
+   * Hoists vptr checks out of loops when the checked vptr does not change
+   * inside the loop. The SD passes run after the LTO optimizations, so LICM
+   * never gets to see the checks emitted by SDUpdateIndices (P4).
+   *
+   * A vptr qualifies if it is defined outside the loop, or if it is a load from
+   * a loop invariant address that no instruction in the loop may write,
+   * calls included: a corrupted object gets its vptr overwritten by plain
+   * stores and library calls, so the check cannot rely on [basic.life].
+   *
+   * The check has to run on the first iteration of every execution of the
+   * loop, like LICM's isGuaranteedToExecute: the loop has an exit, the check
+   * dominates every exiting block and nothing between the header and the
+   * check may throw or fail to return. A vptr loaded inside the loop is
+   * moved to the preheader with the check, so every dispatch in the loop
+   * goes through the checked value.
+   */
+  struct SDCheckHoist : public ModulePass {
+    static char ID; // Pass identification, replacement for typeid
+
+    SDCheckHoist() : ModulePass(ID) {
+      sd_print("initializing SDCheckHoist pass\n");
+      initializeSDCheckHoistPass(*PassRegistry::getPassRegistry());
+    }
+
+    virtual ~SDCheckHoist() {
+      sd_print("deleting SDCheckHoist pass\n");
+    }
+
+    bool runOnModule(Module &M) override {
+      if (!SDHoistChecks)
+        return false;
+
+      AA = &getAnalysis<AliasAnalysis>();
+      uint64_t hoisted = 0;
+
+      sd_print("\n P4a. Started running the SDCheckHoist pass ...\n");
+
+      for (Function &F : M) {
+        if (F.isDeclaration())
+          continue;
+
+        // every hoist changes the CFG, so start over until nothing moves.
+        // A hoisted check always ends up in a shallower loop, so this stops.
+        while (hoistOneCheck(F))
+          hoisted++;
+      }
+
+      sdLog::stream() << "SDCheckHoist: hoisted " << hoisted << " vptr checks out of loops in "
+                      << M.getModuleIdentifier() << "\n";
+
+      sd_print("\n P4a. Finished running the SDCheckHoist pass ...\n");
+      return hoisted > 0;
+    }
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+      AU.addRequired<AliasAnalysis>();
+    }
+
+  private:
+    AliasAnalysis* AA;
+
+    bool hoistOneCheck(Function &F) {
+      std::vector<sd_check_chain_t> chains;
+      sd_collectCheckChains(F, chains);
+
+      if (chains.empty())
+        return false;
+
+      DominatorTree DT;
+      DT.recalculate(F);
+      LoopInfo LI;
+      LI.Analyze(DT);
+
+      for (sd_check_chain_t &chain : chains) {
+        Loop* target = NULL;
+
+        // hoist as far out as the vptr stays invariant
+        for (Loop* L = LI.getLoopFor(chain.head); L && canHoist(chain, L, DT); L = L->getParentLoop())
+          target = L;
+
+        if (target) {
+          hoist(F, chain, target);
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    bool canHoist(const sd_check_chain_t &chain, Loop* L, DominatorTree &DT) {
+      if (!L->getLoopPreheader())
+        return false;
+
+      if (!L->isLoopInvariant(chain.vptr)) {
+        LoadInst* LD = dyn_cast<LoadInst>(chain.vptr);
+
+        if (!LD || !LD->isSimple() || !L->isLoopInvariant(LD->getPointerOperand()) ||
+            mayClobber(L, LD))
+          return false;
+      }
+
+      // only hoist checks that run on every iteration that leaves the loop,
+      // so the hoisted check cannot trap on a path that never checked. A loop
+      // without exits is only left by exit(), longjmp or a throw.
+      SmallVector<BasicBlock*, 8> exiting;
+      L->getExitingBlocks(exiting);
+
+      if (exiting.empty())
+        return false;
+
+      for (BasicBlock* BB : exiting)
+        if (!DT.dominates(chain.head, BB))
+          return false;
+
+      return !mayLeaveBeforeCheck(chain, L);
+    }
+
+    /**
+     * true if the first iteration may leave the loop, or the function, between
+     * the header and the check: an instruction on a path from the header to
+     * the check may throw, or is a call that may not return.
+     */
+    static bool mayLeaveBeforeCheck(const sd_check_chain_t &chain, Loop* L) {
+      std::vector<BasicBlock*> worklist(1, chain.head);
+      SmallPtrSet<BasicBlock*, 16> visited;
+      visited.insert(chain.head);
+
+      while (!worklist.empty()) {
+        BasicBlock* BB = worklist.back();
+        worklist.pop_back();
+
+        for (Instruction &I : *BB) {
+          if (BB == chain.head && &I == chain.checks[0])
+            break;
+          if (mayNotReachNext(I))
+            return true;
+        }
+
+        if (BB == L->getHeader())
+          continue;
+
+        for (pred_iterator PI = pred_begin(BB), E = pred_end(BB); PI != E; ++PI)
+          if (L->contains(*PI) && visited.insert(*PI).second)
+            worklist.push_back(*PI);
+      }
+
+      return false;
+    }
+
+    static bool mayNotReachNext(Instruction &I) {
+      if (I.mayThrow())
+        return true;
+
+      CallSite CS(&I);
+      if (!CS || isa<DbgInfoIntrinsic>(I))
+        return false;
+
+      // exit() and friends write memory, a call that only reads it returns
+      return !CS.onlyReadsMemory() || CS.doesNotReturn();
+    }
+
+    bool mayClobber(Loop* L, LoadInst* LD) {
+      AliasAnalysis::Location loc = AA->getLocation(LD);
+
+      for (Loop::block_iterator BI = L->block_begin(); BI != L->block_end(); BI++) {
+        for (Instruction &I : **BI) {
+          if (!I.mayWriteToMemory())
+            continue;
+
+          if (AA->getModRefInfo(&I, loc) & AliasAnalysis::Mod)
+            return true;
+        }
+      }
+
+      return false;
+    }
+
+    void hoist(Function &F, sd_check_chain_t &chain, Loop* L) {
+      BasicBlock* preheader = L->getLoopPreheader();
+
+      // nothing in the loop writes the vptr, so the preheader loads the same
+      // vptr every iteration does
+      LoadInst* loopLD = dyn_cast<LoadInst>(chain.vptr);
+      Value* vptr = chain.vptr;
+      if (loopLD && L->contains(loopLD)) {
+        LoadInst* hoistedLD = cast<LoadInst>(loopLD->clone());
+        hoistedLD->insertBefore(preheader->getTerminator());
+        hoistedLD->setName(loopLD->getName() + ".hoisted");
+        vptr = hoistedLD;
+      } else {
+        loopLD = NULL;
+      }
+
+      sd_emitCheckChain(chain, vptr, preheader->getTerminator());
+
+      CallInst* deadCheck = sd_bypassCheckChain(chain);
+
+      // the loop dispatches through the checked value, not a second load
+      if (loopLD) {
+        loopLD->replaceAllUsesWith(vptr);
+        loopLD->eraseFromParent();
+      }
+      removeUnreachableBlocks(F);
+      RecursivelyDeleteTriviallyDeadInstructions(deadCheck);
+    }
+  };
+}
+
+char SDCheckHoist::ID = 0;
+
+INITIALIZE_PASS_BEGIN(SDCheckHoist, "sdcheckhoist", "Hoist loop invariant vptr checks", false, false)
+INITIALIZE_AG_DEPENDENCY(AliasAnalysis)
+INITIALIZE_PASS_END(SDCheckHoist, "sdcheckhoist", "Hoist loop invariant vptr checks", false, false)
+
+ModulePass* llvm::createSDCheckHoistPass() {
+  return new SDCheckHoist();
+}
@@ -0,0 +1,350 @@
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/SafeDispatch.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+#include "llvm/Transforms/IPO/SafeDispatchLog.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+#include "llvm/Transforms/IPO/SafeDispatchChecks.h"
+
+#include <vector>
+#include <set>
+#include <map>
+#include <algorithm>
+
+// you have to modify the following 4 files for each additional LLVM pass
+// 1. include/llvm/IPO.h
+// 2. lib/Transforms/IPO/IPO.cpp
+// 3. include/llvm/LinkAllPasses.h
+// 4. include/llvm/InitializePasses.h
+// 5. lib/Transforms/IPO/PassManagerBuilder.cpp
+
+using namespace llvm;
+
+static cl::opt<unsigned>
+SDCheckedThisCloneLimit("sd-checked-this-clone-limit", cl::init(500),
+                        cl::desc("Largest function (in instructions) SDCheckedThis clones "
+                                 "into a check-free specialization"));
+
+namespace {
+  /**
+   * Drops the checks a callee repeats on an object its callers already
+   * checked, e.g. a virtual method making virtual calls on this after being
+   * called through a checked call.
+   *
+   * A check in F is a candidate when it checks the vptr of an argument that
+   * F has not changed since its entry. A call site of F covers it when the
+   * caller checked the vptr field of the object it passes, with a check that
+   * accepts no more vtables, and the field was not changed between that check
+   * and the call. If every call site covers every candidate and F is internal,
+   * the checks are removed from F. Otherwise the covered call sites are
+   * redirected to a clone of F without the checks.
+   *
+   * Only direct calls of F count as call sites. A virtual call reaches F
+   * through a function pointer loaded from the vtable, so the pass relies on
+   * SDDevirt running first and turning checked calls with few targets into
+   * direct calls. Virtual calls SDDevirt leaves indirect are not call sites
+   * of F, and F keeps its checks if it has such callers.
+   */
+  struct SDCheckedThis : public ModulePass {
+    static char ID; // Pass identification, replacement for typeid
+
+    SDCheckedThis() : ModulePass(ID) {
+      sd_print("initializing SDCheckedThis pass\n");
+      initializeSDCheckedThisPass(*PassRegistry::getPassRegistry());
+    }
+
+    virtual ~SDCheckedThis() {
+      sd_print("deleting SDCheckedThis pass\n");
+    }
+
+    bool runOnModule(Module &M) override {
+      AA = &getAnalysis<AliasAnalysis>();
+      DL = &M.getDataLayout();
+      uint64_t removedInPlace = 0;
+      uint64_t removedInClones = 0;
+      uint64_t clones = 0;
+
+      sd_print("\n P4e. Started running the SDCheckedThis pass ...\n");
+
+      for (Function &F : M) {
+        if (F.isDeclaration())
+          continue;
+
+        function_info_t &info = infos[&F];
+        sd_collectCheckChains(F, info.chains);
+        info.DT.recalculate(F);
+
+        for (sd_check_chain_t &chain : info.chains)
+          info.successOf[chain.success] = &chain;
+      }
+
+      // decide everything on the unmodified module first
+      std::vector<Function*> inPlace;
+      std::vector<std::pair<Function*, std::vector<CallSite> > > toClone;
+      for (Function &F : M) {
+        if (F.isDeclaration() || F.mayBeOverridden())
+          continue;
+
+        std::vector<unsigned> candidates;
+        findCandidates(F, candidates);
+        if (candidates.empty())
+          continue;
+
+        std::vector<CallSite> covered;
+        bool allCovered = true;
+        for (User* U : F.users()) {
+          CallSite CS(U);
+          if (CS && CS.getCalledFunction() == &F && coversAll(CS, F, candidates))
+            covered.push_back(CS);
+          else
+            allCovered = false;
+        }
+
+        if (covered.empty())
+          continue;
+
+        candidatesOf[&F] = candidates;
+        if (allCovered && F.hasLocalLinkage())
+          inPlace.push_back(&F);
+        else if (instructionCount(F) <= SDCheckedThisCloneLimit)
+          toClone.push_back(std::make_pair(&F, covered));
+      }
+
+      // clone before removing, so the clones are made from the original bodies
+      for (auto &item : toClone) {
+        Function* F = item.first;
+        Function* clone = cloneWithoutChecks(M, *F, candidatesOf[F]);
+
+        for (CallSite &CS : item.second)
+          CS.setCalledFunction(clone);
+
+        removedInClones += candidatesOf[F].size();
+        clones++;
+      }
+
+      for (Function* F : inPlace) {
+        removeChecks(*F, candidatesOf[F]);
+        removedInPlace += candidatesOf[F].size();
+      }
+
+      sdLog::stream() << "SDCheckedThis: removed " << removedInPlace << " vptr checks in callees, "
+                      << removedInClones << " in " << clones << " check-free clones in "
+                      << M.getModuleIdentifier() << "\n";
+
+      infos.clear();
+      candidatesOf.clear();
+
+      sd_print("\n P4e. Finished running the SDCheckedThis pass ...\n");
+      return removedInPlace + removedInClones > 0;
+    }
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+      AU.addRequired<AliasAnalysis>();
+    }
+
+  private:
+    typedef std::pair<Value*, int64_t> vptr_field_t;
+
+    struct function_info_t {
+      std::vector<sd_check_chain_t> chains;
+      std::map<BasicBlock*, sd_check_chain_t*> successOf;
+      DominatorTree DT;
+    };
+
+    enum { SD_WALK_LIMIT = 512 };
+
+    AliasAnalysis* AA;
+    const DataLayout* DL;
+    std::map<Function*, function_info_t> infos;
+    std::map<Function*, std::vector<unsigned> > candidatesOf;
+
+    static unsigned instructionCount(Function &F) {
+      unsigned count = 0;
+      for (BasicBlock &BB : F)
+        count += BB.size();
+      return count;
+    }
+
+    bool getVptrField(const sd_check_chain_t &chain, LoadInst*& LD, vptr_field_t &field) {
+      LD = dyn_cast<LoadInst>(chain.vptr);
+      if (!LD || !LD->isSimple())
+        return false;
+
+      field.first = GetPointerBaseWithConstantOffset(LD->getPointerOperand(), field.second, *DL);
+      return true;
+    }
+
+    bool mayModifyField(Instruction* I, const vptr_field_t &field) {
+      if (!I->mayWriteToMemory() || isa<DbgInfoIntrinsic>(I))
+        return false;
+
+      // the check intrinsics and the trap do not touch the object
+      if (sd_getCheckIntrinsic(I))
+        return false;
+
+      AliasAnalysis::Location loc(field.first, AliasAnalysis::UnknownSize);
+      return AA->getModRefInfo(I, loc) & AliasAnalysis::Mod;
+    }
+
+    /**
+     * Walk back from I until stop (or the function entry when stop is NULL)
+     * through single predecessor blocks, stepping over whole check chains.
+     * Returns false if field may be modified on the way.
+     */
+    bool unmodifiedSince(Instruction* I, Instruction* stop, const vptr_field_t &field) {
+      BasicBlock* BB = I->getParent();
+      function_info_t &info = infos[BB->getParent()];
+      BasicBlock::iterator it = I;
+      unsigned steps = 0;
+
+      while (steps++ < SD_WALK_LIMIT) {
+        if (it == BB->begin()) {
+          if (BB == &BB->getParent()->getEntryBlock())
+            return stop == NULL;
+
+          BasicBlock* pred = BB->getSinglePredecessor();
+          auto chainIt = info.successOf.find(BB);
+          if (!pred && chainIt != info.successOf.end())
+            pred = chainIt->second->head;
+          if (!pred)
+            return false;
+
+          BB = pred;
+          it = BB->end();
+          continue;
+        }
+
+        it--;
+        if (&*it == stop)
+          return true;
+        if (mayModifyField(it, field))
+          return false;
+      }
+
+      return false;
+    }
+
+    // checks of F on the vptr of an argument F did not change
+    void findCandidates(Function &F, std::vector<unsigned> &candidates) {
+      function_info_t &info = infos[&F];
+
+      for (unsigned i = 0; i < info.chains.size(); i++) {
+        LoadInst* LD;
+        vptr_field_t field;
+
+        if (getVptrField(info.chains[i], LD, field) && isa<Argument>(field.first) &&
+            unmodifiedSince(LD, NULL, field))
+          candidates.push_back(i);
+      }
+    }
+
+    bool coversAll(CallSite CS, Function &F, const std::vector<unsigned> &candidates) {
+      for (unsigned i : candidates)
+        if (!covers(CS, infos[&F].chains[i]))
+          return false;
+      return true;
+    }
+
+    // did the caller check the object it passes in a way that implies calleeCheck
+    bool covers(CallSite CS, const sd_check_chain_t &calleeCheck) {
+      LoadInst* calleeLD;
+      vptr_field_t calleeField;
+      getVptrField(calleeCheck, calleeLD, calleeField);
+
+      unsigned argNo = cast<Argument>(calleeField.first)->getArgNo();
+      if (argNo >= CS.arg_size())
+        return false;
+
+      vptr_field_t field;
+      field.first = GetPointerBaseWithConstantOffset(CS.getArgument(argNo), field.second, *DL);
+      field.second += calleeField.second;
+
+      std::set<sd_vptr_loc_t> calleeLocs;
+      if (!sd_getChainLocations(calleeCheck, calleeLocs))
+        return false;
+
+      Instruction* call = CS.getInstruction();
+      function_info_t &info = infos[call->getParent()->getParent()];
+
+      for (sd_check_chain_t &chain : info.chains) {
+        LoadInst* LD;
+        vptr_field_t checkedField;
+        std::set<sd_vptr_loc_t> locs;
+
+        if (!getVptrField(chain, LD, checkedField) || checkedField != field ||
+            !info.DT.dominates(chain.success, call->getParent()) ||
+            !sd_getChainLocations(chain, locs))
+          continue;
+
+        if (std::includes(calleeLocs.begin(), calleeLocs.end(), locs.begin(), locs.end()) &&
+            unmodifiedSince(call, LD, field))
+          return true;
+      }
+
+      return false;
+    }
+
+    void removeChecks(Function &F, const std::vector<unsigned> &candidates) {
+      std::vector<sd_check_chain_t> &chains = infos[&F].chains;
+      std::vector<CallInst*> headChecks;
+
+      for (unsigned i : candidates)
+        headChecks.push_back(sd_bypassCheckChain(chains[i]));
+
+      removeUnreachableBlocks(F);
+      for (CallInst* check : headChecks)
+        RecursivelyDeleteTriviallyDeadInstructions(check);
+    }
+
+    Function* cloneWithoutChecks(Module &M, Function &F, const std::vector<unsigned> &candidates) {
+      ValueToValueMapTy VMap;
+      Function* clone = CloneFunction(&F, VMap, false);
+      clone->setName(F.getName() + ".sd.checked");
+      clone->setLinkage(GlobalValue::InternalLinkage);
+      M.getFunctionList().push_back(clone);
+
+      // find the cloned chains through their heads
+      std::set<BasicBlock*> heads;
+      for (unsigned i : candidates)
+        heads.insert(cast<BasicBlock>(VMap[infos[&F].chains[i].head]));
+
+      std::vector<sd_check_chain_t> chains;
+      sd_collectCheckChains(*clone, chains);
+
+      std::vector<CallInst*> headChecks;
+      for (sd_check_chain_t &chain : chains)
+        if (heads.count(chain.head))
+          headChecks.push_back(sd_bypassCheckChain(chain));
+
+      removeUnreachableBlocks(*clone);
+      for (CallInst* check : headChecks)
+        RecursivelyDeleteTriviallyDeadInstructions(check);
+
+      return clone;
+    }
+  };
+}
+
+char SDCheckedThis::ID = 0;
+
+INITIALIZE_PASS_BEGIN(SDCheckedThis, "sdcheckedthis", "Skip vptr checks in callees on already checked objects", false, false)
+INITIALIZE_AG_DEPENDENCY(AliasAnalysis)
+INITIALIZE_PASS_END(SDCheckedThis, "sdcheckedthis", "Skip vptr checks in callees on already checked objects", false, false)
+
+ModulePass* llvm::createSDCheckedThisPass() {
+  return new SDCheckedThis();
+}
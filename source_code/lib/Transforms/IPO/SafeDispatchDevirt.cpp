@@ -0,0 +1,353 @@
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/SafeDispatch.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+#include "llvm/Transforms/IPO/SafeDispatchLog.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+#include "llvm/Transforms/IPO/SafeDispatchChecks.h"
+
+#include <vector>
+#include <set>
+#include <map>
+
+// you have to modify the following 4 files for each additional LLVM pass
+// 1. include/llvm/IPO.h
+// 2. lib/Transforms/IPO/IPO.cpp
+// 3. include/llvm/LinkAllPasses.h
+// 4. include/llvm/InitializePasses.h
+// 5. lib/Transforms/IPO/PassManagerBuilder.cpp
+
+using namespace llvm;
+
+static cl::opt<unsigned>
+SDDevirtMaxTargets("sd-devirt-max-targets", cl::init(4),
+                   cl::desc("Devirtualize checked virtual calls whose check allows at most "
+                            "this many vtables (0 disables devirtualization)"));
+
+namespace {
+  /**
+   * Speculative devirtualization of checked virtual calls. After SDUpdateIndices
+   * (P4) every checked call site knows exactly which vtables its vptr may point
+   * to, and the vtables themselves are the constant _SD<root> arrays. When a
+   * check allows only a few vtables, the virtual call is replaced by direct
+   * calls to the functions in the called slot of those vtables, so the later
+   * LTO passes can inline them.
+   *
+   * If every vtable the check accepts holds the same function, the call becomes
+   * a plain direct call. Otherwise each target is guarded by comparing the vptr
+   * against its vtables, with the original indirect call as the fall back.
+   *
+   * Calls of final methods (see SD_MD_FINAL) are made direct however many
+   * vtables the check accepts. When that leaves the checked vptr without
+   * other uses, the check is dropped too, as clang does for the final calls
+   * it devirtualizes itself.
+   */
+  struct SDDevirt : public ModulePass {
+    static char ID; // Pass identification, replacement for typeid
+
+    SDDevirt() : ModulePass(ID) {
+      sd_print("initializing SDDevirt pass\n");
+      initializeSDDevirtPass(*PassRegistry::getPassRegistry());
+    }
+
+    virtual ~SDDevirt() {
+      sd_print("deleting SDDevirt pass\n");
+    }
+
+    bool runOnModule(Module &M) override {
+      uint64_t direct = 0;
+      uint64_t guarded = 0;
+      uint64_t droppedChecks = 0;
+
+      if (SDDevirtMaxTargets == 0)
+        return false;
+
+      sd_print("\n P4c. Started running the SDDevirt pass ...\n");
+
+      for (Function &F : M) {
+        if (F.isDeclaration())
+          continue;
+
+        std::vector<sd_check_chain_t> chains;
+        sd_collectCheckChains(F, chains);
+
+        if (chains.empty())
+          continue;
+
+        DominatorTree DT;
+        DT.recalculate(F);
+
+        // guarded calls split blocks, so the tree has to be rebuilt after them
+        std::vector<sd_check_chain_t*> unused;
+        for (sd_check_chain_t &chain : chains) {
+          bool allDirect = false;
+          if (devirtualizeChain(chain, DT, direct, guarded, allDirect))
+            DT.recalculate(F);
+          if (allDirect)
+            unused.push_back(&chain);
+        }
+
+        if (unused.empty())
+          continue;
+
+        std::vector<CallInst*> headChecks;
+        for (sd_check_chain_t* chain : unused)
+          headChecks.push_back(sd_bypassCheckChain(*chain));
+
+        removeUnreachableBlocks(F);
+        for (CallInst* check : headChecks)
+          RecursivelyDeleteTriviallyDeadInstructions(check);
+        droppedChecks += headChecks.size();
+      }
+
+      sdLog::stream() << "SDDevirt: devirtualized " << direct + guarded << " call sites ("
+                      << guarded << " guarded), dropped " << droppedChecks
+                      << " checks of final method calls in " << M.getModuleIdentifier() << "\n";
+
+      sd_print("\n P4c. Finished running the SDDevirt pass ...\n");
+      return direct + guarded > 0;
+    }
+
+  private:
+    typedef std::map<sd_vptr_loc_t, Function*> target_map_t;
+
+    /**
+     * Find the virtual calls dispatched through the checked vptr:
+     *   %vfn = getelementptr %vptr, i64 <index>
+     *   %fp  = load %vfn
+     *   call %fp(...)
+     * where <index> is a constant or llvm.sd.subst.vtbl.index(<constant>).
+     * allDirect is set for final method checks whose vptr is left unused.
+     */
+    bool devirtualizeChain(sd_check_chain_t &chain, DominatorTree &DT,
+                           uint64_t &direct, uint64_t &guarded, bool &allDirect) {
+      const DataLayout &DL = chain.head->getModule()->getDataLayout();
+      std::set<sd_vptr_loc_t> accepted, exact;
+      std::vector<std::pair<CallSite, int64_t> > calls;
+      std::vector<Instruction*> oldCallees;
+      bool splitBlocks = false;
+      bool finalMethod = sd_isFinal(chain.checks[0]->getMetadata(SD_MD_FINAL), "method");
+
+      if (!sd_getChainLocations(chain, accepted) || !sd_getChainLocations(chain, exact, true))
+        return false;
+
+      // a constant vptr is known exactly, provided the check lets it through
+      int64_t constOff = 0;
+      GlobalVariable* constGV = dyn_cast_or_null<GlobalVariable>(
+        GetPointerBaseWithConstantOffset(chain.vptr, constOff, DL));
+
+      if (constGV) {
+        sd_vptr_loc_t loc(constGV, constOff);
+        if (!accepted.count(loc))
+          return false;
+        accepted.clear();
+        exact.clear();
+        accepted.insert(loc);
+        exact.insert(loc);
+      }
+
+      if (exact.empty() || (exact.size() > SDDevirtMaxTargets && !finalMethod))
+        return false;
+
+      for (User* U : chain.vptr->users()) {
+        GetElementPtrInst* GEP = dyn_cast<GetElementPtrInst>(U);
+        if (!GEP || GEP->getPointerOperand() != chain.vptr || GEP->getNumIndices() != 1)
+          continue;
+
+        int64_t index;
+        if (!getSlotIndex(GEP->getOperand(1), index))
+          continue;
+
+        // byte offset of the slot relative to the address point
+        int64_t slotOff = index * DL.getTypeAllocSize(GEP->getType()->getPointerElementType());
+
+        for (User* GU : GEP->users()) {
+          LoadInst* LD = dyn_cast<LoadInst>(GU);
+          if (!LD)
+            continue;
+
+          for (User* LU : LD->users()) {
+            Value* fp = LD;
+            if (isa<BitCastInst>(LU) && LU->hasOneUse()) {
+              fp = LU;
+              LU = *LU->user_begin();
+            }
+
+            CallSite CS(LU);
+            if (CS && CS.getCalledValue() == fp && DT.dominates(chain.success, CS.getInstruction()->getParent()))
+              calls.push_back(std::make_pair(CS, slotOff));
+          }
+        }
+      }
+
+      for (auto &call : calls) {
+        target_map_t targets;
+        if (!resolveTargets(exact, call.second, targets))
+          continue;
+
+        // every vtable the check lets through calls the same function
+        target_map_t acceptedTargets;
+        if (resolveTargets(accepted, call.second, acceptedTargets) &&
+            singleTarget(acceptedTargets)) {
+          Function* target = acceptedTargets.begin()->second;
+          CallSite CS = call.first;
+          if (Instruction* oldCallee = dyn_cast<Instruction>(CS.getCalledValue()))
+            oldCallees.push_back(oldCallee);
+          CS.setCalledFunction(ConstantExpr::getBitCast(target, CS.getCalledValue()->getType()));
+          direct++;
+          continue;
+        }
+
+        if (isa<CallInst>(call.first.getInstruction()) && exact.size() <= SDDevirtMaxTargets) {
+          emitGuardedCalls(cast<CallInst>(call.first.getInstruction()), chain.vptr, targets, DL);
+          guarded++;
+          splitBlocks = true;
+        }
+      }
+
+      // the vtable loads of the calls made direct are dead now
+      if (finalMethod) {
+        for (Instruction* oldCallee : oldCallees)
+          RecursivelyDeleteTriviallyDeadInstructions(oldCallee);
+        allDirect = !oldCallees.empty() && onlyUsedByChecks(chain.vptr);
+      }
+
+      return splitBlocks;
+    }
+
+    bool onlyUsedByChecks(Value* vptr) {
+      for (User* U : vptr->users()) {
+        if (sd_getCheckIntrinsic(U))
+          continue;
+        if (!isa<CastInst>(U))
+          return false;
+        for (User* CU : U->users())
+          if (!sd_getCheckIntrinsic(CU))
+            return false;
+      }
+      return true;
+    }
+
+    bool getSlotIndex(Value* V, int64_t &index) {
+      if (IntrinsicInst* II = dyn_cast<IntrinsicInst>(V))
+        if (II->getIntrinsicID() == Intrinsic::sd_subst_vtbl_index)
+          V = II->getArgOperand(0);
+
+      ConstantInt* CI = dyn_cast<ConstantInt>(V);
+      if (!CI)
+        return false;
+
+      index = CI->getSExtValue();
+      return true;
+    }
+
+    // look up the function in the slot at slotOff of each vtable in locs
+    bool resolveTargets(const std::set<sd_vptr_loc_t> &locs, int64_t slotOff, target_map_t &targets) {
+      for (const sd_vptr_loc_t &loc : locs) {
+        GlobalVariable* gv = loc.first;
+        if (!gv->hasDefinitiveInitializer())
+          return false;
+
+        ConstantArray* vtable = dyn_cast<ConstantArray>(gv->getInitializer());
+        int64_t off = (int64_t) loc.second + slotOff;
+        if (!vtable || off < 0 || off % 8 != 0 || (uint64_t) off / 8 >= vtable->getNumOperands())
+          return false;
+
+        Function* target = dyn_cast<Function>(vtable->getOperand(off / 8)->stripPointerCasts());
+        if (!target || target->getName() == "__cxa_pure_virtual")
+          return false;
+
+        targets[loc] = target;
+      }
+
+      return !targets.empty();
+    }
+
+    bool singleTarget(const target_map_t &targets) {
+      for (auto &entry : targets)
+        if (entry.second != targets.begin()->second)
+          return false;
+      return true;
+    }
+
+    /**
+     * Turn "call %fp(args)" into
+     *   if (vptr == A1 || ...) call @target1(args)
+     *   else if (...)          call @target2(args)
+     *   else                   call %fp(args)
+     * joining the results in a phi.
+     */
+    void emitGuardedCalls(CallInst* CI, Value* vptr, const target_map_t &targets, const DataLayout &DL) {
+      LLVMContext &C = CI->getContext();
+      Type* IntPtrTy = DL.getIntPtrType(C, 0);
+      BasicBlock* BB = CI->getParent();
+      Function* F = BB->getParent();
+
+      BasicBlock* indirectBB = BB->splitBasicBlock(CI, "sd.devirt.indirect");
+      BasicBlock* joinBB = indirectBB->splitBasicBlock(CI->getNextNode(), "sd.devirt.join");
+
+      // group the vtables by the function they call
+      std::map<Function*, std::vector<sd_vptr_loc_t> > groups;
+      for (auto &entry : targets)
+        groups[entry.second].push_back(entry.first);
+
+      PHINode* PN = NULL;
+      if (!CI->getType()->isVoidTy()) {
+        PN = PHINode::Create(CI->getType(), groups.size() + 1, "sd.devirt.result", joinBB->begin());
+        CI->replaceAllUsesWith(PN);
+        PN->addIncoming(CI, indirectBB);
+      }
+
+      BB->getTerminator()->eraseFromParent();
+      IRBuilder<> builder(BB);
+      Value* vptrInt = builder.CreatePtrToInt(vptr, IntPtrTy);
+
+      for (auto &group : groups) {
+        Value* match = NULL;
+        for (const sd_vptr_loc_t &loc : group.second) {
+          Constant* addr = ConstantExpr::getAdd(ConstantExpr::getPtrToInt(loc.first, IntPtrTy),
+                                                ConstantInt::get(IntPtrTy, loc.second));
+          Value* eq = builder.CreateICmpEQ(vptrInt, addr);
+          match = match ? builder.CreateOr(match, eq) : eq;
+        }
+
+        BasicBlock* directBB = BasicBlock::Create(C, "sd.devirt.direct", F, indirectBB);
+        BasicBlock* nextBB = BasicBlock::Create(C, "sd.devirt.next", F, indirectBB);
+        builder.CreateCondBr(match, directBB, nextBB);
+
+        CallInst* directCall = cast<CallInst>(CI->clone());
+        directCall->setCalledFunction(ConstantExpr::getBitCast(group.first, CI->getCalledValue()->getType()));
+        directBB->getInstList().push_back(directCall);
+        BranchInst::Create(joinBB, directBB);
+
+        if (PN)
+          PN->addIncoming(directCall, directBB);
+
+        builder.SetInsertPoint(nextBB);
+      }
+
+      builder.CreateBr(indirectBB);
+    }
+  };
+}
+
+char SDDevirt::ID = 0;
+
+INITIALIZE_PASS(SDDevirt, "sddevirt", "Devirtualize checked virtual calls with few targets", false, false)
+
+ModulePass* llvm::createSDDevirtPass() {
+  return new SDDevirt();
+}
@@ -0,0 +1,330 @@
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/SafeDispatch.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+#include "llvm/Transforms/IPO/SafeDispatchLog.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+#include "llvm/Transforms/IPO/SafeDispatchChecks.h"
+
+#include <vector>
+#include <set>
+#include <map>
+#include <tuple>
+
+// you have to modify the following 4 files for each additional LLVM pass
+// 1. include/llvm/IPO.h
+// 2. lib/Transforms/IPO/IPO.cpp
+// 3. include/llvm/LinkAllPasses.h
+// 4. include/llvm/InitializePasses.h
+// 5. lib/Transforms/IPO/PassManagerBuilder.cpp
+
+using namespace llvm;
+
+namespace {
+  /**
+   * Removes vptr checks whose vptr provably holds a vtable the check accepts.
+   * The vptr of an object is known after a constructor stored it: either the
+   * store is visible in the function (inlined constructor), or the object was
+   * passed to a constructor whose last store to the vptr field is known on
+   * every return. For internal functions, the vptr of an argument is known at
+   * the entry when every caller passes an object with the same known vptr.
+   *
+   * The vptr is followed backwards from the checked load through straight
+   * line code only. Any call taking the object that is not a known
+   * constructor, and any store that may write the vptr field, ends the
+   * search, so a corrupted vptr is still caught by its check.
+   */
+  struct SDKnownType : public ModulePass {
+    static char ID; // Pass identification, replacement for typeid
+
+    SDKnownType() : ModulePass(ID) {
+      sd_print("initializing SDKnownType pass\n");
+      initializeSDKnownTypePass(*PassRegistry::getPassRegistry());
+    }
+
+    virtual ~SDKnownType() {
+      sd_print("deleting SDKnownType pass\n");
+    }
+
+    bool runOnModule(Module &M) override {
+      AA = &getAnalysis<AliasAnalysis>();
+      DL = &M.getDataLayout();
+      uint64_t totalChecks = 0;
+      uint64_t removed = 0;
+
+      sd_print("\n P4d. Started running the SDKnownType pass ...\n");
+
+      for (Function &F : M) {
+        if (F.isDeclaration())
+          continue;
+
+        std::vector<sd_check_chain_t> chains;
+        sd_collectCheckChains(F, chains);
+        totalChecks += chains.size();
+
+        std::vector<CallInst*> headChecks;
+        for (sd_check_chain_t &chain : chains) {
+          if (isKnownSafe(chain))
+            headChecks.push_back(sd_bypassCheckChain(chain));
+        }
+
+        if (headChecks.empty())
+          continue;
+
+        removeUnreachableBlocks(F);
+        for (CallInst *check : headChecks)
+          RecursivelyDeleteTriviallyDeadInstructions(check);
+        removed += headChecks.size();
+      }
+
+      sdLog::stream() << "SDKnownType: removed " << removed << " of " << totalChecks
+                      << " vptr checks on objects of known type in " << M.getModuleIdentifier() << "\n";
+
+      exitSummaries.clear();
+      entrySummaries.clear();
+
+      sd_print("\n P4d. Finished running the SDKnownType pass ...\n");
+      return removed > 0;
+    }
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+      AU.addRequired<AliasAnalysis>();
+    }
+
+  private:
+    // the vptr field of an object: base pointer and byte offset
+    typedef std::pair<Value*, int64_t> vptr_field_t;
+    // per function, argument number and vptr offset
+    typedef std::tuple<Function*, unsigned, int64_t> summary_key_t;
+
+    enum { SD_WALK_LIMIT = 512 };
+
+    AliasAnalysis* AA;
+    const DataLayout* DL;
+
+    // known vptr on return / at entry, NULL location when unknown
+    std::map<summary_key_t, sd_vptr_loc_t> exitSummaries;
+    std::map<summary_key_t, sd_vptr_loc_t> entrySummaries;
+
+    static bool isKnown(const sd_vptr_loc_t &loc) {
+      return loc.first != NULL;
+    }
+
+    bool isKnownSafe(const sd_check_chain_t &chain) {
+      LoadInst* LD = dyn_cast<LoadInst>(chain.vptr);
+      if (!LD || !LD->isSimple())
+        return false;
+
+      vptr_field_t field;
+      field.first = GetPointerBaseWithConstantOffset(LD->getPointerOperand(), field.second, *DL);
+
+      sd_vptr_loc_t known = knownVptrBefore(LD, field);
+      if (!isKnown(known))
+        return false;
+
+      std::set<sd_vptr_loc_t> locs;
+      return sd_getChainLocations(chain, locs, true) && locs.count(known);
+    }
+
+    /**
+     * The vptr held by field right before I, found by walking back through
+     * single predecessor blocks.
+     */
+    sd_vptr_loc_t knownVptrBefore(Instruction* I, const vptr_field_t &field) {
+      BasicBlock* BB = I->getParent();
+      BasicBlock::iterator it = I;
+      unsigned steps = 0;
+
+      while (steps++ < SD_WALK_LIMIT) {
+        if (it == BB->begin()) {
+          if (BasicBlock* pred = BB->getSinglePredecessor()) {
+            BB = pred;
+            it = BB->end();
+            continue;
+          }
+
+          // reached the entry with the field of an argument
+          Argument* arg = dyn_cast<Argument>(field.first);
+          if (BB == &BB->getParent()->getEntryBlock() && arg)
+            return knownAtEntry(BB->getParent(), arg->getArgNo(), field.second);
+
+          return sd_vptr_loc_t(NULL, 0);
+        }
+
+        it--;
+        bool unknown = false;
+        sd_vptr_loc_t found = vptrSetBy(it, field, unknown);
+
+        if (isKnown(found) || unknown)
+          return found;
+      }
+
+      return sd_vptr_loc_t(NULL, 0);
+    }
+
+    /**
+     * What instruction I does to the vptr field: returns the vptr it stores,
+     * or sets unknown when it may change the field in an unknown way.
+     */
+    sd_vptr_loc_t vptrSetBy(Instruction* I, const vptr_field_t &field, bool &unknown) {
+      sd_vptr_loc_t none(NULL, 0);
+
+      if (StoreInst* SI = dyn_cast<StoreInst>(I)) {
+        int64_t off;
+        Value* base = GetPointerBaseWithConstantOffset(SI->getPointerOperand(), off, *DL);
+
+        if (base == field.first) {
+          uint64_t size = DL->getTypeStoreSize(SI->getValueOperand()->getType());
+          if (off == field.second && size == DL->getPointerSize() && SI->isSimple()) {
+            sd_vptr_loc_t loc;
+            if (sd_getConstVptrLoc(SI->getValueOperand(), *DL, loc))
+              return loc;
+            unknown = true;
+            return none;
+          }
+
+          // another field of the same object
+          if (off + (int64_t) size <= field.second || off >= field.second + (int64_t) DL->getPointerSize())
+            return none;
+        }
+
+        unknown = mayModifyField(I, field);
+        return none;
+      }
+
+      if (isa<DbgInfoIntrinsic>(I))
+        return none;
+
+      CallSite CS(I);
+      if (CS) {
+        // a constructor (or any function with a known exit vptr) the object is passed to
+        for (unsigned i = 0; i < CS.arg_size(); i++) {
+          int64_t off;
+          Value* base = GetPointerBaseWithConstantOffset(CS.getArgument(i), off, *DL);
+          if (base != field.first)
+            continue;
+
+          Function* callee = CS.getCalledFunction();
+          if (callee && !callee->isDeclaration() && !callee->mayBeOverridden()) {
+            sd_vptr_loc_t loc = knownAtExit(callee, i, field.second - off);
+            if (isKnown(loc))
+              return loc;
+          }
+
+          if (!CS.onlyReadsMemory()) {
+            unknown = true;
+            return none;
+          }
+        }
+      }
+
+      if (I->mayWriteToMemory())
+        unknown = mayModifyField(I, field);
+      return none;
+    }
+
+    bool mayModifyField(Instruction* I, const vptr_field_t &field) {
+      AliasAnalysis::Location loc(field.first, AliasAnalysis::UnknownSize);
+      return AA->getModRefInfo(I, loc) & AliasAnalysis::Mod;
+    }
+
+    /**
+     * The vptr at offset off of argument argNo when F returns, if it is the
+     * same on every return.
+     */
+    sd_vptr_loc_t knownAtExit(Function* F, unsigned argNo, int64_t off) {
+      summary_key_t key(F, argNo, off);
+      auto it = exitSummaries.find(key);
+      if (it != exitSummaries.end())
+        return it->second;
+
+      // unknown while being computed, so recursion ends
+      exitSummaries[key] = sd_vptr_loc_t(NULL, 0);
+
+      Function::arg_iterator arg = F->arg_begin();
+      std::advance(arg, argNo);
+      vptr_field_t field(arg, off);
+      sd_vptr_loc_t result(NULL, 0);
+      bool first = true;
+
+      for (BasicBlock &BB : *F) {
+        if (isa<UnreachableInst>(BB.getTerminator()))
+          continue;
+
+        // unwinding may leave a partially constructed object
+        if (!isa<ReturnInst>(BB.getTerminator()))
+          return sd_vptr_loc_t(NULL, 0);
+
+        sd_vptr_loc_t loc = knownVptrBefore(BB.getTerminator(), field);
+        if (!isKnown(loc) || (!first && loc != result))
+          return sd_vptr_loc_t(NULL, 0);
+
+        result = loc;
+        first = false;
+      }
+
+      exitSummaries[key] = result;
+      return result;
+    }
+
+    /**
+     * The vptr at offset off of argument argNo when F is entered, if F is
+     * internal and every caller passes an object with the same known vptr.
+     */
+    sd_vptr_loc_t knownAtEntry(Function* F, unsigned argNo, int64_t off) {
+      summary_key_t key(F, argNo, off);
+      auto it = entrySummaries.find(key);
+      if (it != entrySummaries.end())
+        return it->second;
+
+      entrySummaries[key] = sd_vptr_loc_t(NULL, 0);
+
+      if (!F->hasLocalLinkage())
+        return sd_vptr_loc_t(NULL, 0);
+
+      sd_vptr_loc_t result(NULL, 0);
+      bool first = true;
+
+      for (User* U : F->users()) {
+        CallSite CS(U);
+        if (!CS || CS.getCalledValue()->stripPointerCasts() != F || CS.arg_size() <= argNo)
+          return sd_vptr_loc_t(NULL, 0);
+
+        vptr_field_t field;
+        field.first = GetPointerBaseWithConstantOffset(CS.getArgument(argNo), field.second, *DL);
+        field.second += off;
+
+        sd_vptr_loc_t loc = knownVptrBefore(CS.getInstruction(), field);
+        if (!isKnown(loc) || (!first && loc != result))
+          return sd_vptr_loc_t(NULL, 0);
+
+        result = loc;
+        first = false;
+      }
+
+      entrySummaries[key] = result;
+      return result;
+    }
+  };
+}
+
+char SDKnownType::ID = 0;
+
+INITIALIZE_PASS_BEGIN(SDKnownType, "sdknowntype", "Remove vptr checks on objects of known dynamic type", false, false)
+INITIALIZE_AG_DEPENDENCY(AliasAnalysis)
+INITIALIZE_PASS_END(SDKnownType, "sdknowntype", "Remove vptr checks on objects of known dynamic type", false, false)
+
+ModulePass* llvm::createSDKnownTypePass() {
+  return new SDKnownType();
+}
@@ -0,0 +1,542 @@
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/SafeDispatch.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalAlias.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+
+#include "llvm/Transforms/IPO/SafeDispatchCHA.h"
+#include "llvm/Transforms/IPO/SafeDispatchLog.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+#include "llvm/Transforms/IPO/SafeDispatchMD.h"
+#include "llvm/Transforms/IPO/SafeDispatchTools.h"
+
+#include <vector>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <limits>
+
+// you have to modify the following 4 files for each additional LLVM pass
+// 1. include/llvm/IPO.h
+// 2. lib/Transforms/IPO/IPO.cpp
+// 3. include/llvm/LinkAllPasses.h
+// 4. include/llvm/InitializePasses.h
+// 5. lib/Transforms/IPO/PassManagerBuilder.cpp
+
+using namespace llvm;
+
+// first two bytes of "movabs $imm64, %r11", the marker after a return site
+static const uint16_t SD_RET_SITE_OPCODE = 0xbb49;
+
+static std::string sd_getClassNameFromMD(MDNode* mdNode) {
+  MDTuple* mdTuple = cast<MDTuple>(mdNode);
+  MDNode* nameMdNode = cast<MDNode>(mdTuple->getOperand(0).get());
+  return cast<MDString>(nameMdNode->getOperand(0))->getString();
+}
+
+static std::string sd_getFunctionNameFromMD(MDNode* mdNode) {
+  return cast<MDString>(mdNode->getOperand(0))->getString();
+}
+
+namespace {
+  /**
+   * Checks on return from a virtual function that it returns to a call site
+   * allowed to call it. SDBuildCHA::buildFunctionInfo numbers the functions
+   * in the vtables so that a function and its overriders get consecutive
+   * IDs. Every call site that may reach a checked function is followed by
+   *
+   *   movabs $(lo | hi << 32), %r11
+   *
+   * holding the IDs [lo, hi] it may call: the range of its static callee for
+   * virtual calls, the callee's ID for direct calls and all IDs for other
+   * indirect calls. The X86 backend emits the marker for calls with
+   * SD_MD_RET_SITE metadata. Before each return, a checked function loads
+   * the marker through its return address and traps unless one of its IDs
+   * lies in [lo, hi].
+   *
+   * Only internal functions whose address is used by nothing but calls and
+   * vtables are checked, all their callers are in the module then and carry
+   * the marker. A vtable only counts if it is internal and every class in its
+   * type_info graph is defined in the module: code outside the module (e.g.
+   * libstdc++ calling streambuf::overflow or thread::_Impl::_M_run) calls the
+   * overriders of its own classes without the marker. Objects of classes
+   * known only to the module are assumed not to be called through by
+   * other code, which is why the pass is opt-in (-plugin-opt=sd-return-range).
+   *
+   * The pass runs twice. Before SDLayoutBuilder it needs the CHA and the
+   * sd.get.checked.vptr intrinsics: it picks the checked functions, inserts
+   * their return checks, gives them the SD_ATTR_RET_RANGE attribute and
+   * puts the range of each virtual call site on the call. The second run
+   * (markSites) comes after every pass that may still merge, clone or
+   * create calls, right before code generation, and marks the call sites
+   * of the final IR: direct calls with the callee's ID, indirect calls with
+   * the range they got in the first run or, if a pass like SimplifyCFG
+   * merged two calls and dropped it, with all IDs.
+   */
+  struct SDReturnRange : public ModulePass {
+    static char ID; // Pass identification, replacement for typeid
+
+    SDReturnRange(bool markSites = false) : ModulePass(ID), markSites(markSites) {
+      sd_print("initializing SDReturnRange pass\n");
+      initializeSDReturnRangePass(*PassRegistry::getPassRegistry());
+    }
+
+    virtual ~SDReturnRange() {
+      sd_print("deleting SDReturnRange pass\n");
+    }
+
+    bool runOnModule(Module &M) override {
+      sd_print("\n P7b. Started running the SDReturnRange pass ...\n");
+
+      if (Triple(M.getTargetTriple()).getArch() != Triple::x86_64) {
+        sdLog::warn() << "SDReturnRange: return checks are only implemented for x86-64\n";
+        return false;
+      }
+
+      if (markSites) {
+        bool changed = markCallSites(M);
+        sd_print("\n P7b. Finished running the SDReturnRange pass ...\n");
+        return changed;
+      }
+
+      CHA = &getAnalysis<SDBuildCHA>();
+      if (!CHA->hasFunctionInfo())
+        CHA->buildFunctionInfo();
+
+      for (auto &entry : CHA->getFunctionIDs())
+        idsOf[entry.first.functionName].push_back(entry.second);
+
+      if (idsOf.empty()) {
+        sd_print("\n P7b. Finished running the SDReturnRange pass ...\n");
+        return false;
+      }
+
+      collectVirtualCallSites(M);
+      chooseCheckedFunctions(M);
+
+      // a musttail call returns to the caller's call site
+      for (Function &F : M) {
+        for (BasicBlock &BB : F) {
+          for (Instruction &I : BB) {
+            CallInst* CI = dyn_cast<CallInst>(&I);
+            if (!CI || !CI->isMustTailCall() || isa<InlineAsm>(CI->getCalledValue()) ||
+                isa<IntrinsicInst>(CI))
+              continue;
+
+            Function* callee = getCallee(CallSite(CI));
+            if (!callee || checkedFunctions.count(callee)) {
+              sdLog::warn() << "SDReturnRange: musttail call in " << F.getName()
+                            << ", no return checks in " << M.getModuleIdentifier() << "\n";
+              clear();
+              return false;
+            }
+          }
+        }
+      }
+
+      for (auto &site : virtualSiteRanges)
+        markReturnSite(site.first, site.second);
+
+      uint64_t checkedReturns = 0;
+      for (auto &checked : checkedFunctions) {
+        checkedReturns += insertReturnChecks(*checked.first, checked.second);
+        checked.first->addFnAttr(SD_ATTR_RET_RANGE, utostr(checked.second[0]));
+      }
+
+      sdLog::stream() << "SDReturnRange: checked " << checkedReturns << " returns of "
+                      << checkedFunctions.size() << " functions, "
+                      << virtualSiteRanges.size() << " virtual call sites in "
+                      << M.getModuleIdentifier() << "\n";
+
+      bool changed = !checkedFunctions.empty() || !virtualSiteRanges.empty();
+      clear();
+
+      sd_print("\n P7b. Finished running the SDReturnRange pass ...\n");
+      return changed;
+    }
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+      if (markSites)
+        return;
+      AU.addRequired<SDBuildCHA>();
+      AU.addPreserved<SDBuildCHA>();
+    }
+
+  private:
+    typedef SDBuildCHA::range_t range_t;
+
+    bool markSites;
+    SDBuildCHA* CHA;
+    std::map<std::string, std::vector<uint64_t> > idsOf;
+    std::map<Instruction*, range_t> virtualSiteRanges;
+    std::map<Function*, std::vector<uint64_t> > checkedFunctions;
+    std::map<GlobalVariable*, bool> closedVTables;
+
+    void clear() {
+      idsOf.clear();
+      virtualSiteRanges.clear();
+      checkedFunctions.clear();
+      closedVTables.clear();
+    }
+
+    /**
+     * Marks every call site that may reach a function with return checks,
+     * on the IR code generation gets.
+     */
+    bool markCallSites(Module &M) {
+      std::map<Function*, uint64_t> firstIDs;
+      for (Function &F : M) {
+        uint64_t id;
+        if (F.hasFnAttribute(SD_ATTR_RET_RANGE) &&
+            !F.getFnAttribute(SD_ATTR_RET_RANGE).getValueAsString().getAsInteger(10, id))
+          firstIDs[&F] = id;
+      }
+
+      if (firstIDs.empty())
+        return false;
+
+      // any ID, for call sites whose range is not known anymore
+      range_t allIDs(0, std::numeric_limits<uint32_t>::max());
+      uint64_t virtualSites = 0;
+      uint64_t directSites = 0;
+      uint64_t indirectSites = 0;
+
+      for (Function &F : M) {
+        for (BasicBlock &BB : F) {
+          for (Instruction &I : BB) {
+            CallSite CS(&I);
+            if (!CS || isa<InlineAsm>(CS.getCalledValue()) || isa<IntrinsicInst>(&I))
+              continue;
+
+            if (Function* callee = getCallee(CS)) {
+              auto checked = firstIDs.find(callee);
+              if (checked == firstIDs.end())
+                continue;
+              markReturnSite(&I, range_t(checked->second, checked->second));
+              directSites++;
+            } else if (I.getMetadata(SD_MD_RET_SITE)) {
+              virtualSites++;
+            } else {
+              markReturnSite(&I, allIDs);
+              indirectSites++;
+            }
+          }
+        }
+      }
+
+      sdLog::stream() << "SDReturnRange: marked " << virtualSites << " virtual, "
+                      << directSites << " direct and " << indirectSites
+                      << " other indirect call sites in " << M.getModuleIdentifier() << "\n";
+      return true;
+    }
+
+    static Function* getCallee(CallSite CS) {
+      Value* callee = CS.getCalledValue()->stripPointerCasts();
+      if (GlobalAlias* GA = dyn_cast<GlobalAlias>(callee))
+        callee = GA->getAliasee()->stripPointerCasts();
+      return dyn_cast<Function>(callee);
+    }
+
+    /**
+     * The ID range of every virtual call site, from the static callee of its
+     * sd.get.checked.vptr intrinsic.
+     */
+    void collectVirtualCallSites(Module &M) {
+      Function* intrinsic = M.getFunction(Intrinsic::getName(Intrinsic::sd_get_checked_vptr));
+      if (!intrinsic)
+        return;
+
+      sd_linked_calls_t linkedCalls;
+      sd_collectLinkedCalls(intrinsic, linkedCalls);
+
+      for (User* U : intrinsic->users()) {
+        CallInst* CI = cast<CallInst>(U);
+        range_t range;
+        if (!getStaticCalleeRange(CI, range))
+          continue;
+
+        std::vector<Instruction*> calls;
+        if (Instruction* linked = sd_getLinkedCall(CI, linkedCalls))
+          calls.push_back(linked);
+        else
+          findCallsThrough(CI, calls);
+
+        for (Instruction* call : calls) {
+          auto it = virtualSiteRanges.find(call);
+          if (it == virtualSiteRanges.end()) {
+            virtualSiteRanges[call] = range;
+          } else {
+            it->second.first = std::min(it->second.first, range.first);
+            it->second.second = std::max(it->second.second, range.second);
+          }
+        }
+      }
+    }
+
+    bool getStaticCalleeRange(CallInst* CI, range_t &range) {
+      MDNode* classMD = cast<MDNode>(cast<MetadataAsValue>(CI->getArgOperand(1))->getMetadata());
+      MDNode* preciseMD = cast<MDNode>(cast<MetadataAsValue>(CI->getArgOperand(2))->getMetadata());
+      MDNode* functionMD = cast<MDNode>(cast<MetadataAsValue>(CI->getArgOperand(3))->getMetadata());
+
+      // calls through pointers to virtual member functions have no function name
+      std::string functionName = sd_getFunctionNameFromMD(functionMD);
+      if (functionName.empty())
+        return false;
+
+      return CHA->getFunctionRange(functionName, sd_getClassNameFromMD(preciseMD), range) ||
+             CHA->getFunctionRange(functionName, sd_getClassNameFromMD(classMD), range);
+    }
+
+    // the calls through a function pointer loaded from the checked vptr
+    static void findCallsThrough(Value* vptr, std::vector<Instruction*> &calls) {
+      std::vector<std::pair<Value*, unsigned> > worklist(1, std::make_pair(vptr, 0u));
+
+      while (!worklist.empty()) {
+        Value* V = worklist.back().first;
+        unsigned depth = worklist.back().second;
+        worklist.pop_back();
+
+        for (User* U : V->users()) {
+          CallSite CS(U);
+          if (CS && CS.getCalledValue()->stripPointerCasts() == V->stripPointerCasts()) {
+            calls.push_back(CS.getInstruction());
+            continue;
+          }
+
+          if (depth < 4 && (isa<CastInst>(U) || isa<GetElementPtrInst>(U) || isa<LoadInst>(U)))
+            worklist.push_back(std::make_pair(U, depth + 1));
+        }
+      }
+    }
+
+    /**
+     * A function is checked if it has function IDs, under its own name or
+     * the name of an alias, is internal and is only called or put in vtables.
+     */
+    void chooseCheckedFunctions(Module &M) {
+      for (Function &F : M) {
+        if (F.isDeclaration() || !F.hasLocalLinkage() || hasMustTailCall(F))
+          continue;
+
+        std::vector<uint64_t> ids;
+        if (!collectIDs(&F, &F, ids) || ids.empty())
+          continue;
+
+        std::sort(ids.begin(), ids.end());
+        checkedFunctions[&F] = ids;
+      }
+    }
+
+    // the IDs of GV (F or one of its aliases), false if a use of GV is unknown
+    bool collectIDs(GlobalValue* GV, Function* F, std::vector<uint64_t> &ids) {
+      auto it = idsOf.find(GV->getName());
+      if (it != idsOf.end())
+        ids.insert(ids.end(), it->second.begin(), it->second.end());
+
+      for (User* U : GV->users()) {
+        if (GlobalAlias* GA = dyn_cast<GlobalAlias>(U)) {
+          if (!GA->hasLocalLinkage() || !collectIDs(GA, F, ids))
+            return false;
+          continue;
+        }
+
+        if (!isCallOrVTableUse(U, GV))
+          return false;
+      }
+
+      return true;
+    }
+
+    // is U, a user of callee or of a constant built from it, a call of callee or
+    // a vtable only the module calls through
+    bool isCallOrVTableUse(User* U, Value* callee) {
+      CallSite CS(U);
+      if (CS) {
+        for (CallSite::arg_iterator arg = CS.arg_begin(); arg != CS.arg_end(); ++arg)
+          if ((*arg)->stripPointerCasts() == callee)
+            return false;
+        return CS.getCalledValue()->stripPointerCasts() == callee && !CS.isMustTailCall();
+      }
+
+      if (GlobalVariable* GV = dyn_cast<GlobalVariable>(U))
+        return (GV->getName().startswith("_ZTV") || GV->getName().startswith("_ZTC")) &&
+               isClosedVTable(GV);
+
+      if (isa<ConstantExpr>(U) || isa<ConstantArray>(U) || isa<ConstantStruct>(U)) {
+        for (User* UU : U->users())
+          if (!isCallOrVTableUse(UU, callee))
+            return false;
+        return true;
+      }
+
+      return false;
+    }
+
+    /**
+     * true if vtable cannot be reached from outside the module: it is internal
+     * and the type_info of its class and of all its bases is defined in the
+     * module. Without RTTI nothing is known about the bases.
+     */
+    bool isClosedVTable(GlobalVariable* vtable) {
+      auto cached = closedVTables.find(vtable);
+      if (cached != closedVTables.end())
+        return cached->second;
+
+      // every address point of the vtable is preceded by the type_info of the class
+      bool closed = false;
+      if (vtable->hasLocalLinkage() && vtable->hasInitializer()) {
+        std::set<GlobalVariable*> visited;
+        for (Use &entry : vtable->getInitializer()->operands()) {
+          GlobalVariable* GV = dyn_cast<GlobalVariable>(entry->stripPointerCasts());
+          if (GV && GV->getName().startswith("_ZTI")) {
+            closed = isDefinedTypeInfo(GV, visited);
+            break;
+          }
+        }
+      }
+
+      closedVTables[vtable] = closed;
+      return closed;
+    }
+
+    // the type_info V and the base type_infos it refers to are all defined here
+    static bool isDefinedTypeInfo(Value* V, std::set<GlobalVariable*> &visited) {
+      GlobalVariable* typeInfo = dyn_cast<GlobalVariable>(V);
+      if (!typeInfo || !typeInfo->getName().startswith("_ZTI") || typeInfo->isDeclaration())
+        return false;
+
+      if (!visited.insert(typeInfo).second)
+        return true;
+
+      std::vector<Constant*> worklist(1, typeInfo->getInitializer());
+      while (!worklist.empty()) {
+        Constant* C = worklist.back();
+        worklist.pop_back();
+
+        for (Use &op : C->operands()) {
+          Constant* opC = cast<Constant>(op->stripPointerCasts());
+          GlobalVariable* GV = dyn_cast<GlobalVariable>(opC);
+
+          if (GV && GV->getName().startswith("_ZTI")) {
+            if (!isDefinedTypeInfo(GV, visited))
+              return false;
+          } else if (isa<ConstantStruct>(opC) || isa<ConstantArray>(opC)) {
+            worklist.push_back(opC);
+          }
+        }
+      }
+
+      return true;
+    }
+
+    static bool hasMustTailCall(Function &F) {
+      for (BasicBlock &BB : F)
+        for (Instruction &I : BB)
+          if (CallInst* CI = dyn_cast<CallInst>(&I))
+            if (CI->isMustTailCall())
+              return true;
+      return false;
+    }
+
+    void markReturnSite(Instruction* I, const range_t &range) {
+      LLVMContext& C = I->getContext();
+      MDBuilder MDB(C);
+      Metadata* ops[] = {
+        MDB.createConstant(ConstantInt::get(Type::getInt64Ty(C), range.first)),
+        MDB.createConstant(ConstantInt::get(Type::getInt64Ty(C), range.second))
+      };
+      I->setMetadata(SD_MD_RET_SITE, MDNode::get(C, ops));
+
+      // the marker is only emitted after calls that return here
+      if (CallInst* CI = dyn_cast<CallInst>(I))
+        CI->setTailCall(false);
+    }
+
+    /**
+     * Before each return of F:
+     *
+     *   %ra = llvm.returnaddress(0)
+     *   trap unless (i16) ra[0] == 0xbb49 and (id - lo) <= (hi - lo) for an id of F
+     *
+     * where lo and hi are the two halves of the marker's immediate at ra + 2.
+     */
+    uint64_t insertReturnChecks(Function &F, const std::vector<uint64_t> &ids) {
+      Module &M = *F.getParent();
+      LLVMContext& C = M.getContext();
+      Type* i16Ty = Type::getInt16Ty(C);
+      Type* i32Ty = Type::getInt32Ty(C);
+      MDNode* likely = MDBuilder(C).createBranchWeights(1 << 20, 1);
+
+      std::vector<ReturnInst*> returns;
+      for (BasicBlock &BB : F)
+        if (ReturnInst* RI = dyn_cast<ReturnInst>(BB.getTerminator()))
+          returns.push_back(RI);
+
+      if (returns.empty())
+        return 0;
+
+      BasicBlock* trapBB = BasicBlock::Create(C, "sd.ret.trap", &F);
+      IRBuilder<> trapBuilder(trapBB);
+      trapBuilder.CreateCall(Intrinsic::getDeclaration(&M, Intrinsic::trap));
+      trapBuilder.CreateUnreachable();
+
+      Function* returnAddress = Intrinsic::getDeclaration(&M, Intrinsic::returnaddress);
+
+      for (ReturnInst* RI : returns) {
+        BasicBlock* BB = RI->getParent();
+        BasicBlock* retBB = BB->splitBasicBlock(RI, "sd.ret");
+        BasicBlock* rangeBB = BasicBlock::Create(C, "sd.ret.range", &F, retBB);
+        BB->getTerminator()->eraseFromParent();
+
+        IRBuilder<> builder(BB);
+        Value* ra = builder.CreateCall(returnAddress, builder.getInt32(0), "sd.ra");
+        LoadInst* opcode = builder.CreateLoad(builder.CreateBitCast(ra, i16Ty->getPointerTo()));
+        opcode->setAlignment(1);
+        builder.CreateCondBr(builder.CreateICmpEQ(opcode, ConstantInt::get(i16Ty, SD_RET_SITE_OPCODE)),
+                             rangeBB, trapBB, likely);
+
+        builder.SetInsertPoint(rangeBB);
+        LoadInst* lo = builder.CreateLoad(
+          builder.CreateBitCast(builder.CreateConstGEP1_64(ra, 2), i32Ty->getPointerTo()), "sd.ret.lo");
+        LoadInst* hi = builder.CreateLoad(
+          builder.CreateBitCast(builder.CreateConstGEP1_64(ra, 6), i32Ty->getPointerTo()), "sd.ret.hi");
+        lo->setAlignment(1);
+        hi->setAlignment(1);
+
+        Value* width = builder.CreateSub(hi, lo);
+        Value* valid = NULL;
+        for (uint64_t id : ids) {
+          Value* inRange = builder.CreateICmpULE(builder.CreateSub(ConstantInt::get(i32Ty, id), lo), width);
+          valid = valid ? builder.CreateOr(valid, inRange) : inRange;
+        }
+        builder.CreateCondBr(valid, retBB, trapBB, likely);
+      }
+
+      // llvm.returnaddress would read the caller's return address once inlined
+      F.addFnAttr(Attribute::NoInline);
+      return returns.size();
+    }
+  };
+}
+
+char SDReturnRange::ID = 0;
+
+INITIALIZE_PASS_BEGIN(SDReturnRange, "sdreturnrange", "Check returns against the function ID range of the call site", false, false)
+INITIALIZE_PASS_DEPENDENCY(SDBuildCHA)
+INITIALIZE_PASS_END(SDReturnRange, "sdreturnrange", "Check returns against the function ID range of the call site", false, false)
+
+ModulePass* llvm::createSDReturnRangePass(bool markSites) {
+  return new SDReturnRange(markSites);
+}
@@ -0,0 +1,397 @@
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/SafeDispatch.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalAlias.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "llvm/Transforms/IPO/SafeDispatchLog.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+#include "llvm/Transforms/IPO/SafeDispatchMD.h"
+
+#include <vector>
+#include <set>
+#include <map>
+
+// you have to modify the following 4 files for each additional LLVM pass
+// 1. include/llvm/IPO.h
+// 2. lib/Transforms/IPO/IPO.cpp
+// 3. include/llvm/LinkAllPasses.h
+// 4. include/llvm/InitializePasses.h
+// 5. lib/Transforms/IPO/PassManagerBuilder.cpp
+
+using namespace llvm;
+
+static cl::opt<bool>
+SDReturnIndirect("sd-return-indirect", cl::init(false),
+                 cl::desc("Also check the returns of internal functions whose address is "
+                          "taken, assuming only indirect calls in the module reach them"));
+
+// first two bytes of "movabs $imm64, %r11" (SD_RET_SITE) and "movl $imm32, %r11d" (SD_RET_SITE_ID)
+static const uint16_t SD_RET_SITE_OPCODE = 0xbb49;
+static const uint16_t SD_RET_SITE_ID_OPCODE = 0xbb41;
+static const unsigned SD_RET_SITE_SIZE = 10;
+
+// a run of consecutive call site IDs, an empty run matches no ID
+static const uint32_t SD_EMPTY_RUN = 0xffffffff;
+
+namespace {
+  /**
+   * Checks on return from a non-virtual function that it returns to one of
+   * its call sites. Every call site that may reach a checked function gets
+   * an ID, emitted after the call as "movl $id, %r11d" by the X86 backend
+   * for calls with SD_MD_RET_SITE_ID metadata. The IDs are given out so that
+   * the valid sites of a function form at most two runs: its direct call
+   * sites, and the indirect call sites of its function type when its
+   * address is taken (-sd-return-indirect). The runs of each function are
+   * its return table, a sorted 16 byte read-only array
+   *
+   *   @sd.ret.table.<function> = [lo0, hi0 - lo0, lo1, hi1 - lo1]
+   *
+   * so a return check reads one cache line and does two range compares, no
+   * matter how many call sites there are. Building the tables is linear in
+   * the number of call sites.
+   *
+   * Functions in vtables and those SDReturnRange checks are left alone. Only
+   * internal functions are checked, and without -sd-return-indirect only
+   * those that are called directly and never have their address taken.
+   * Checked functions are not inlined and their calls are no tail calls
+   * anymore, so the pass is opt-in (-plugin-opt=sd-return-table).
+   *
+   * The pass runs last, right before code generation. The IDs are given to
+   * the calls code generation gets, so no later pass can merge two call
+   * sites and drop an ID, and nothing folds the loads from the tables.
+   */
+  struct SDReturnTable : public ModulePass {
+    static char ID; // Pass identification, replacement for typeid
+
+    SDReturnTable() : ModulePass(ID) {
+      sd_print("initializing SDReturnTable pass\n");
+      initializeSDReturnTablePass(*PassRegistry::getPassRegistry());
+    }
+
+    virtual ~SDReturnTable() {
+      sd_print("deleting SDReturnTable pass\n");
+    }
+
+    bool runOnModule(Module &M) override {
+      sd_print("\n P7c. Started running the SDReturnTable pass ...\n");
+
+      if (Triple(M.getTargetTriple()).getArch() != Triple::x86_64) {
+        sdLog::warn() << "SDReturnTable: return checks are only implemented for x86-64\n";
+        return false;
+      }
+
+      chooseCheckedFunctions(M);
+      if (checked.empty()) {
+        clear();
+        sd_print("\n P7c. Finished running the SDReturnTable pass ...\n");
+        return false;
+      }
+
+      collectSites(M);
+
+      // direct sites first, then the indirect sites of each function type
+      uint32_t nextID = 1;
+      uint64_t directSites = 0;
+      uint64_t indirectSites = 0;
+      for (Function* F : checkedOrder) {
+        function_info_t &info = checked[F];
+        info.direct = assignIDs(directSitesOf[F], nextID);
+        directSites += directSitesOf[F].size();
+      }
+      for (auto &group : indirectSitesOf) {
+        run_t run = assignIDs(group.second, nextID);
+        for (Function* F : checkedOrder)
+          if (checked[F].addressTaken && F->getFunctionType() == group.first)
+            checked[F].indirect = run;
+        indirectSites += group.second.size();
+      }
+
+      uint64_t checkedReturns = 0;
+      for (Function* F : checkedOrder)
+        checkedReturns += insertReturnChecks(*F, emitTable(*F, checked[F]));
+
+      sdLog::stream() << "SDReturnTable: checked " << checkedReturns << " returns of "
+                      << checkedOrder.size() << " functions, "
+                      << directSites << " direct and " << indirectSites << " indirect call sites, "
+                      << checkedOrder.size() * 16 << " bytes of return tables in "
+                      << M.getModuleIdentifier() << "\n";
+
+      clear();
+
+      sd_print("\n P7c. Finished running the SDReturnTable pass ...\n");
+      return true;
+    }
+
+  private:
+    // first ID and ID count - 1 of a run
+    typedef std::pair<uint32_t, uint32_t> run_t;
+
+    struct function_info_t {
+      bool addressTaken;
+      run_t direct;
+      run_t indirect;
+
+      function_info_t() : addressTaken(false),
+                          direct(SD_EMPTY_RUN, 0),
+                          indirect(SD_EMPTY_RUN, 0) {}
+    };
+
+    std::map<Function*, function_info_t> checked;
+    std::vector<Function*> checkedOrder;
+    DenseMap<Function*, std::vector<Instruction*> > directSitesOf;
+    std::map<FunctionType*, std::vector<Instruction*> > indirectSitesOf;
+
+    void clear() {
+      checked.clear();
+      checkedOrder.clear();
+      directSitesOf.clear();
+      indirectSitesOf.clear();
+    }
+
+    static Function* getCallee(CallSite CS) {
+      Value* callee = CS.getCalledValue()->stripPointerCasts();
+      if (GlobalAlias* GA = dyn_cast<GlobalAlias>(callee))
+        callee = GA->getAliasee()->stripPointerCasts();
+      return dyn_cast<Function>(callee);
+    }
+
+    void chooseCheckedFunctions(Module &M) {
+      for (Function &F : M) {
+        if (F.isDeclaration() || !F.hasLocalLinkage() || F.hasFnAttribute(SD_ATTR_RET_RANGE) ||
+            hasMustTailCall(F))
+          continue;
+
+        function_info_t info;
+        if (!knownUses(&F, &F, info.addressTaken))
+          continue;
+
+        checked[&F] = info;
+        checkedOrder.push_back(&F);
+      }
+    }
+
+    // false if GV (F or one of its aliases) is used in an unknown way, a
+    // vtable is one: escapes() below rejects vtables
+    bool knownUses(GlobalValue* GV, Function* F, bool &addressTaken) {
+      for (User* U : GV->users()) {
+        if (GlobalAlias* GA = dyn_cast<GlobalAlias>(U)) {
+          if (!GA->hasLocalLinkage() || !knownUses(GA, F, addressTaken))
+            return false;
+          continue;
+        }
+
+        CallSite CS(U);
+        if (CS && CS.getCalledValue()->stripPointerCasts() == GV && !CS.isMustTailCall() &&
+            !isArgument(CS, GV))
+          continue;
+
+        if (!SDReturnIndirect || escapes(U, GV))
+          return false;
+        addressTaken = true;
+      }
+
+      return true;
+    }
+
+    static bool isArgument(CallSite CS, Value* V) {
+      for (CallSite::arg_iterator arg = CS.arg_begin(); arg != CS.arg_end(); ++arg)
+        if ((*arg)->stripPointerCasts() == V)
+          return true;
+      return false;
+    }
+
+    /**
+     * Can the address of F, used by U, be called from outside the module:
+     * passed to a declaration, put in a vtable or an externally visible
+     * global, or registered as a constructor or destructor.
+     */
+    static bool escapes(User* U, Value* F) {
+      CallSite CS(U);
+      if (CS) {
+        if (CS.getCalledValue()->stripPointerCasts() == F)
+          return false;
+        Function* callee = getCallee(CS);
+        return !callee || callee->isDeclaration();
+      }
+
+      if (GlobalVariable* GV = dyn_cast<GlobalVariable>(U))
+        return !GV->hasLocalLinkage() || GV->getName().startswith("llvm.") ||
+               GV->getName().startswith("_ZTV") || GV->getName().startswith("_ZTC") ||
+               GV->getName().startswith("_SD");
+
+      if (isa<Constant>(U)) {
+        for (User* UU : U->users())
+          if (escapes(UU, F))
+            return true;
+        return false;
+      }
+
+      // stores, selects, phis: the pointer stays in the module
+      return false;
+    }
+
+    static bool hasMustTailCall(Function &F) {
+      for (BasicBlock &BB : F)
+        for (Instruction &I : BB)
+          if (CallInst* CI = dyn_cast<CallInst>(&I))
+            if (CI->isMustTailCall())
+              return true;
+      return false;
+    }
+
+    void collectSites(Module &M) {
+      std::set<FunctionType*> indirectTypes;
+      for (Function* F : checkedOrder)
+        if (checked[F].addressTaken)
+          indirectTypes.insert(F->getFunctionType());
+
+      for (Function &F : M) {
+        for (BasicBlock &BB : F) {
+          for (Instruction &I : BB) {
+            CallSite CS(&I);
+            if (!CS || isa<InlineAsm>(CS.getCalledValue()) || isa<IntrinsicInst>(&I))
+              continue;
+
+            if (Function* callee = getCallee(CS)) {
+              if (checked.count(callee))
+                directSitesOf[callee].push_back(&I);
+            } else if (indirectTypes.count(CS.getFunctionType())) {
+              indirectSitesOf[CS.getFunctionType()].push_back(&I);
+            }
+          }
+        }
+      }
+    }
+
+    run_t assignIDs(const std::vector<Instruction*> &sites, uint32_t &nextID) {
+      if (sites.empty())
+        return run_t(SD_EMPTY_RUN, 0);
+
+      LLVMContext& C = sites[0]->getContext();
+      MDBuilder MDB(C);
+      run_t run(nextID, sites.size() - 1);
+
+      for (Instruction* I : sites) {
+        Metadata* ops[] = { MDB.createConstant(ConstantInt::get(Type::getInt64Ty(C), nextID++)) };
+        I->setMetadata(SD_MD_RET_SITE_ID, MDNode::get(C, ops));
+
+        // the marker is only emitted after calls that return here
+        if (CallInst* CI = dyn_cast<CallInst>(I))
+          CI->setTailCall(false);
+      }
+
+      return run;
+    }
+
+    GlobalVariable* emitTable(Function &F, const function_info_t &info) {
+      Module &M = *F.getParent();
+      Type* i32Ty = Type::getInt32Ty(M.getContext());
+      ArrayType* tableTy = ArrayType::get(i32Ty, 4);
+
+      Constant* runs[] = {
+        ConstantInt::get(i32Ty, info.direct.first),
+        ConstantInt::get(i32Ty, info.direct.second),
+        ConstantInt::get(i32Ty, info.indirect.first),
+        ConstantInt::get(i32Ty, info.indirect.second)
+      };
+
+      GlobalVariable* table = new GlobalVariable(M, tableTy, true, GlobalValue::PrivateLinkage,
+                                                 ConstantArray::get(tableTy, runs),
+                                                 "sd.ret.table." + F.getName());
+      table->setUnnamedAddr(true);
+      // the whole table in one cache line
+      table->setAlignment(16);
+      return table;
+    }
+
+    /**
+     * Before each return of F:
+     *
+     *   %ra = llvm.returnaddress(0)
+     *   %p  = skip the SD_RET_SITE marker at %ra, if there is one
+     *   trap unless (i16) p[0] == 0xbb41 and the ID at p + 2 lies in one of
+     *   the runs of the table
+     */
+    uint64_t insertReturnChecks(Function &F, GlobalVariable* table) {
+      Module &M = *F.getParent();
+      LLVMContext& C = M.getContext();
+      Type* i16Ty = Type::getInt16Ty(C);
+      Type* i32Ty = Type::getInt32Ty(C);
+      MDNode* likely = MDBuilder(C).createBranchWeights(1 << 20, 1);
+
+      std::vector<ReturnInst*> returns;
+      for (BasicBlock &BB : F)
+        if (ReturnInst* RI = dyn_cast<ReturnInst>(BB.getTerminator()))
+          returns.push_back(RI);
+
+      if (returns.empty())
+        return 0;
+
+      BasicBlock* trapBB = BasicBlock::Create(C, "sd.ret.trap", &F);
+      IRBuilder<> trapBuilder(trapBB);
+      trapBuilder.CreateCall(Intrinsic::getDeclaration(&M, Intrinsic::trap));
+      trapBuilder.CreateUnreachable();
+
+      Function* returnAddress = Intrinsic::getDeclaration(&M, Intrinsic::returnaddress);
+
+      for (ReturnInst* RI : returns) {
+        BasicBlock* BB = RI->getParent();
+        BasicBlock* retBB = BB->splitBasicBlock(RI, "sd.ret");
+        BasicBlock* lookupBB = BasicBlock::Create(C, "sd.ret.lookup", &F, retBB);
+        BB->getTerminator()->eraseFromParent();
+
+        IRBuilder<> builder(BB);
+        Value* ra = builder.CreateCall(returnAddress, builder.getInt32(0), "sd.ra");
+        LoadInst* first = builder.CreateLoad(builder.CreateBitCast(ra, i16Ty->getPointerTo()));
+        first->setAlignment(1);
+        Value* marker = builder.CreateSelect(
+          builder.CreateICmpEQ(first, ConstantInt::get(i16Ty, SD_RET_SITE_OPCODE)),
+          builder.CreateConstGEP1_64(ra, SD_RET_SITE_SIZE), ra, "sd.ret.marker");
+        LoadInst* opcode = builder.CreateLoad(builder.CreateBitCast(marker, i16Ty->getPointerTo()));
+        opcode->setAlignment(1);
+        builder.CreateCondBr(builder.CreateICmpEQ(opcode, ConstantInt::get(i16Ty, SD_RET_SITE_ID_OPCODE)),
+                             lookupBB, trapBB, likely);
+
+        builder.SetInsertPoint(lookupBB);
+        LoadInst* id = builder.CreateLoad(
+          builder.CreateBitCast(builder.CreateConstGEP1_64(marker, 2), i32Ty->getPointerTo()), "sd.ret.id");
+        id->setAlignment(1);
+
+        Value* valid = NULL;
+        for (unsigned run = 0; run < 2; run++) {
+          Value* lo = builder.CreateLoad(builder.CreateConstInBoundsGEP2_32(table->getValueType(), table, 0, run * 2));
+          Value* width = builder.CreateLoad(builder.CreateConstInBoundsGEP2_32(table->getValueType(), table, 0, run * 2 + 1));
+          Value* inRun = builder.CreateICmpULE(builder.CreateSub(id, lo), width);
+          valid = valid ? builder.CreateOr(valid, inRun) : inRun;
+        }
+        builder.CreateCondBr(valid, retBB, trapBB, likely);
+      }
+
+      // llvm.returnaddress would read the caller's return address once inlined
+      F.addFnAttr(Attribute::NoInline);
+      return returns.size();
+    }
+  };
+}
+
+char SDReturnTable::ID = 0;
+
+INITIALIZE_PASS(SDReturnTable, "sdreturntable", "Check returns of non-virtual functions against return tables", false, false)
+
+ModulePass* llvm::createSDReturnTablePass() {
+  return new SDReturnTable();
+}
@@ -0,0 +1,277 @@
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/SafeDispatch.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "llvm/Transforms/IPO/SafeDispatchLog.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+
+#include <vector>
+
+// you have to modify the following 4 files for each additional LLVM pass
+// 1. include/llvm/IPO.h
+// 2. lib/Transforms/IPO/IPO.cpp
+// 3. include/llvm/LinkAllPasses.h
+// 4. include/llvm/InitializePasses.h
+// 5. lib/Transforms/IPO/PassManagerBuilder.cpp
+
+using namespace llvm;
+
+static cl::opt<unsigned>
+SDShadowStackSize("sd-shadowstack-size", cl::init(8 << 20),
+                  cl::desc("Size in bytes of the per thread shadow stack of return addresses"));
+
+// linux x86-64 mmap and mprotect arguments
+static const int SD_PROT_NONE = 0;
+static const int SD_PROT_READ_WRITE = 0x3;
+static const int SD_MAP_PRIVATE_ANONYMOUS_NORESERVE = 0x2 | 0x20 | 0x4000;
+static const uint64_t SD_PAGE_SIZE = 4096;
+
+namespace {
+  /**
+   * Protects every return with a shadow stack, as a baseline for the range
+   * based return checks (-plugin-opt=sd-shadowstack).
+   *
+   * Each thread gets its own shadow stack, an mmap region with a guard page
+   * on both ends, allocated on the first call in the thread. The top of the
+   * stack is the thread local sd.shadowstack.ptr. A function pushes its
+   * return address on entry and keeps the slot it pushed to. Before
+   * returning it pops to that slot and traps unless the return address on
+   * the stack is still the one in the slot.
+   *
+   * Since every function pops to its own slot rather than one entry down,
+   * frames skipped by an exception or a longjmp leave nothing behind: the
+   * landing pads and the returns of setjmp (returns_twice calls) reset the
+   * top to just above the slot of their function. The regions of exited
+   * threads are not unmapped.
+   */
+  struct SDShadowStack : public ModulePass {
+    static char ID; // Pass identification, replacement for typeid
+
+    SDShadowStack() : ModulePass(ID) {
+      sd_print("initializing SDShadowStack pass\n");
+      initializeSDShadowStackPass(*PassRegistry::getPassRegistry());
+    }
+
+    virtual ~SDShadowStack() {
+      sd_print("deleting SDShadowStack pass\n");
+    }
+
+    bool runOnModule(Module &M) override {
+      sd_print("\n P7d. Started running the SDShadowStack pass ...\n");
+
+      if (Triple(M.getTargetTriple()).getArch() != Triple::x86_64) {
+        sdLog::warn() << "SDShadowStack: the shadow stack is only implemented for x86-64 linux\n";
+        return false;
+      }
+
+      std::vector<Function*> functions;
+      for (Function &F : M)
+        if (shouldProtect(F))
+          functions.push_back(&F);
+
+      if (functions.empty()) {
+        sd_print("\n P7d. Finished running the SDShadowStack pass ...\n");
+        return false;
+      }
+
+      createShadowStack(M);
+
+      uint64_t returns = 0;
+      uint64_t resets = 0;
+      for (Function* F : functions)
+        protect(*F, returns, resets);
+
+      sdLog::stream() << "SDShadowStack: protected " << returns << " returns of "
+                      << functions.size() << " functions, " << resets
+                      << " landing pads and setjmp returns reset the shadow stack in "
+                      << M.getModuleIdentifier() << "\n";
+
+      stackPtr = NULL;
+      initFunction = NULL;
+
+      sd_print("\n P7d. Finished running the SDShadowStack pass ...\n");
+      return true;
+    }
+
+  private:
+    GlobalVariable* stackPtr = NULL;
+    Function* initFunction = NULL;
+
+    static bool shouldProtect(Function &F) {
+      if (F.isDeclaration() || F.hasFnAttribute(Attribute::Naked))
+        return false;
+
+      bool hasReturn = false;
+      for (BasicBlock &BB : F) {
+        if (isa<ReturnInst>(BB.getTerminator()))
+          hasReturn = true;
+
+        // the callee of a musttail call returns in place of F
+        for (Instruction &I : BB)
+          if (CallInst* CI = dyn_cast<CallInst>(&I))
+            if (CI->isMustTailCall())
+              return false;
+      }
+
+      return hasReturn;
+    }
+
+    /**
+     * The thread local top of the shadow stack and
+     *
+     *   i8** sd.shadowstack.init()
+     *
+     * which maps the shadow stack of the calling thread between two guard
+     * pages and returns its bottom.
+     */
+    void createShadowStack(Module &M) {
+      LLVMContext& C = M.getContext();
+      Type* i8PtrTy = Type::getInt8PtrTy(C);
+      Type* slotPtrTy = i8PtrTy->getPointerTo();
+      Type* i32Ty = Type::getInt32Ty(C);
+      Type* i64Ty = Type::getInt64Ty(C);
+      uint64_t size = ((uint64_t) SDShadowStackSize + SD_PAGE_SIZE - 1) / SD_PAGE_SIZE * SD_PAGE_SIZE;
+
+      // initial-exec like the check counters, so PIC code reaches it without
+      // a __tls_get_addr call on every entry and return
+      stackPtr = new GlobalVariable(M, slotPtrTy, false, GlobalValue::InternalLinkage,
+                                    ConstantPointerNull::get(cast<PointerType>(slotPtrTy)),
+                                    "sd.shadowstack.ptr", NULL, GlobalVariable::InitialExecTLSModel);
+
+      initFunction = Function::Create(FunctionType::get(slotPtrTy, false),
+                                      GlobalValue::InternalLinkage, "sd.shadowstack.init", &M);
+      initFunction->addFnAttr(Attribute::NoInline);
+      initFunction->addFnAttr(Attribute::Cold);
+      initFunction->addFnAttr(Attribute::NoUnwind);
+
+      Constant* mmap = M.getOrInsertFunction("mmap", i8PtrTy, i8PtrTy, i64Ty, i32Ty, i32Ty, i32Ty, i64Ty, NULL);
+      Constant* mprotect = M.getOrInsertFunction("mprotect", i32Ty, i8PtrTy, i64Ty, i32Ty, NULL);
+
+      BasicBlock* entryBB = BasicBlock::Create(C, "entry", initFunction);
+      BasicBlock* mappedBB = BasicBlock::Create(C, "sd.shadowstack.mapped", initFunction);
+      BasicBlock* trapBB = BasicBlock::Create(C, "sd.shadowstack.trap", initFunction);
+
+      IRBuilder<> builder(entryBB);
+      Value* base = builder.CreateCall(mmap, {
+        ConstantPointerNull::get(cast<PointerType>(i8PtrTy)),
+        ConstantInt::get(i64Ty, size + 2 * SD_PAGE_SIZE),
+        ConstantInt::get(i32Ty, SD_PROT_READ_WRITE),
+        ConstantInt::get(i32Ty, SD_MAP_PRIVATE_ANONYMOUS_NORESERVE),
+        ConstantInt::get(i32Ty, -1),
+        ConstantInt::get(i64Ty, 0)
+      }, "sd.shadowstack.base");
+      Value* failed = builder.CreateICmpEQ(
+        base, builder.CreateIntToPtr(ConstantInt::get(i64Ty, -1), i8PtrTy));
+      builder.CreateCondBr(failed, trapBB, mappedBB);
+
+      builder.SetInsertPoint(mappedBB);
+      Value* bottom = builder.CreateConstGEP1_64(base, SD_PAGE_SIZE);
+      builder.CreateCall(mprotect, {
+        base, ConstantInt::get(i64Ty, SD_PAGE_SIZE), ConstantInt::get(i32Ty, SD_PROT_NONE)
+      });
+      builder.CreateCall(mprotect, {
+        builder.CreateConstGEP1_64(bottom, size),
+        ConstantInt::get(i64Ty, SD_PAGE_SIZE), ConstantInt::get(i32Ty, SD_PROT_NONE)
+      });
+      builder.CreateRet(builder.CreateBitCast(bottom, slotPtrTy));
+
+      builder.SetInsertPoint(trapBB);
+      builder.CreateCall(Intrinsic::getDeclaration(&M, Intrinsic::trap));
+      builder.CreateUnreachable();
+    }
+
+    void protect(Function &F, uint64_t &returns, uint64_t &resets) {
+      Module &M = *F.getParent();
+      LLVMContext& C = M.getContext();
+      MDNode* likely = MDBuilder(C).createBranchWeights(1 << 20, 1);
+      Function* returnAddress = Intrinsic::getDeclaration(&M, Intrinsic::returnaddress);
+
+      std::vector<ReturnInst*> rets;
+      std::vector<Instruction*> resumePoints;
+      for (BasicBlock &BB : F) {
+        if (ReturnInst* RI = dyn_cast<ReturnInst>(BB.getTerminator()))
+          rets.push_back(RI);
+
+        for (Instruction &I : BB) {
+          if (isa<LandingPadInst>(&I)) {
+            resumePoints.push_back(I.getNextNode());
+          } else if (CallInst* CI = dyn_cast<CallInst>(&I)) {
+            // a longjmp comes back through the return of setjmp
+            if (CI->hasFnAttr(Attribute::ReturnsTwice))
+              resumePoints.push_back(CI->getNextNode());
+          }
+        }
+      }
+
+      // push, keeping the allocas of the entry block static
+      BasicBlock* entryBB = &F.getEntryBlock();
+      BasicBlock::iterator it = entryBB->begin();
+      while (isa<AllocaInst>(it))
+        ++it;
+      BasicBlock* pushBB = entryBB->splitBasicBlock(it, "sd.shadowstack.push");
+      BasicBlock* initBB = BasicBlock::Create(C, "sd.shadowstack.init", &F, pushBB);
+      entryBB->getTerminator()->eraseFromParent();
+
+      IRBuilder<> builder(entryBB);
+      Value* top = builder.CreateLoad(stackPtr, "sd.shadowstack.top");
+      builder.CreateCondBr(builder.CreateIsNotNull(top), pushBB, initBB, likely);
+
+      builder.SetInsertPoint(initBB);
+      Value* bottom = builder.CreateCall(initFunction);
+      builder.CreateBr(pushBB);
+
+      builder.SetInsertPoint(pushBB, pushBB->begin());
+      PHINode* slot = builder.CreatePHI(top->getType(), 2, "sd.shadowstack.slot");
+      slot->addIncoming(top, entryBB);
+      slot->addIncoming(bottom, initBB);
+      builder.CreateStore(builder.CreateCall(returnAddress, builder.getInt32(0)), slot);
+      Value* above = builder.CreateConstGEP1_64(slot, 1);
+      builder.CreateStore(above, stackPtr);
+
+      for (Instruction* I : resumePoints) {
+        builder.SetInsertPoint(I);
+        builder.CreateStore(above, stackPtr);
+        resets++;
+      }
+
+      BasicBlock* trapBB = BasicBlock::Create(C, "sd.shadowstack.trap", &F);
+      IRBuilder<> trapBuilder(trapBB);
+      trapBuilder.CreateCall(Intrinsic::getDeclaration(&M, Intrinsic::trap));
+      trapBuilder.CreateUnreachable();
+
+      for (ReturnInst* RI : rets) {
+        BasicBlock* BB = RI->getParent();
+        BasicBlock* retBB = BB->splitBasicBlock(RI, "sd.ret");
+        BB->getTerminator()->eraseFromParent();
+
+        builder.SetInsertPoint(BB);
+        Value* expected = builder.CreateLoad(slot);
+        builder.CreateStore(slot, stackPtr);
+        Value* actual = builder.CreateCall(returnAddress, builder.getInt32(0), "sd.ra");
+        builder.CreateCondBr(builder.CreateICmpEQ(expected, actual), retBB, trapBB, likely);
+      }
+      returns += rets.size();
+
+      // llvm.returnaddress would read the caller's return address once inlined
+      F.addFnAttr(Attribute::NoInline);
+    }
+  };
+}
+
+char SDShadowStack::ID = 0;
+
+INITIALIZE_PASS(SDShadowStack, "sdshadowstack", "Protect returns with a thread local shadow stack", false, false)
+
+ModulePass* llvm::createSDShadowStackPass() {
+  return new SDShadowStack();
+}
@@ -3,6 +3,9 @@
 #include "llvm/Transforms/IPO/SafeDispatchLayoutBuilder.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/Constant.h"
@@ -11,14 +14,23 @@
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/Pass.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Transforms/IPO/LowerBitSets.h"
 
 #include "llvm/Transforms/IPO/SafeDispatchLog.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
 #include "llvm/Transforms/IPO/SafeDispatchTools.h"
+#include "llvm/Transforms/IPO/SafeDispatchChecks.h"
+#include "llvm/Transforms/IPO/SafeDispatchProfile.h"
 
 #include "llvm/Transforms/Utils/ValueMapper.h"
 #include "llvm/Transforms/Utils/Cloning.h"
@@ -41,6 +53,46 @@
 
 using namespace llvm;
 
+static cl::opt<bool>
+SDCheckFailHandler("sd-check-fail-handler", cl::init(false),
+                   cl::desc("Call the cold __sd_check_failed(site id) runtime handler "
+                            "before trapping on a failed vptr check"));
+
+static cl::opt<bool>
+SDCheckCounters("sd-check-counters", cl::init(false),
+                cl::desc("Count passed and failed vptr checks per call site and range "
+                         "(needs the libsdprof runtime)"));
+
+static cl::opt<std::string>
+SDCheckProfile("sd-check-profile", cl::init(""),
+               cl::desc("Per call site range hit counts used to order the range checks "
+                        "(see SafeDispatchProfile.h)"));
+
+static cl::opt<bool>
+SDCheckReport("sd-check-report", cl::init(false),
+              cl::desc("Write a CSV report of every vptr check site with its location, "
+                       "classes, ranges and estimated instruction count to SDOutput"));
+
+static cl::opt<bool>
+SDNativeChecks("sd-native-checks", cl::init(false),
+               cl::desc("Leave range checks to the x86-64 backend, which emits them as "
+                        "sub; ror; cmp instead of the IR shift/or expansion"));
+
+static cl::opt<bool>
+SDMaskChecks("sd-mask-checks", cl::init(false),
+             cl::desc("Replace a vptr that fails its checks with a vtable the checks "
+                      "accept, using a select instead of branching to a trap"));
+
+static cl::opt<bool>
+SDOutlineChecks("sd-outline-checks", cl::init(false),
+                cl::desc("Replace the vptr checks of cold sites in functions optimized "
+                         "for size with calls to a shared check thunk"));
+
+static cl::opt<unsigned>
+SDOutlineHotCount("sd-outline-hot-count", cl::init(1000),
+                  cl::desc("Sites the -sd-check-profile saw at least this often are hot "
+                           "and keep their checks inline"));
+
 namespace {
   /**
    * Pass for updating the annotated instructions with the new indices
@@ -51,7 +103,7 @@ namespace {
   struct SDUpdateIndices : public ModulePass {
     static char ID; // Pass identification, replacement for typeid
 
-    SDUpdateIndices() : ModulePass(ID) {
+    SDUpdateIndices(bool bitset = false) : ModulePass(ID), bitsetChecks(bitset) {
       sd_print("initializing SDUpdateIndices pass\n");
       initializeSDUpdateIndicesPass(*PassRegistry::getPassRegistry());
     }
@@ -68,6 +120,11 @@ namespace {
       //Paul: second get the results from the class hierarchy analysis pass
       cha = &getAnalysis<SDBuildCHA>();
 
+      //order the range checks by observed hits when a profile is given
+      profile.clear();
+      if (!SDCheckProfile.empty() && !sd_readCheckProfile(SDCheckProfile, profile))
+        sd_print("P4. Could not read the check profile %s\n", SDCheckProfile.c_str());
+
       sd_print("\n P4. Started running the 4th pass (Update indices) ...\n");
 
       //Paul: substitute the old v table index witht the new one
@@ -104,6 +161,8 @@ namespace {
   private:
     SDLayoutBuilder* layoutBuilder;
     SDBuildCHA* cha;
+    bool bitsetChecks; // emit span+bitset checks for multi-range call sites when cheaper
+    sd_check_profile_t profile; // range hit counts per call site, may be empty
     
     // metadata ids
     void handleSDGetVtblIndex(Module* M);
@@ -236,6 +295,65 @@ struct range_less_than_key {
   }
 };
 
+// Approximate x86-64 cost (instructions + branches) of the sequences SDSubstModule
+// lowers each check intrinsic into. Used to decide per call site whether a chain of
+// range checks or a single span+bitset check is cheaper.
+enum {
+  SD_RANGE_CHECK_COST  = 4 + 1, // sub, ror, cmp, jcc
+  SD_EQ_CHECK_COST     = 2 + 1, // cmp, jcc
+  SD_BITSET_CHECK_COST = 7 + 1  // sub, ror, cmp, cmov, bt (or load+test), and, jcc
+};
+
+static uint64_t sd_rangeChainCost(const std::vector<SDLayoutBuilder::mem_range_t>& ranges) {
+  uint64_t cost = 0;
+  for (auto rangeIt : ranges)
+    cost += rangeIt.second > 1 ? SD_RANGE_CHECK_COST : SD_EQ_CHECK_COST;
+  return cost;
+}
+
+// Build the bitset covering all vtables allowed by ranges. Every vtable inside a
+// range lies alignment bytes after the previous one, so the bitset is exact.
+static bool sd_buildRangeBitSet(const std::vector<SDLayoutBuilder::mem_range_t>& ranges,
+                                uint64_t alignment, llvm::GlobalVariable*& rootGV,
+                                BitSetInfo& BSI) {
+  BitSetBuilder BSB;
+  rootGV = NULL;
+
+  for (auto rangeIt : ranges) {
+    llvm::GlobalVariable* gv;
+    uint64_t off;
+
+    if (!sd_getRangeStartOffset(rangeIt.first, gv, off) || (rootGV && gv != rootGV))
+      return false;
+    rootGV = gv;
+
+    for (uint64_t k = 0; k < rangeIt.second; k++)
+      BSB.addOffset(off + k * alignment);
+  }
+
+  BSI = BSB.build();
+  return rootGV != NULL;
+}
+
+// Emit the bits of BSI as a private constant byte array, bit i lives in byte i/8.
+// Identical bitsets share one global.
+static llvm::Constant* sd_getBitSetGlobal(Module* M, const BitSetInfo& BSI,
+                                          std::map<std::vector<uint8_t>, llvm::GlobalVariable*>& cache) {
+  std::vector<uint8_t> bytes((BSI.BitSize + 7) / 8, 0);
+  for (uint64_t bit : BSI.Bits)
+    bytes[bit / 8] |= 1 << (bit % 8);
+
+  llvm::GlobalVariable*& gv = cache[bytes];
+  if (!gv) {
+    llvm::Constant* init = llvm::ConstantDataArray::get(M->getContext(), bytes);
+    gv = new llvm::GlobalVariable(*M, init->getType(), true,
+                                  GlobalValue::PrivateLinkage, init, "sd.bitset");
+    gv->setUnnamedAddr(true);
+  }
+
+  return ConstantExpr::getPointerCast(gv, IntegerType::getInt8PtrTy(M->getContext()));
+}
+
 //Paul: adds the range check (casted_vptr, start, width, alingment)
 //add check v table and check v table range 
 // it uses: 
@@ -413,6 +531,29 @@ void SDUpdateIndices::handleSDCheckVtbl(Module* M) {
   }
 }
 
+// number the sd_get_checked_vptr calls of every function in instruction order,
+// the ordinal tells apart the profile keys of sites without debug info
+static void sd_numberCheckSites(Function* intrinsic) {
+  std::set<Function*> functions;
+  for (User* U : intrinsic->users())
+    functions.insert(cast<CallInst>(U)->getParent()->getParent());
+
+  for (Function* F : functions) {
+    uint32_t ordinal = 0;
+    for (BasicBlock& BB : *F) {
+      for (Instruction& I : BB) {
+        CallInst* CI = dyn_cast<CallInst>(&I);
+        if (!CI || CI->getCalledFunction() != intrinsic)
+          continue;
+
+        LLVMContext& C = CI->getContext();
+        CI->setMetadata(SD_MD_SITE_ORDINAL, MDNode::get(C,
+                        ConstantAsMetadata::get(ConstantInt::get(Type::getInt32Ty(C), ordinal++))));
+      }
+    }
+  }
+}
+
 //Paul: add the range checks, success, failed path, the trap and replace the terminator 
 //add checked v table pointer, add subst range and the trap if failed
 //it uses:  
@@ -424,12 +565,19 @@ void SDUpdateIndices::handleSDGetCheckedVtbl(Module* M) {
   const DataLayout &DL = M->getDataLayout(); //Paul: get data layout 
   llvm::LLVMContext& C = M->getContext();    //Paul: get the context
   Type *IntPtrTy = DL.getIntPtrType(C, 0);   //Paul: get the Int pointer type
+  std::map<std::vector<uint8_t>, llvm::GlobalVariable*> bitsetCache;
+  int bitsetSites = 0;
+  int profiledSites = 0;
+  int finalClassSites = 0;
 
   // if the function doesn't exist, do nothing
   if (!sd_vtbl_indexF){
    return;
   }
 
+  // the profile key of a site without debug info is its ordinal in the function
+  sd_numberCheckSites(sd_vtbl_indexF);
+
   // Paul: iterate through all function uses
   for (const Use &U : sd_vtbl_indexF->uses()) {
     
@@ -506,6 +654,8 @@ void SDUpdateIndices::handleSDGetCheckedVtbl(Module* M) {
     //Paul: get the old BB terminator 
     llvm::Instruction *oldTerminator = BB->getTerminator();
     IRBuilder<> builder(oldTerminator);
+    //the checks get the location of the call site, P5 reports sites by it
+    builder.SetCurrentDebugLocation(CI->getDebugLoc());
 
     //do a bit cast and store the result in castVptr
     llvm::Value *castVptr = builder.CreateBitCast(vptr, Int8PtrTy);
@@ -528,6 +678,14 @@ void SDUpdateIndices::handleSDGetCheckedVtbl(Module* M) {
 
       //notice a v table can have multiple ranges 
       std::vector<SDLayoutBuilder::mem_range_t> ranges(layoutBuilder->getMemRange(vtbl));
+
+      //the object of a final class has exactly that vtable, check for it alone
+      llvm::MDNode* finalMD = CI->getMetadata(SD_MD_FINAL);
+      if (sd_isFinal(finalMD, "class") && cha->isDefined(vtbl)) {
+        ranges.clear();
+        ranges.push_back(SDLayoutBuilder::mem_range_t(layoutBuilder->getVTableRangeStart(vtbl), 1));
+        finalClassSites++;
+      }
       std::sort(ranges.begin(), ranges.end(), range_less_than_key()); //Paul: sort the elements in the range 
 
       uint64_t sum = 0;
@@ -543,9 +701,72 @@ void SDUpdateIndices::handleSDGetCheckedVtbl(Module* M) {
                                        vtbl.second, 
                                        ranges.size(), 
                                        sum);
-  
+
+      //the check report of P5 lists the class of every check, and the sites
+      //whose checks were removed in between
+      llvm::MDNode* classMD = llvm::MDNode::get(C, {llvm::MDString::get(C, className),
+                                                     llvm::MDString::get(C, preciseClassName)});
+      llvm::Metadata* siteMD[] = {llvm::MDString::get(C, sd_getCheckSiteKey(CI)),
+                                  llvm::MDString::get(C, className),
+                                  llvm::MDString::get(C, preciseClassName),
+                                  llvm::ConstantAsMetadata::get(builder.getInt32(ranges.size()))};
+      M->getOrInsertNamedMetadata(SD_MD_CHECK_SITES)->addOperand(llvm::MDNode::get(C, siteMD));
+
+      // with several ranges, a single check against the covering span plus a
+      // bitset test may be cheaper than the chain of range checks
+      BitSetInfo BSI;
+      llvm::GlobalVariable* rootGV;
+      bool useBitset = bitsetChecks && ranges.size() > 1 &&
+                       sd_buildRangeBitSet(ranges, layoutBuilder->alignmentMap[root], rootGV, BSI) &&
+                       SD_BITSET_CHECK_COST < sd_rangeChainCost(ranges);
+
+      if (useBitset) {
+        llvm::Constant* spanStart = ConstantExpr::getAdd(ConstantExpr::getPtrToInt(rootGV, IntPtrTy),
+                                                         llvm::ConstantInt::get(IntPtrTy, BSI.ByteOffset));
+        llvm::Value *Args[] = {castVptr,
+                               spanStart,
+                               llvm::ConstantInt::get(IntPtrTy, BSI.BitSize),
+                               llvm::ConstantInt::get(IntPtrTy, 1ULL << BSI.AlignLog2),
+                               sd_getBitSetGlobal(M, BSI, bitsetCache)};
+
+        llvm::CallInst* fastPathSuccess = builder.CreateCall(Intrinsic::getDeclaration(M,
+                                                     Intrinsic::sd_subst_check_bitset),
+                                                                                Args);
+        fastPathSuccess->setMetadata(SD_MD_CHECK_CLASS, classMD);
+        fastPathSuccess->setMetadata(SD_MD_SITE_ORDINAL, CI->getMetadata(SD_MD_SITE_ORDINAL));
+        if (finalMD)
+          fastPathSuccess->setMetadata(SD_MD_FINAL, finalMD);
+
+        llvm::BasicBlock *fastCheckFailed = llvm::BasicBlock::Create(F->getContext(), "sd.fastcheck.fail.0", F);
+        llvm::BranchInst *BI = builder.CreateCondBr(fastPathSuccess, SuccessBB, fastCheckFailed);
+        llvm::MDBuilder MDB(BI->getContext());
+
+        BI->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(
+                                              std::numeric_limits<uint32_t>::max(),
+                                              std::numeric_limits<uint32_t>::min()));
+
+        builder.SetInsertPoint(fastCheckFailed);
+        bitsetSites++;
+        ranges.clear(); // no per-range checks needed anymore
+      }
+
+      //check the ranges that matched most often in the profile first, ranges
+      //the profile has not seen keep their width order
+      std::vector<unsigned> order(ranges.size());
+      for (unsigned r = 0; r < ranges.size(); r++)
+        order[r] = r;
+
+      sd_check_profile_t::iterator profIt = profile.find(sd_getCheckSiteKey(CI));
+      if (ranges.size() > 1 && profIt != profile.end() && profIt->second.size() == ranges.size()) {
+        const std::vector<uint64_t>& hits = profIt->second;
+        std::stable_sort(order.begin(), order.end(),
+                         [&hits](unsigned a, unsigned b) { return hits[a] > hits[b]; });
+        profiledSites++;
+      }
+
       //Paul: iterate throught the ranges for one v table at a time 
-      for (auto rangeIt : ranges) {
+      for (unsigned r : order) {
+        const SDLayoutBuilder::mem_range_t& rangeIt = ranges[r];
         llvm::Value *start = rangeIt.first;
         llvm::Value *width = llvm::ConstantInt::get(IntPtrTy, rangeIt.second);
         llvm::Value *Args[] = {castVptr, start, width, alignment};
@@ -553,9 +774,16 @@ void SDUpdateIndices::handleSDGetCheckedVtbl(Module* M) {
         //Paul: create the fast path success, this Intrinsic::sd_subst_check_range function
         // was previously added during code generation 
         //create a call to named fast path success 
-        llvm::Value* fastPathSuccess = builder.CreateCall(Intrinsic::getDeclaration(M,
+        llvm::CallInst* fastPathSuccess = builder.CreateCall(Intrinsic::getDeclaration(M,
                                                      Intrinsic::sd_subst_check_range),
                                                                                 Args);
+        //remember the width order index, the profile refers to ranges by it
+        fastPathSuccess->setMetadata(SD_MD_RANGE_INDEX, llvm::MDNode::get(C,
+                                     llvm::ConstantAsMetadata::get(builder.getInt32(r))));
+        fastPathSuccess->setMetadata(SD_MD_CHECK_CLASS, classMD);
+        fastPathSuccess->setMetadata(SD_MD_SITE_ORDINAL, CI->getMetadata(SD_MD_SITE_ORDINAL));
+        if (finalMD)
+          fastPathSuccess->setMetadata(SD_MD_FINAL, finalMD);
 
         char blockName[256];
         
@@ -611,6 +839,10 @@ void SDUpdateIndices::handleSDGetCheckedVtbl(Module* M) {
     CI->replaceAllUsesWith(vptr);//Paul: replace all uses with the new v pointer
     CI->eraseFromParent();
   } //end of all uses for loop.
+
+  sd_print("P4. Call sites checked with span+bitset: %d \n", bitsetSites);
+  sd_print("P4. Call sites with profile ordered range checks: %d \n", profiledSites);
+  sd_print("P4. Call sites on final classes checked for a single vtable: %d \n", finalClassSites);
 }
 
 //Paul: read the v call index and add replace all uses with this new value 
@@ -672,6 +904,12 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
       //Paul: count the number of constant pointers
       int64_t constPtr = 0;
 
+      //count number of span+bitset checks substituted
+      int64_t bitsetSubst = 0;
+
+      //count number of range checks left to the backend
+      int64_t nativeSubst = 0;
+
       //Paul: cum up the width of a range such that
       // we can compute an average value for each inserted check
       uint64_t sumWidth = 0.0;
@@ -704,6 +942,36 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
         }
       }
       
+      //one trap block per function instead of one per check, before the
+      //check intrinsics are lowered and the chains can no longer be found
+      check_sites_t sites;
+      collectCheckSites(M, sites);
+
+      //per site report, while the checks are still intrinsics
+      if (SDCheckReport)
+        writeCheckReport(M, sites);
+      if (NamedMDNode* sitesMD = M.getNamedMetadata(SD_MD_CHECK_SITES))
+        sitesMD->eraseFromParent();
+
+      //count passed and failed checks per site and range for profiling
+      int64_t countedSites = 0;
+      if (SDCheckCounters)
+        countedSites = instrumentCheckCounters(M, sites);
+
+      //branchless enforcement, also not in profiling builds
+      int64_t maskedSites = 0;
+      if (SDMaskChecks && !SDCheckCounters)
+        maskedSites = maskChecks(M, sites);
+
+      //calls to shared check thunks for cold sites in size optimized code,
+      //not in profiling builds, the counters stay with the inline checks
+      int64_t outlinedSites = 0;
+      int64_t checkThunks = 0;
+      if (SDOutlineChecks && !SDCheckCounters)
+        outlinedSites = outlineChecks(M, sites, checkThunks);
+
+      int64_t mergedTraps = mergeCheckFailures(M, sites);
+
       //Paul: add the final range checks 
       //Notice: that we have ranges with: width > 1 or < 1
       if (sd_subst_rangeF) {
@@ -717,6 +985,10 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
         //count number of constant checks added
         int constantCounter = 0;
 
+        //the x86-64 backend lowers the range checks itself, see X86ISD::SD_CHECK_RANGE
+        bool nativeChecks = SDNativeChecks &&
+          Triple(M.getTargetTriple()).getArch() == Triple::x86_64;
+
         //Paul: for all the places where the range check has to be added
         for (const Use &U : sd_subst_rangeF->uses()) {
           
@@ -759,6 +1031,12 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
             constPtr++;
           } else
 
+          //keep the intrinsic, codegen emits sub; ror; cmp right before the branch
+          if (widthInt > 1 && nativeChecks) {
+            rangeSubst += 1;
+            nativeSubst += 1;
+          } else
+
           //Paul: if the range is grether than 1 do the rotation checks 
           if (widthInt > 1) {
             // create pointer to int
@@ -805,6 +1083,13 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
         }
       }
       
+      //lower the span+bitset checks emitted for call sites with several ranges
+      Function *sd_subst_bitsetF = M.getFunction(Intrinsic::getName(Intrinsic::sd_subst_check_bitset));
+
+      if (sd_subst_bitsetF) {
+        bitsetSubst = lowerBitSetChecks(M, sd_subst_bitsetF, constPtr);
+      }
+
       //finished adding all the range checks, now print some statistics.
       //in the interleaving paper the average number of ranges per call site was close to 1 (1,005).
       sd_print("\n P5. Finished running SDSubstModule pass...\n");
@@ -814,11 +1099,812 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
       sd_print(" Total index substitutions %d \n", indexSubst);
       sd_print(" Total range checks added %d \n", rangeSubst);
       sd_print(" Total eq_checks added %d \n", eqSubst);
+      sd_print(" Total bitset checks added %d \n", bitsetSubst);
+      sd_print(" Total range checks left to the backend %d \n", nativeSubst);
       sd_print(" Total const_ptr % d \n", constPtr);
+      sd_print(" Total trap blocks merged %d \n", mergedTraps);
+      sd_print(" Total check sites with counters %d \n", countedSites);
+      sd_print(" Total check sites masked %d \n", maskedSites);
+      sd_print(" Total check sites outlined %d into %d thunks \n", outlinedSites, checkThunks);
       sd_print(" Average width % lf \n", sumWidth * 1.0 / (rangeSubst + eqSubst + constPtr));
 
       //one of these values has to be > than 0 
-      return indexSubst > 0 || rangeSubst > 0 || eqSubst > 0 || constPtr > 0;
+      return indexSubst > 0 || rangeSubst > 0 || eqSubst > 0 || constPtr > 0 || bitsetSubst > 0;
+    }
+
+    typedef std::vector<std::pair<Function*, std::vector<sd_check_chain_t> > > check_sites_t;
+
+    /**
+     * Give every check chain a module wide site id, stored as !sd.check.site
+     * on its checks. The site ids are written to <sd_output>-Sites.csv as
+     *   site,function,location
+     * to tell which check failed from the site id a trap leaves in a register.
+     */
+    void collectCheckSites(Module &M, check_sites_t &sites) {
+      std::vector<std::string> siteKeys;
+
+      for (Function &F : M) {
+        if (F.isDeclaration())
+          continue;
+
+        std::vector<sd_check_chain_t> chains;
+        sd_collectCheckChains(F, chains);
+
+        if (chains.empty())
+          continue;
+
+        for (sd_check_chain_t &chain : chains) {
+          for (CallInst* check : chain.checks)
+            sd_setCheckSiteId(check, siteKeys.size());
+
+          siteKeys.push_back(sd_getCheckSiteKey(chain.checks[0]));
+        }
+
+        sites.push_back(std::make_pair(&F, chains));
+      }
+
+      if (siteKeys.empty())
+        return;
+
+      std::string fileName = findOutputFileName(M, "Sites");
+      std::error_code EC;
+      raw_fd_ostream out(fileName, EC, sys::fs::OpenFlags::F_Text);
+      if (EC) {
+        sdLog::errs() << "Failed to write to " << fileName << "!\n";
+        return;
+      }
+
+      out << "site,function,location\n";
+      for (uint32_t siteId = 0; siteId < siteKeys.size(); siteId++) {
+        // the key is "<function> <file>:<line>:<col>"
+        std::pair<StringRef, StringRef> funcLoc = StringRef(siteKeys[siteId]).split(' ');
+        out << siteId << "," << funcLoc.first << "," << funcLoc.second << "\n";
+      }
+
+      sdLog::stream() << "SDSubstModule: wrote the check site ids to " << fileName << "\n";
+    }
+
+    /**
+     * Write one CSV line per check site to <sd_output>-Checks.csv:
+     *   site,kind,function,location,class,precise class,ranges,widths,estimated instructions
+     * kind is range, eq (a single vtable), bitset, const (vptr known to pass,
+     * the check folds away) or elided (P4 emitted checks for the site, but a
+     * later pass removed them). widths lists the width of each check in chain
+     * order. estimated instructions is the sum of the fixed per-check costs
+     * (SD_RANGE_CHECK_COST and friends), not a count of the machine code the
+     * backend emits: it misses the vptr load, hoisted constants and the
+     * effect of -sd-native-checks, -sd-mask-checks and -sd-outline-checks.
+     */
+    void writeCheckReport(Module &M, check_sites_t &sites) {
+      std::string fileName = findOutputFileName(M, "Checks");
+      std::error_code EC;
+      raw_fd_ostream out(fileName, EC, sys::fs::OpenFlags::F_Text);
+      if (EC) {
+        sdLog::errs() << "Failed to write to " << fileName << "!\n";
+        return;
+      }
+
+      out << "site,kind,function,location,class,precise class,ranges,widths,estimated instructions\n";
+
+      // sites still checked, by key, to tell which of the P4 sites were removed
+      std::map<std::string, unsigned> remaining;
+
+      for (auto &site : sites) {
+        for (sd_check_chain_t &chain : site.second) {
+          std::string key = sd_getCheckSiteKey(chain.checks[0]);
+          remaining[key]++;
+
+          uint32_t siteId = 0;
+          sd_getCheckSiteId(chain.checks[0], siteId);
+
+          std::string kind;
+          std::string widths;
+          uint64_t cost = 0;
+          bool allConst = true;
+
+          for (CallInst* check : chain.checks) {
+            uint64_t width = cast<ConstantInt>(check->getArgOperand(2))->getZExtValue();
+            widths += (widths.empty() ? "" : " ") + utostr(width);
+
+            if (check->getCalledFunction()->getIntrinsicID() == Intrinsic::sd_subst_check_bitset) {
+              kind = "bitset";
+              cost += SD_BITSET_CHECK_COST;
+              allConst = false;
+            } else if (!isConstRangeCheck(check, M.getDataLayout())) {
+              if (kind.empty() || width > 1)
+                kind = width > 1 ? "range" : "eq";
+              cost += width > 1 ? SD_RANGE_CHECK_COST : SD_EQ_CHECK_COST;
+              allConst = false;
+            }
+          }
+
+          if (allConst)
+            kind = "const";
+
+          writeReportLine(out, utostr(siteId), kind, key, chain.checks[0]->getMetadata(SD_MD_CHECK_CLASS),
+                          chain.checks.size(), widths, cost);
+        }
+      }
+
+      NamedMDNode* sitesMD = M.getNamedMetadata(SD_MD_CHECK_SITES);
+      for (unsigned i = 0; sitesMD && i < sitesMD->getNumOperands(); i++) {
+        MDNode* siteMD = sitesMD->getOperand(i);
+        std::string key = cast<MDString>(siteMD->getOperand(0))->getString();
+
+        if (remaining[key] > 0) {
+          remaining[key]--;
+          continue;
+        }
+
+        uint64_t ranges = mdconst::extract<ConstantInt>(siteMD->getOperand(3))->getZExtValue();
+        MDNode* classMD = MDNode::get(M.getContext(), {siteMD->getOperand(1), siteMD->getOperand(2)});
+        writeReportLine(out, "", "elided", key, classMD, ranges, "", 0);
+      }
+
+      sdLog::stream() << "SDSubstModule: wrote the check report to " << fileName << "\n";
+    }
+
+    void writeReportLine(raw_ostream &out, const std::string &site, const std::string &kind,
+                         const std::string &key, MDNode* classMD, uint64_t ranges,
+                         const std::string &widths, uint64_t cost) {
+      // the key is "<function> <file>:<line>:<col>"
+      std::pair<StringRef, StringRef> funcLoc = StringRef(key).split(' ');
+      StringRef className, preciseClassName;
+      if (classMD) {
+        className = cast<MDString>(classMD->getOperand(0))->getString();
+        preciseClassName = cast<MDString>(classMD->getOperand(1))->getString();
+      }
+
+      out << site << "," << kind << "," << funcLoc.first << "," << funcLoc.second << ","
+          << className << "," << preciseClassName << "," << ranges << "," << widths << ","
+          << cost << "\n";
+    }
+
+    // does SDSubstModule fold this range check to true
+    bool isConstRangeCheck(CallInst* check, const DataLayout &DL) {
+      GlobalVariable* rootVtbl;
+      uint64_t startOff;
+      int64_t width = cast<ConstantInt>(check->getArgOperand(2))->getSExtValue();
+
+      return sd_getRangeStartOffset(cast<Constant>(check->getArgOperand(1)), rootVtbl, startOff) &&
+             validConstVptr(rootVtbl, startOff, width, DL, check->getArgOperand(0), 0);
+    }
+
+    // <sd_output>-<what>.csv, numbered like the SDAnalysis output if it exists
+    std::string findOutputFileName(Module &M, const std::string &what) {
+      std::string base = "./SDSubst";
+      if (NamedMDNode* SDOutputMD = M.getNamedMetadata("sd_output"))
+        base = cast<MDString>(SDOutputMD->getOperand(0)->getOperand(0))->getString();
+      else if (NamedMDNode* SDFilenameMD = M.getNamedMetadata("sd_filename"))
+        base = ("./" + cast<MDString>(SDFilenameMD->getOperand(0)->getOperand(0))->getString()).str();
+
+      std::string fileName = base + "-" + what + ".csv";
+      for (unsigned number = 1; sys::fs::exists(fileName); number++)
+        fileName = base + "-" + what + utostr(number) + ".csv";
+
+      return fileName;
+    }
+
+    /**
+     * Let all chains of a function fail into one shared block:
+     *   sd.check.fail:
+     *     %sd.check.site = phi i32 [ <site id>, <last check of the site> ], ...
+     *     call void asm sideeffect "", "r"(i32 %sd.check.site)
+     *     call void @__sd_check_failed(i32 %sd.check.site)  ; -sd-check-fail-handler
+     *     call void @llvm.trap()
+     *     unreachable
+     * The empty asm keeps the site id in a register at the trap, so a core
+     * dump tells which check failed. Returns the number of trap blocks removed.
+     */
+    int64_t mergeCheckFailures(Module &M, check_sites_t &sites) {
+      LLVMContext& C = M.getContext();
+      Type* Int32Ty = Type::getInt32Ty(C);
+      Function* handlerF = NULL;
+      int64_t merged = 0;
+
+      if (SDCheckFailHandler) {
+        FunctionType* handlerT = FunctionType::get(Type::getVoidTy(C), Int32Ty, false);
+        handlerF = cast<Function>(M.getOrInsertFunction("__sd_check_failed", handlerT));
+        handlerF->addFnAttr(Attribute::Cold);
+        handlerF->addFnAttr(Attribute::NoReturn);
+        handlerF->addFnAttr(Attribute::NoUnwind);
+      }
+
+      for (auto &site : sites) {
+        std::vector<sd_check_chain_t> &chains = site.second;
+
+        BasicBlock* failBB = BasicBlock::Create(C, "sd.check.fail", site.first);
+        IRBuilder<> builder(failBB);
+        PHINode* sitePN = builder.CreatePHI(Int32Ty, chains.size(), "sd.check.site");
+
+        builder.CreateCall(InlineAsm::get(FunctionType::get(Type::getVoidTy(C), Int32Ty, false),
+                                          "", "r", true), sitePN);
+        if (handlerF)
+          builder.CreateCall(handlerF, sitePN)->setDoesNotReturn();
+        builder.CreateCall(Intrinsic::getDeclaration(&M, Intrinsic::trap));
+        builder.CreateUnreachable();
+
+        for (sd_check_chain_t &chain : chains) {
+          uint32_t siteId;
+          sd_getCheckSiteId(chain.checks[0], siteId);
+
+          // the last check fails straight into the shared block
+          BasicBlock* trapBB = chain.fails.back();
+          BasicBlock* lastCheckBB = trapBB->getSinglePredecessor();
+          BranchInst* BI = cast<BranchInst>(lastCheckBB->getTerminator());
+
+          BI->setSuccessor(1, failBB);
+          sitePN->addIncoming(ConstantInt::get(Int32Ty, siteId), lastCheckBB);
+          trapBB->eraseFromParent();
+        }
+
+        merged += chains.size() - 1;
+      }
+
+      return merged;
+    }
+
+    /**
+     * Enforce the checks without branches. All checks of a chain move into
+     * its head and every use of the vptr becomes
+     *   %sd.masked.vptr = select i1 (check0 | check1 | ...), %vptr, <vtable>
+     * where <vtable> is one of the vtables the checks were built from, so a
+     * corrupted vptr is replaced by a valid one of the static class instead
+     * of trapping. The select is lowered to a cmov, and the chain's branches
+     * and trap go away. Masked chains are removed from sites. Returns the
+     * number of masked sites.
+     */
+    int64_t maskChecks(Module &M, check_sites_t &sites) {
+      int64_t masked = 0;
+
+      for (auto &site : sites) {
+        Function &F = *site.first;
+        std::vector<sd_check_chain_t> branchyChains;
+        std::vector<sd_check_chain_t*> maskedChains;
+
+        DominatorTree DT;
+        DT.recalculate(F);
+
+        for (sd_check_chain_t &chain : site.second) {
+          if (maskChain(chain, DT))
+            maskedChains.push_back(&chain);
+          else
+            branchyChains.push_back(chain);
+        }
+
+        if (maskedChains.empty())
+          continue;
+
+        for (sd_check_chain_t* chain : maskedChains)
+          sd_bypassCheckChain(*chain);
+
+        removeUnreachableBlocks(F);
+        site.second.swap(branchyChains);
+        masked += maskedChains.size();
+      }
+
+      sites.erase(std::remove_if(sites.begin(), sites.end(),
+                                 [](const std::pair<Function*, std::vector<sd_check_chain_t> >& site) {
+                                   return site.second.empty();
+                                 }),
+                  sites.end());
+
+      return masked;
+    }
+
+    /**
+     * Mask the vptr of chain before anything in the head uses it: the checks
+     * and the select go right after the vptr, or to the top of the head when
+     * the vptr comes from before it. Every use of the vptr, not just those
+     * after the checks, has to come after the select, so no value derived
+     * from the unmasked vptr reaches the call. A chain whose vptr is also
+     * used elsewhere, e.g. on a path the checks do not guard, keeps its
+     * branches.
+     */
+    bool maskChain(sd_check_chain_t &chain, DominatorTree &DT) {
+      std::set<sd_vptr_loc_t> locs;
+      if (!sd_getChainLocations(chain, locs, true) || locs.empty())
+        return false;
+
+      Instruction* insertPt = chain.head->getFirstInsertionPt();
+      Instruction* vptrI = dyn_cast<Instruction>(chain.vptr);
+      if (vptrI && vptrI->getParent() == chain.head && !isa<PHINode>(vptrI))
+        insertPt = std::next(BasicBlock::iterator(vptrI));
+
+      // the checks move up to insertPt, their other operands are constants
+      for (CallInst* check : chain.checks)
+        for (unsigned i = 1; i < check->getNumArgOperands(); i++)
+          if (isa<Instruction>(check->getArgOperand(i)))
+            return false;
+
+      for (Use &U : chain.vptr->uses()) {
+        Instruction* user = dyn_cast<Instruction>(U.getUser());
+        if (!user || onlyFeedsChecks(user, chain))
+          continue;
+        if (user != insertPt && !DT.dominates(insertPt, U))
+          return false;
+      }
+
+      LLVMContext& C = chain.head->getContext();
+      Type* vptrTy = chain.vptr->getType();
+      IRBuilder<> builder(insertPt);
+
+      Value* castVptr = builder.CreatePointerCast(chain.vptr, chain.checks[0]->getArgOperand(0)->getType());
+      Value* valid = NULL;
+      for (CallInst* check : chain.checks) {
+        check->moveBefore(insertPt);
+        check->setArgOperand(0, castVptr);
+        valid = valid ? builder.CreateOr(valid, check) : check;
+      }
+
+      const sd_vptr_loc_t &loc = *locs.begin();
+      Constant* vtable = ConstantExpr::getGetElementPtr(Type::getInt8Ty(C),
+        ConstantExpr::getBitCast(loc.first, Type::getInt8PtrTy(C)),
+        ConstantInt::get(Type::getInt64Ty(C), loc.second));
+      Value* maskedVptr = builder.CreateSelect(valid, chain.vptr,
+                                               ConstantExpr::getBitCast(vtable, vptrTy), "sd.masked.vptr");
+
+      std::vector<Use*> uses;
+      for (Use &U : chain.vptr->uses())
+        if (U.getUser() != castVptr && U.getUser() != maskedVptr)
+          uses.push_back(&U);
+      for (Use* U : uses)
+        U->set(maskedVptr);
+
+      return true;
+    }
+
+    // V is a check of chain, or a cast only the checks of chain use
+    static bool onlyFeedsChecks(Value* V, const sd_check_chain_t &chain) {
+      if (CallInst* CI = dyn_cast<CallInst>(V))
+        return std::find(chain.checks.begin(), chain.checks.end(), CI) != chain.checks.end();
+
+      if (!isa<CastInst>(V) || V->use_empty())
+        return false;
+
+      for (User* U : V->users())
+        if (!onlyFeedsChecks(U, chain))
+          return false;
+      return true;
+    }
+
+    /**
+     * Should the checks of chain in F become a call to a check thunk: F is
+     * optimized for size or cold, and the site is not hot. A site is hot when
+     * the check profile saw it at least -sd-outline-hot-count times, or,
+     * without a profile, when it is inside a loop.
+     */
+    bool shouldOutline(Function &F, const sd_check_chain_t &chain, LoopInfo &LI,
+                       const sd_check_profile_t &siteProfile) {
+      if (!F.hasFnAttribute(Attribute::OptimizeForSize) && !F.hasFnAttribute(Attribute::MinSize) &&
+          !F.hasFnAttribute(Attribute::Cold))
+        return false;
+
+      if (siteProfile.empty())
+        return LI.getLoopFor(chain.head) == NULL;
+
+      uint64_t hits = 0;
+      sd_check_profile_t::const_iterator it = siteProfile.find(sd_getCheckSiteKey(chain.checks[0]));
+      if (it != siteProfile.end())
+        for (uint64_t count : it->second)
+          hits += count;
+
+      return hits < SDOutlineHotCount;
+    }
+
+    /**
+     * Replace the checks of the sites shouldOutline picks with a call to a
+     * thunk holding the same checks:
+     *   call void @sd.check.thunk(i8* %vptr)
+     * which returns when a check passes and traps otherwise. Sites with the
+     * same checks, i.e. the same class of the same cloud, share a thunk. On
+     * x86-64 the thunks use preserve_most, so the call sites keep their
+     * registers live across the call. The outlined chains are removed from
+     * sites, their traps do not know the site id. Returns the number of
+     * outlined sites and sets thunks to the number of thunks.
+     */
+    int64_t outlineChecks(Module &M, check_sites_t &sites, int64_t &thunks) {
+      LLVMContext& C = M.getContext();
+      Type* Int8PtrTy = Type::getInt8PtrTy(C);
+      FunctionType* thunkT = FunctionType::get(Type::getVoidTy(C), Int8PtrTy, false);
+      CallingConv::ID thunkCC = Triple(M.getTargetTriple()).getArch() == Triple::x86_64 ?
+                                CallingConv::PreserveMost : CallingConv::C;
+      std::map<std::vector<Value*>, Function*> thunkMap;
+      int64_t outlined = 0;
+
+      sd_check_profile_t siteProfile;
+      if (!SDCheckProfile.empty())
+        sd_readCheckProfile(SDCheckProfile, siteProfile);
+
+      for (auto &site : sites) {
+        Function &F = *site.first;
+        std::vector<sd_check_chain_t> inlineChains;
+        std::vector<CallInst*> headChecks;
+
+        DominatorTree DT;
+        DT.recalculate(F);
+        LoopInfo LI;
+        LI.Analyze(DT);
+
+        for (sd_check_chain_t &chain : site.second) {
+          if (!shouldOutline(F, chain, LI, siteProfile)) {
+            inlineChains.push_back(chain);
+            continue;
+          }
+
+          // the called intrinsic and its arguments but the vptr, per check
+          std::vector<Value*> key;
+          for (CallInst* check : chain.checks) {
+            key.push_back(check->getCalledFunction());
+            key.insert(key.end(), check->arg_operands().begin() + 1, check->arg_operands().end());
+          }
+
+          Function*& thunkF = thunkMap[key];
+          if (!thunkF) {
+            thunkF = createCheckThunk(M, thunkT, chain);
+            thunkF->setCallingConv(thunkCC);
+          }
+
+          IRBuilder<> builder(chain.head->getTerminator());
+          CallInst* call = builder.CreateCall(thunkF, chain.checks[0]->getArgOperand(0));
+          call->setCallingConv(thunkCC);
+          call->setDoesNotThrow();
+          call->setDebugLoc(chain.checks[0]->getDebugLoc());
+
+          headChecks.push_back(sd_bypassCheckChain(chain));
+          outlined++;
+        }
+
+        if (headChecks.empty())
+          continue;
+
+        removeUnreachableBlocks(F);
+        for (CallInst* check : headChecks)
+          RecursivelyDeleteTriviallyDeadInstructions(check);
+        site.second.swap(inlineChains);
+      }
+
+      // functions left without inline checks need no shared trap block
+      sites.erase(std::remove_if(sites.begin(), sites.end(),
+                                 [](const std::pair<Function*, std::vector<sd_check_chain_t> >& site) {
+                                   return site.second.empty();
+                                 }),
+                  sites.end());
+
+      thunks = thunkMap.size();
+      return outlined;
+    }
+
+    // void sd.check.thunk(i8* vptr), the checks of chain on vptr
+    Function* createCheckThunk(Module &M, FunctionType* thunkT, const sd_check_chain_t &chain) {
+      LLVMContext& C = M.getContext();
+      Function* thunkF = Function::Create(thunkT, GlobalValue::InternalLinkage, "sd.check.thunk", &M);
+      thunkF->addFnAttr(Attribute::NoInline);
+      thunkF->addFnAttr(Attribute::NoUnwind);
+      thunkF->addFnAttr(Attribute::OptimizeForSize);
+
+      BasicBlock* passBB = BasicBlock::Create(C, "sd.check.pass", thunkF);
+      ReturnInst::Create(C, passBB);
+
+      BasicBlock* checkBB = BasicBlock::Create(C, "entry", thunkF, passBB);
+      IRBuilder<> builder(checkBB);
+      int i = 0;
+
+      for (CallInst* check : chain.checks) {
+        SmallVector<Value*, 5> args(check->arg_operands().begin(), check->arg_operands().end());
+        args[0] = thunkF->arg_begin();
+
+        CallInst* success = builder.CreateCall(check->getCalledFunction(), args);
+        if (MDNode* rangeIndex = check->getMetadata(SD_MD_RANGE_INDEX))
+          success->setMetadata(SD_MD_RANGE_INDEX, rangeIndex);
+
+        char blockName[256];
+        snprintf(blockName, sizeof(blockName), "sd.fastcheck.fail.%d", i++);
+
+        BasicBlock* fastCheckFailed = BasicBlock::Create(C, blockName, thunkF);
+        BranchInst* BI = builder.CreateCondBr(success, passBB, fastCheckFailed);
+        MDBuilder MDB(C);
+        BI->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(
+                                              std::numeric_limits<uint32_t>::max(),
+                                              std::numeric_limits<uint32_t>::min()));
+        builder.SetInsertPoint(fastCheckFailed);
+      }
+
+      builder.CreateCall(Intrinsic::getDeclaration(&M, Intrinsic::trap));
+      builder.CreateUnreachable();
+      return thunkF;
+    }
+
+    /**
+     * Count how often each check passes and fails, in per thread counters:
+     *   %slot = select i1 %check, i64 <pass slot>, i64 <fail slot>
+     *   sd.prof.counters[%slot]++
+     * in front of the branch of every check, so the control flow stays as is.
+     * A check gets the slots 2*r and 2*r+1 after the base of its site, where r
+     * is its !sd.range.index, or its position in the chain if the site has
+     * checks without one (span+bitset). The counters are initial-exec TLS, so
+     * the increments need no atomics. A constructor registers the counters and
+     * the site table with the libsdprof runtime, which sums up the counters of
+     * all threads and writes them out at exit.
+     */
+    int64_t instrumentCheckCounters(Module &M, check_sites_t &sites) {
+      LLVMContext& C = M.getContext();
+      Type* Int32Ty = Type::getInt32Ty(C);
+      Type* Int64Ty = Type::getInt64Ty(C);
+      Type* Int8PtrTy = Type::getInt8PtrTy(C);
+      StructType* siteTy = StructType::get(Int32Ty, Int32Ty, Int32Ty, Int32Ty, Int8PtrTy, NULL);
+      std::vector<Constant*> siteTable;
+      std::vector<std::pair<sd_check_chain_t*, uint64_t> > siteBases; // chain, first slot
+      std::set<sd_check_chain_t*> rangeIndexedSites;
+      uint64_t numSlots = 0;
+
+      for (auto &site : sites) {
+        for (sd_check_chain_t &chain : site.second) {
+          uint32_t siteId;
+          sd_getCheckSiteId(chain.checks[0], siteId);
+
+          // number the checks by range index if all of them have one
+          bool rangeIndexed = true;
+          uint64_t numChecks = 0;
+          for (CallInst* check : chain.checks) {
+            MDNode* MD = check->getMetadata(SD_MD_RANGE_INDEX);
+            if (!MD) {
+              rangeIndexed = false;
+              break;
+            }
+            uint64_t r = mdconst::extract<ConstantInt>(MD->getOperand(0))->getZExtValue();
+            numChecks = std::max(numChecks, r + 1);
+          }
+          if (!rangeIndexed)
+            numChecks = chain.checks.size();
+
+          Constant* locStr = ConstantDataArray::getString(C, sd_getCheckSiteKey(chain.checks[0]));
+          GlobalVariable* locGV = new GlobalVariable(M, locStr->getType(), true, GlobalValue::PrivateLinkage,
+                                                     locStr, "sd.prof.loc");
+          locGV->setUnnamedAddr(true);
+          Constant* loc = ConstantExpr::getPointerCast(locGV, Int8PtrTy);
+          Constant* fields[] = {ConstantInt::get(Int32Ty, siteId),
+                                ConstantInt::get(Int32Ty, numChecks),
+                                ConstantInt::get(Int32Ty, rangeIndexed),
+                                ConstantInt::get(Int32Ty, numSlots),
+                                loc};
+          siteTable.push_back(ConstantStruct::get(siteTy, fields));
+          siteBases.push_back(std::make_pair(&chain, numSlots));
+          if (rangeIndexed)
+            rangeIndexedSites.insert(&chain);
+          numSlots += 2 * numChecks;
+        }
+      }
+
+      if (siteTable.empty())
+        return 0;
+
+      ArrayType* countersTy = ArrayType::get(Int64Ty, numSlots);
+      GlobalVariable* counters = new GlobalVariable(M, countersTy, false, GlobalValue::InternalLinkage,
+                                                    Constant::getNullValue(countersTy), "sd.prof.counters",
+                                                    NULL, GlobalVariable::InitialExecTLSModel);
+
+      for (auto &siteBase : siteBases) {
+        sd_check_chain_t &chain = *siteBase.first;
+
+        for (unsigned i = 0; i < chain.checks.size(); i++) {
+          CallInst* check = chain.checks[i];
+          uint64_t r = i;
+          if (rangeIndexedSites.count(&chain))
+            r = mdconst::extract<ConstantInt>(check->getMetadata(SD_MD_RANGE_INDEX)->getOperand(0))
+                  ->getZExtValue();
+
+          Instruction* BI = check->getParent()->getTerminator();
+          IRBuilder<> builder(BI);
+          Value* slot = builder.CreateSelect(check,
+                                             builder.getInt64(siteBase.second + 2 * r),
+                                             builder.getInt64(siteBase.second + 2 * r + 1));
+          Value* counterPtr = builder.CreateInBoundsGEP(counters, {builder.getInt64(0), slot});
+          builder.CreateStore(builder.CreateAdd(builder.CreateLoad(counterPtr), builder.getInt64(1)),
+                              counterPtr);
+        }
+      }
+
+      // the runtime reads the counters of each thread through this function
+      FunctionType* getCountersT = FunctionType::get(Int64Ty->getPointerTo(), false);
+      Function* getCountersF = Function::Create(getCountersT, GlobalValue::InternalLinkage,
+                                                "sd.prof.get_counters", &M);
+      IRBuilder<> builder(BasicBlock::Create(C, "entry", getCountersF));
+      builder.CreateRet(builder.CreateConstInBoundsGEP2_64(counters, 0, 0));
+
+      ArrayType* siteTableTy = ArrayType::get(siteTy, siteTable.size());
+      GlobalVariable* siteTableGV = new GlobalVariable(M, siteTableTy, true, GlobalValue::PrivateLinkage,
+                                                       ConstantArray::get(siteTableTy, siteTable),
+                                                       "sd.prof.sites");
+
+      // void __sd_prof_register(const void* sites, i32 numSites, i64* (*getCounters)(), i32 numSlots)
+      Type* registerArgs[] = {Int8PtrTy, Int32Ty, getCountersT->getPointerTo(), Int32Ty};
+      Constant* registerF = M.getOrInsertFunction("__sd_prof_register",
+                                                  FunctionType::get(Type::getVoidTy(C), registerArgs, false));
+
+      Function* ctorF = Function::Create(FunctionType::get(Type::getVoidTy(C), false),
+                                         GlobalValue::InternalLinkage, "sd.prof.ctor", &M);
+      builder.SetInsertPoint(BasicBlock::Create(C, "entry", ctorF));
+      Value* registerCallArgs[] = {builder.CreatePointerCast(siteTableGV, Int8PtrTy),
+                                   builder.getInt32(siteTable.size()),
+                                   getCountersF,
+                                   builder.getInt32(numSlots)};
+      builder.CreateCall(registerF, registerCallArgs);
+      builder.CreateRetVoid();
+      appendToGlobalCtors(M, ctorF, 0);
+
+      return siteTable.size();
+    }
+
+    struct bitset_site_t {
+      llvm::CallInst* CI;
+      std::set<uint64_t> bits;
+      uint64_t bitSize;
+      uint64_t byteOffset; // only used for bitsets wider than 64 bits
+      uint8_t mask;
+    };
+
+    /**
+     * Lower sd_subst_check_bitset(vptr, start, width, alignment, bits) into
+     *   idx = ror(vptr - start, log2(alignment))
+     *   idx < width && bit idx of bits is set
+     * The index is clamped with a select, so the whole test needs only the
+     * single branch emitted by P4. Bitsets of up to 64 bits are tested against an
+     * immediate, wider ones are packed into one byte array like LowerBitSets does.
+     */
+    int64_t lowerBitSetChecks(Module &M, Function *sd_subst_bitsetF, int64_t &constPtr) {
+      const DataLayout &DL = M.getDataLayout();
+      LLVMContext& C = M.getContext();
+      Type *IntPtrTy = DL.getIntPtrType(C, 0);
+      Type *Int8Ty = Type::getInt8Ty(C);
+      std::vector<bitset_site_t> sites;
+      std::set<GlobalVariable*> bitsetGVs;
+      int64_t bitsetSubst = 0;
+
+      for (const Use &U : sd_subst_bitsetF->uses()) {
+        bitset_site_t site;
+        site.CI = cast<CallInst>(U.getUser());
+        site.bitSize = cast<ConstantInt>(site.CI->getArgOperand(2))->getZExtValue();
+        site.byteOffset = 0;
+        site.mask = 0;
+
+        bool hasBits = sd_getBitSetBits(site.CI, site.bits);
+        assert(hasBits && "malformed bitset check");
+        (void) hasBits;
+
+        bitsetGVs.insert(cast<GlobalVariable>(site.CI->getArgOperand(4)->stripPointerCasts()));
+        sites.push_back(site);
+      }
+
+      // allocate the wide bitsets in decreasing size order
+      std::stable_sort(sites.begin(), sites.end(),
+                       [](const bitset_site_t &s1, const bitset_site_t &s2) {
+                         return s1.bitSize > s2.bitSize;
+                       });
+
+      ByteArrayBuilder BAB;
+      for (bitset_site_t &site : sites)
+        if (site.bitSize > 64)
+          BAB.allocate(site.bits, site.bitSize, site.byteOffset, site.mask);
+
+      GlobalVariable* byteArray = NULL;
+      if (!BAB.Bytes.empty()) {
+        Constant* byteArrayInit = ConstantDataArray::get(C, BAB.Bytes);
+        byteArray = new GlobalVariable(M, byteArrayInit->getType(), true,
+                                       GlobalValue::PrivateLinkage, byteArrayInit, "sd.bitset.bytes");
+      }
+
+      for (bitset_site_t &site : sites) {
+        llvm::CallInst* CI = site.CI;
+        IRBuilder<> builder(CI);
+
+        llvm::Value* vptr            = CI->getArgOperand(0);
+        llvm::Constant* start        = cast<Constant>(CI->getArgOperand(1));
+        llvm::ConstantInt* width     = cast<ConstantInt>(CI->getArgOperand(2));
+        llvm::ConstantInt* alignment = cast<ConstantInt>(CI->getArgOperand(3));
+        unsigned alignmentBits = countTrailingZeros(alignment->getZExtValue());
+
+        GlobalVariable* rootVtbl;
+        uint64_t startOff;
+        bool isStart = sd_getRangeStartOffset(start, rootVtbl, startOff);
+        assert(isStart && "unexpected bitset span start");
+
+        std::vector<uint64_t> constOffs;
+        if (isStart && constVptrOffsets(rootVtbl, DL, vptr, 0, constOffs)) {
+          bool allValid = true;
+          for (uint64_t off : constOffs) {
+            uint64_t rel = off - startOff;
+            allValid &= off >= startOff && rel % alignment->getZExtValue() == 0 &&
+                        site.bits.count(rel >> alignmentBits);
+          }
+
+          if (allValid) {
+            CI->replaceAllUsesWith(llvm::ConstantInt::getTrue(C));
+            CI->eraseFromParent();
+            constPtr++;
+            continue;
+          }
+        }
+
+        llvm::Value *vptrInt = builder.CreatePtrToInt(vptr, IntPtrTy);
+        llvm::Value *diff = builder.CreateSub(vptrInt, start);
+        llvm::Value *idx = diff;
+
+        if (alignmentBits > 0) {
+          llvm::Value *diffShr = builder.CreateLShr(diff, alignmentBits);
+          llvm::Value *diffShl = builder.CreateShl(diff, DL.getPointerSizeInBits(0) - alignmentBits);
+          idx = builder.CreateOr(diffShr, diffShl);
+        }
+
+        llvm::Value *inSpan = builder.CreateICmpULT(idx, width);
+        llvm::Value *clampedIdx = builder.CreateSelect(inSpan, idx, ConstantInt::get(IntPtrTy, 0));
+        llvm::Value *bitSet;
+
+        if (site.bitSize <= 64) {
+          // test the bit against an immediate, this matches to bt on x86
+          IntegerType *BitsTy = site.bitSize <= 32 ? Type::getInt32Ty(C) : Type::getInt64Ty(C);
+          uint64_t bits = 0;
+          for (uint64_t bit : site.bits)
+            bits |= uint64_t(1) << bit;
+
+          llvm::Value *bitIdx = builder.CreateZExtOrTrunc(clampedIdx, BitsTy);
+          llvm::Value *bitMask = builder.CreateShl(ConstantInt::get(BitsTy, 1), bitIdx);
+          llvm::Value *maskedBits = builder.CreateAnd(ConstantInt::get(BitsTy, bits), bitMask);
+          bitSet = builder.CreateICmpNE(maskedBits, ConstantInt::get(BitsTy, 0));
+        } else {
+          Constant *Idxs[] = {ConstantInt::get(IntPtrTy, 0),
+                              ConstantInt::get(IntPtrTy, site.byteOffset)};
+          Constant *bitsBase = ConstantExpr::getInBoundsGetElementPtr(byteArray->getValueType(),
+                                                                      byteArray, Idxs);
+          llvm::Value *byteAddr = builder.CreateGEP(Int8Ty, bitsBase, clampedIdx);
+          llvm::Value *byte = builder.CreateLoad(byteAddr);
+          llvm::Value *byteAndMask = builder.CreateAnd(byte, ConstantInt::get(Int8Ty, site.mask));
+          bitSet = builder.CreateICmpNE(byteAndMask, ConstantInt::get(Int8Ty, 0));
+        }
+
+        CI->replaceAllUsesWith(builder.CreateAnd(inSpan, bitSet));
+        CI->eraseFromParent();
+        bitsetSubst += 1;
+      }
+
+      // the per-site bitsets were only used to carry the bits from P4
+      for (GlobalVariable* gv : bitsetGVs) {
+        // the constant expressions of the lowered checks may still refer to it
+        gv->removeDeadConstantUsers();
+        if (gv->use_empty())
+          gv->eraseFromParent();
+      }
+
+      return bitsetSubst;
+    }
+
+    // collect the offsets into rootVtbl a constant vptr may point to
+    bool constVptrOffsets(GlobalVariable *rootVtbl, const DataLayout &DL, Value *V,
+                          uint64_t off, std::vector<uint64_t> &offs) {
+      if (auto GV = dyn_cast<GlobalVariable>(V)) {
+        if (GV != rootVtbl)
+          return false;
+        offs.push_back(off);
+        return true;
+      }
+
+      if (auto GEP = dyn_cast<GEPOperator>(V)) {
+        APInt APOffset(DL.getPointerSizeInBits(0), 0);
+        if (!GEP->accumulateConstantOffset(DL, APOffset))
+          return false;
+        return constVptrOffsets(rootVtbl, DL, GEP->getPointerOperand(), off + APOffset.getZExtValue(), offs);
+      }
+
+      if (auto Op = dyn_cast<Operator>(V)) {
+        if (Op->getOpcode() == Instruction::BitCast)
+          return constVptrOffsets(rootVtbl, DL, Op->getOperand(0), off, offs);
+
+        if (Op->getOpcode() == Instruction::Select)
+          return constVptrOffsets(rootVtbl, DL, Op->getOperand(1), off, offs) &&
+                 constVptrOffsets(rootVtbl, DL, Op->getOperand(2), off, offs);
+      }
+
+      return false;
     }
 
 //Paul: this validates a constant pointer 
@@ -878,8 +1964,8 @@ INITIALIZE_PASS_DEPENDENCY(SDBuildCHA)
 INITIALIZE_PASS_END(SDUpdateIndices, "cc", "Change Constant", false, false)
 
 
-ModulePass* llvm::createSDUpdateIndicesPass() {
-  return new SDUpdateIndices();
+ModulePass* llvm::createSDUpdateIndicesPass(bool bitsetChecks) {
+  return new SDUpdateIndices(bitsetChecks);
 }
 
 ModulePass* llvm::createSDSubstModulePass() {
@@ -20,6 +20,18 @@ sd_config = {
   "SD_ENABLE_INTERLEAVING" : True,  # interleave the vtables
   "SD_ENABLE_ORDERING"     : False, # order the vtables
   "SD_ENABLE_CHECKS"       : True,  # add the range checks
+  "SD_ENABLE_BITSET_CHECKS": False, # use span+bitset checks where cheaper than range chains
+  "SD_CHECK_FAIL_HANDLER"  : False, # report the failing check site via libdyncast before trapping
+  "SD_CHECK_COUNTERS"      : False, # count passed/failed checks per call site (libsdprof)
+  "SD_NATIVE_CHECKS"       : False, # lower range checks in the x86-64 backend (sub; ror; cmp)
+  "SD_CHECK_REPORT"        : False, # write a per call site check report to SDOutput
+  "SD_BATCH_CHECKS"        : False, # validate the vptrs of loops over object arrays before the loop
+  "SD_OUTLINE_CHECKS"      : False, # call shared check thunks from cold sites in -Os/-Oz code
+  "SD_MASK_CHECKS"         : False, # replace failing vptrs with a valid vtable instead of trapping
+  "SD_RETURN_RANGE"        : False, # check returns of virtual functions against the call site ranges
+  "SD_RETURN_TABLE"        : False, # check returns of directly called functions against their call site tables
+  "SD_SHADOW_STACK"        : False, # protect returns with a thread local shadow stack
+  "SD_ANALYSIS_COMPACT"    : False, # write the SDAnalysis metric results with each target set stored once
 
   # LLVM's cfi sanitizer option
   "SD_LLVM_CFI"            : False, # compile with llvm's cfi technique
@@ -50,6 +62,18 @@ linker_flag_opt_map = {
   "SD_ENABLE_INTERLEAVING" : "-plugin-opt=sd-ivtbl",
   "SD_ENABLE_ORDERING"     : "-plugin-opt=sd-ovtbl",
   "SD_ENABLE_CHECKS"       : "-plugin-opt=sd-return",
+  "SD_ENABLE_BITSET_CHECKS": "-plugin-opt=sd-bitset",
+  "SD_CHECK_FAIL_HANDLER"  : "-plugin-opt=-sd-check-fail-handler",
+  "SD_CHECK_COUNTERS"      : "-plugin-opt=-sd-check-counters",
+  "SD_NATIVE_CHECKS"       : "-plugin-opt=-sd-native-checks",
+  "SD_CHECK_REPORT"        : "-plugin-opt=-sd-check-report",
+  "SD_BATCH_CHECKS"        : "-plugin-opt=-sd-batch-checks",
+  "SD_OUTLINE_CHECKS"      : "-plugin-opt=-sd-outline-checks",
+  "SD_MASK_CHECKS"         : "-plugin-opt=-sd-mask-checks",
+  "SD_RETURN_RANGE"        : "-plugin-opt=sd-return-range",
+  "SD_RETURN_TABLE"        : "-plugin-opt=sd-return-table",
+  "SD_SHADOW_STACK"        : "-plugin-opt=sd-shadowstack",
+  "SD_ANALYSIS_COMPACT"    : "-plugin-opt=-sd-analysis-compact",
   "SD_LTO_EMIT_LLVM"       : "-plugin-opt=emit-llvm",
   "SD_LTO_SAVE_TEMPS"      : "-plugin-opt=save-temps",
 }
@@ -239,6 +263,10 @@ def read_config():
   for (k,v) in sd_config.items():
     clang_config[k] = v
 
+  if sd_config["SD_CHECK_COUNTERS"]:
+    clang_config["SD_LIB_FOLDERS"].append("-L" + clang_config["LLVM_DIR"] + "/sd/libsdprof")
+    clang_config["SD_LIBS"] += ["-lsdprof", "-ldl", "-lpthread"]
+
   if sd_config["SD_LLVM_CFI"]:
     clang_config["CXX_FLAGS"].append('-fsanitize=cfi-vcall')
     clang_config["SD_LIB_FOLDERS"] = []
@@ -249,6 +277,11 @@ def read_config():
   if sd_config["SD_ENABLE_CHECKS"]:
     clang_config["CXX_FLAGS"].append('-femit-vtbl-checks')
 
+  # order the range checks by a call site profile (see SafeDispatchProfile.h)
+  if os.environ.get("SD_CHECK_PROFILE"):
+    clang_config["LD_PLUGIN"].append('-plugin-opt=-sd-check-profile=' +
+                                     os.environ["SD_CHECK_PROFILE"])
+
   return clang_config
 
 if __name__ == '__main__':
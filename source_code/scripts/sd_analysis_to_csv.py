@@ -0,0 +1,133 @@
+#!/usr/bin/env python
+
+# Convert the compact SDAnalysis metric results (*-metric.sda, written with
+# -sd-analysis-compact / SD_ANALYSIS_COMPACT in config.py) back into the
+# metric CSV the analysis writes by default.
+#
+# usage: sd_analysis_to_csv.py [--sets] SDAnalysis-Virtual-metric.sda > SDAnalysis-Virtual-metric.csv
+#
+# With --sets the distinct target sets are printed instead, one per line with
+# their size and the number of column references to them.
+
+from __future__ import print_function
+
+import sys
+
+class Reader:
+  def __init__(self, data):
+    self.data = data
+    self.pos = 0
+
+  def uleb(self):
+    result = 0
+    shift = 0
+    while True:
+      byte = bytearray(self.data[self.pos:self.pos + 1])[0]
+      self.pos += 1
+      result |= (byte & 0x7f) << shift
+      shift += 7
+      if byte < 0x80:
+        return result
+
+  def sleb(self):
+    result = 0
+    shift = 0
+    while True:
+      byte = bytearray(self.data[self.pos:self.pos + 1])[0]
+      self.pos += 1
+      result |= (byte & 0x7f) << shift
+      shift += 7
+      if byte < 0x80:
+        if byte & 0x40:
+          result -= 1 << shift
+        return result
+
+  def string(self):
+    length = self.uleb()
+    s = self.data[self.pos:self.pos + length].decode('utf-8')
+    self.pos += length
+    return s
+
+def read_sda(path):
+  with open(path, 'rb') as f:
+    data = f.read()
+
+  if not data:
+    return None
+
+  assert data[:8] == b'SDASET01', path + " is not a compact SDAnalysis file"
+  r = Reader(data)
+  r.pos = 8
+
+  names = [r.string() for _ in range(r.uleb())]
+
+  sets = []
+  for _ in range(r.uleb()):
+    ids = []
+    previous = 0
+    for _ in range(r.uleb()):
+      previous += r.uleb()
+      ids.append(previous)
+    sets.append(ids)
+
+  header = r.string()
+  labels = [r.string() for _ in range(r.uleb())]
+
+  rows = []
+  for _ in range(r.uleb()):
+    prefix = r.string()
+    columns = []
+    for _ in range(r.uleb()):
+      label = r.uleb()
+      shown = r.sleb()
+      refs = [r.uleb() for _ in range(r.uleb())]
+      columns.append((label, shown, refs))
+    rows.append((prefix, columns))
+
+  return (names, sets, header, labels, rows)
+
+def write_csv(sda, out):
+  (names, sets, header, labels, rows) = sda
+  quoted = ['"' + name + '"' for name in names]
+
+  out.write(header)
+  for (prefix, columns) in rows:
+    parts = [prefix]
+    for (label, shown, refs) in columns:
+      parts.append(", %s(%d):" % (labels[label], shown))
+      for ref in refs:
+        for i in sets[ref]:
+          parts.append(',' + quoted[i])
+    parts.append('\n')
+    out.write(''.join(parts))
+
+def write_sets(sda, out):
+  (names, sets, header, labels, rows) = sda
+  uses = [0] * len(sets)
+  for (prefix, columns) in rows:
+    for (label, shown, refs) in columns:
+      for ref in refs:
+        uses[ref] += 1
+
+  for (setId, ids) in enumerate(sets):
+    out.write("set %d size=%d uses=%d\n" % (setId, len(ids), uses[setId]))
+
+def main(args):
+  sets = '--sets' in args
+  paths = [a for a in args if a != '--sets']
+  if len(paths) != 1:
+    print("usage: sd_analysis_to_csv.py [--sets] file.sda", file=sys.stderr)
+    return 1
+
+  sda = read_sda(paths[0])
+  if sda is None:
+    return 0
+
+  if sets:
+    write_sets(sda, sys.stdout)
+  else:
+    write_csv(sda, sys.stdout)
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,70 @@
+#!/usr/bin/env python
+
+# Convert the vptr check counters written by libsdprof (sdprof.out) into a
+# range profile for -sd-check-profile (SD_CHECK_PROFILE in config.py).
+#
+# usage: sdprof_to_profile.py [--stats] sdprof.out [more.out ...] > checks.prof
+#
+# Counters of the same site in several files are added up. With --stats the
+# pass/fail counts of every site are printed instead, for looking at the check
+# overhead of a run.
+
+from __future__ import print_function
+
+import sys
+import struct
+
+def read_sdprof(path, sites):
+  with open(path, 'rb') as f:
+    data = f.read()
+
+  assert data[:8] == b'SDPROF01', path + " is not a libsdprof file"
+  (numSites,) = struct.unpack_from('<I', data, 8)
+  pos = 12
+
+  for _ in range(numSites):
+    (siteId, numChecks, rangeIndexed, locLength) = struct.unpack_from('<IIII', data, pos)
+    pos += 16
+    loc = data[pos:pos + locLength].decode('utf-8')
+    pos += locLength
+    counts = struct.unpack_from('<%dQ' % (2 * numChecks), data, pos)
+    pos += 16 * numChecks
+
+    key = (loc, rangeIndexed)
+    if key not in sites:
+      sites[key] = [0] * (2 * numChecks)
+    old = sites[key]
+    if len(old) < len(counts):
+      old.extend([0] * (len(counts) - len(old)))
+    for i in range(len(counts)):
+      old[i] += counts[i]
+
+def main(args):
+  stats = '--stats' in args
+  paths = [a for a in args if a != '--stats']
+  if not paths:
+    print("usage: sdprof_to_profile.py [--stats] sdprof.out ...", file=sys.stderr)
+    return 1
+
+  sites = {}
+  for path in paths:
+    read_sdprof(path, sites)
+
+  if stats:
+    for ((loc, rangeIndexed), counts) in sorted(sites.items()):
+      passed = counts[0::2]
+      failed = counts[1::2]
+      print("%s ranges=%d passed=%s failed=%s" % (loc, rangeIndexed, passed, failed))
+    return 0
+
+  print("# <function> <file>:<line>:<col> <hits of range 0> <hits of range 1> ...")
+  for ((loc, rangeIndexed), counts) in sorted(sites.items()):
+    # the profile refers to ranges by width order index, span+bitset sites
+    # have a single check and nothing to order
+    if not rangeIndexed or len(counts) < 4:
+      continue
+    print(loc + " " + " ".join(str(c) for c in counts[0::2]))
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv[1:]))
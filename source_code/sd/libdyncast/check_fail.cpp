@@ -0,0 +1,11 @@
+#include <cstdio>
+#include <cstdlib>
+
+// Called by the shared sd.check.fail block of a function when a vptr check
+// fails and the binary was linked with -plugin-opt=-sd-check-fail-handler.
+// The site id is the one listed by SDSubstModule for the failing check.
+extern "C" __attribute__((cold, noreturn, noinline, section(".text.unlikely")))
+void __sd_check_failed(int siteId) {
+  fprintf(stderr, "SafeDispatch: vptr check failed at check site %d\n", siteId);
+  abort();
+}
@@ -0,0 +1,157 @@
+// Runtime for the per call site vptr check counters emitted by SDSubstModule
+// with -sd-check-counters. Link with -lsdprof -ldl -lpthread.
+//
+// Every instrumented module keeps its counters in an initial-exec TLS array
+// and registers it from a constructor. The counters of a thread are added to
+// the module totals when the thread exits, the main thread's at exit, when the
+// totals are written to $SD_PROF_FILE (default sdprof.out):
+//
+//   char     magic[8] = "SDPROF01"
+//   uint32_t numSites
+//   numSites times:
+//     uint32_t siteId
+//     uint32_t numChecks
+//     uint32_t rangeIndexed   1 if check r is the r-th range in width order
+//     uint32_t locLength
+//     char     loc[locLength] "<function> <file>:<line>:<col>"
+//     numChecks times:
+//       uint64_t passed
+//       uint64_t failed
+//
+// scripts/sdprof_to_profile.py turns this into a -sd-check-profile file.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+struct sd_prof_site_t {
+  uint32_t siteId;
+  uint32_t numChecks;
+  uint32_t rangeIndexed;
+  uint32_t firstSlot;
+  const char* loc;
+};
+
+typedef uint64_t* (*sd_get_counters_t)();
+
+struct sd_prof_module_t {
+  const sd_prof_site_t* sites;
+  uint32_t numSites;
+  sd_get_counters_t getCounters;
+  uint32_t numSlots;
+  uint64_t* totals;
+  sd_prof_module_t* next;
+};
+
+static sd_prof_module_t* modules = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t threadKey;
+static pthread_once_t threadKeyOnce = PTHREAD_ONCE_INIT;
+
+// add the counters of the calling thread to the totals
+static void sd_prof_flush_thread() {
+  pthread_mutex_lock(&lock);
+  for (sd_prof_module_t* m = modules; m; m = m->next) {
+    uint64_t* counters = m->getCounters();
+    for (uint32_t i = 0; i < m->numSlots; i++) {
+      m->totals[i] += counters[i];
+      counters[i] = 0;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void sd_prof_thread_exit(void*) {
+  sd_prof_flush_thread();
+}
+
+static void sd_prof_make_key() {
+  pthread_key_create(&threadKey, sd_prof_thread_exit);
+}
+
+static void sd_prof_write() {
+  sd_prof_flush_thread();
+
+  const char* path = getenv("SD_PROF_FILE");
+  FILE* out = fopen(path ? path : "sdprof.out", "wb");
+  if (!out) {
+    perror("sdprof");
+    return;
+  }
+
+  uint32_t numSites = 0;
+  for (sd_prof_module_t* m = modules; m; m = m->next)
+    numSites += m->numSites;
+
+  fwrite("SDPROF01", 1, 8, out);
+  fwrite(&numSites, sizeof(numSites), 1, out);
+
+  for (sd_prof_module_t* m = modules; m; m = m->next) {
+    for (uint32_t s = 0; s < m->numSites; s++) {
+      const sd_prof_site_t& site = m->sites[s];
+      uint32_t locLength = strlen(site.loc);
+
+      fwrite(&site.siteId, sizeof(uint32_t), 1, out);
+      fwrite(&site.numChecks, sizeof(uint32_t), 1, out);
+      fwrite(&site.rangeIndexed, sizeof(uint32_t), 1, out);
+      fwrite(&locLength, sizeof(uint32_t), 1, out);
+      fwrite(site.loc, 1, locLength, out);
+      fwrite(&m->totals[site.firstSlot], sizeof(uint64_t), 2 * site.numChecks, out);
+    }
+  }
+
+  fclose(out);
+}
+
+extern "C" void __sd_prof_register(const void* sites, uint32_t numSites,
+                                   sd_get_counters_t getCounters, uint32_t numSlots) {
+  sd_prof_module_t* m = (sd_prof_module_t*) calloc(1, sizeof(sd_prof_module_t));
+  m->sites = (const sd_prof_site_t*) sites;
+  m->numSites = numSites;
+  m->getCounters = getCounters;
+  m->numSlots = numSlots;
+  m->totals = (uint64_t*) calloc(numSlots, sizeof(uint64_t));
+
+  pthread_mutex_lock(&lock);
+  if (!modules)
+    atexit(sd_prof_write);
+  m->next = modules;
+  modules = m;
+  pthread_mutex_unlock(&lock);
+}
+
+// Threads are started through this wrapper, so that their counters are
+// flushed by the key destructor when they exit, also through pthread_exit.
+
+struct sd_prof_start_t {
+  void* (*fn)(void*);
+  void* arg;
+};
+
+static void* sd_prof_thread_start(void* p) {
+  sd_prof_start_t start = *(sd_prof_start_t*) p;
+  free(p);
+
+  pthread_setspecific(threadKey, (void*) 1);
+  return start.fn(start.arg);
+}
+
+extern "C" int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+                              void* (*fn)(void*), void* arg) {
+  typedef int (*pthread_create_t)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*);
+  static pthread_create_t realCreate = (pthread_create_t) dlsym(RTLD_NEXT, "pthread_create");
+
+  pthread_once(&threadKeyOnce, sd_prof_make_key);
+
+  sd_prof_start_t* start = (sd_prof_start_t*) malloc(sizeof(sd_prof_start_t));
+  start->fn = fn;
+  start->arg = arg;
+
+  int ret = realCreate(thread, attr, sd_prof_thread_start, start);
+  if (ret)
+    free(start);
+  return ret;
+}
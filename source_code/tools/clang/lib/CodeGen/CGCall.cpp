@@ -31,6 +31,7 @@
 #include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Transforms/IPO/SafeDispatchMD.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include <sstream>
 using namespace clang;
@@ -3046,6 +3047,9 @@ RValue CodeGenFunction::EmitCall(const CGFunctionInfo &CallInfo,
                                  llvm::Instruction **callOrInvoke) {
   // FIXME: We no longer need the types from CallArgs; lift up and simplify.
 
+  // the callee as loaded, before any of the casts below
+  llvm::Value *SDCallee = Callee;
+
   // Handle struct-return functions by passing a pointer to the
   // location that we would like to return into.
   QualType RetTy = CallInfo.getReturnType();
@@ -3389,6 +3393,15 @@ RValue CodeGenFunction::EmitCall(const CGFunctionInfo &CallInfo,
   if (callOrInvoke)
     *callOrInvoke = CS.getInstruction();
 
+  // SafeDispatch: link a virtual call to the check of its vptr
+  if (!SDVirtualCallSites.empty()) {
+    auto SDSite = SDVirtualCallSites.find(SDCallee);
+    if (SDSite != SDVirtualCallSites.end()) {
+      CS.getInstruction()->setMetadata(SD_MD_CALL_SITE, SDSite->second);
+      SDVirtualCallSites.erase(SDSite);
+    }
+  }
+
   if (CurCodeDecl && CurCodeDecl->hasAttr<FlattenAttr>() &&
       !CS.hasFnAttr(llvm::Attribute::NoInline))
     Attrs =
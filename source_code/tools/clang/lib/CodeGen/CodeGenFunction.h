@@ -266,6 +266,11 @@ public:
   /// finally block or filter expression.
   bool IsOutlinedSEHHelper;
 
+  /// SafeDispatch: the call site metadata of the checked virtual function
+  /// pointers loaded in this function. EmitCall attaches it to the call
+  /// through the pointer, linking the call to its sd_get_checked_vptr.
+  llvm::DenseMap<llvm::Value *, llvm::MDNode *> SDVirtualCallSites;
+
   const CodeGen::CGBlockInfo *BlockInfo;
   llvm::Value *BlockPointer;
 
@@ -26,6 +26,7 @@
 #include "CodeGenModule.h"
 #include "TargetInfo.h"
 #include "clang/AST/Mangle.h"
+#include "clang/AST/RecordLayout.h"
 #include "clang/AST/Type.h"
 #include "clang/AST/StmtCXX.h"
 #include "llvm/IR/CallSite.h"
@@ -40,6 +41,7 @@
 #include "llvm/Transforms/IPO/SafeDispatchMD.h"
 #include "llvm/Transforms/IPO/SafeDispatchTools.h"
 #include "llvm/Transforms/IPO/SafeDispatchVtblMD.h"
+#include <map>
 #include <vector>
 #define WORD_WIDTH 8
 
@@ -153,6 +155,54 @@ llvm::Value* sd_getRangeEnd(CodeGenModule& CGM,
   return builder.CreateCall(CGM.getIntrinsic(llvm::Intrinsic::sd_vtbl_range_end), //Paul: see Intrinsics.td file
                             Args); //this Args are the parameters of the above sd_vtbl_range_end 
  }
+
+// the dynamic non-virtual bases of RD (RD included) by their offset in RD, a
+// base sharing its offset with one of its derived classes is left out: the
+// vptr at that offset is the vptr of the derived class
+static void sd_collectMemptrBases(clang::ASTContext& Context,
+                                  const clang::CXXRecordDecl* RD,
+                                  clang::CharUnits Offset,
+                                  std::map<int64_t, const clang::CXXRecordDecl*>& Bases) {
+  Bases.insert(std::make_pair(Offset.getQuantity(), RD));
+
+  const clang::ASTRecordLayout& Layout = Context.getASTRecordLayout(RD);
+  for (const clang::CXXBaseSpecifier& Spec : RD->bases()) {
+    const clang::CXXRecordDecl* Base = Spec.getType()->getAsCXXRecordDecl();
+    if (Spec.isVirtual() || !Base->isDynamicClass())
+      continue;
+    sd_collectMemptrBases(Context, Base, Offset + Layout.getBaseClassOffset(Base), Bases);
+  }
+}
+
+// check the vptr of an object of class RD that is called through a pointer to
+// a virtual member function. P4 checks it against the ranges of RD like the
+// vptr of an ordinary virtual call. The called method is not known, so the
+// function name metadata is empty.
+llvm::Value* sd_getCheckedMemptrVTable(CodeGenModule& CGM,
+                                       CGBuilderTy& builder,
+                                       const clang::CXXRecordDecl* RD,
+                                       llvm::Value* VTableAP) {
+  llvm::Module& M = CGM.getModule();
+  llvm::LLVMContext& C = M.getContext();
+
+  llvm::GlobalVariable* VTableGV = sd_needGlobalVar(&CGM.getCXXABI(), RD) ?
+              CGM.getCXXABI().getAddrOfVTable(RD, clang::CharUnits()) :
+              NULL;
+  std::string ClassName = CGM.getCXXABI().GetClassMangledName(RD);
+
+  llvm::Value* mdValue = llvm::MetadataAsValue::get(C, sd_getClassNameMetadata(ClassName, M, VTableGV));
+  llvm::Value* functionMDValue = llvm::MetadataAsValue::get(C, llvm::MDNode::get(C, llvm::MDString::get(C, "")));
+  llvm::Value* castPointer = builder.CreatePointerCast(VTableAP, CGM.Int8PtrTy);
+
+  llvm::Value* intr = builder.CreateCall4(
+              CGM.getIntrinsic(llvm::Intrinsic::sd_get_checked_vptr), //Paul: see Intrinsics.td file
+              castPointer,
+              mdValue,
+              mdValue,
+              functionMDValue);
+
+  return builder.CreatePointerCast(intr, VTableAP->getType());
+}
 }
 
 namespace {
@@ -553,6 +603,7 @@ llvm::Value *ItaniumCXXABI::EmitLoadOfMemberFunctionPointer(
 
   // Apply the adjustment and cast back to the original struct type
   // for consistency.
+  llvm::Value *UnadjustedThis = This;
   llvm::Value *Ptr = Builder.CreateBitCast(This, Builder.getInt8PtrTy());
   Ptr = Builder.CreateInBoundsGEP(Ptr, Adj);
   This = Builder.CreateBitCast(Ptr, This->getType(), "this.adjusted");
@@ -579,6 +630,56 @@ llvm::Value *ItaniumCXXABI::EmitLoadOfMemberFunctionPointer(
   llvm::Type *VTableTy = Builder.getInt8PtrTy();
   llvm::Value *VTable = CGF.GetVTablePtr(This, VTableTy);
 
+  std::string Name = CGM.getCXXABI().GetClassMangledName(RD);
+
+  // Check the vptr the function is loaded from. A member pointer of RD or of
+  // one of its bases has the offset of a dynamic non-virtual base of RD as
+  // its adjustment, and the vptr is checked against the ranges of that base.
+  // A member pointer converted down from a class derived from RD has some
+  // other, usually negative, adjustment into an object this TU may not know.
+  // Then the object is checked against the ranges of RD instead and the
+  // adjusted vptr is only used once that check passed.
+  if (CGM.getCodeGenOpts().EmitVTBLChecks && sd_isVtableName(Name) && RD->isDynamicClass()) {
+    std::map<int64_t, const CXXRecordDecl*> Bases;
+    sd_collectMemptrBases(CGM.getContext(), RD, CharUnits::Zero(), Bases);
+
+    llvm::BasicBlock *CheckedBB = CGF.createBasicBlock("memptr.checked");
+    llvm::BasicBlock *OtherAdjBB = CGF.createBasicBlock("memptr.otheradj");
+    llvm::SwitchInst *AdjSwitch = Builder.CreateSwitch(Adj, OtherAdjBB, Bases.size());
+    llvm::SmallVector<std::pair<llvm::Value*, llvm::BasicBlock*>, 4> CheckedVTables;
+
+    for (auto &Base : Bases) {
+      llvm::BasicBlock *CheckBB = CGF.createBasicBlock("memptr.check");
+      AdjSwitch->addCase(llvm::ConstantInt::get(cast<llvm::IntegerType>(CGM.PtrDiffTy), Base.first),
+                         CheckBB);
+      CGF.EmitBlock(CheckBB);
+
+      // bases SafeDispatch does not check (std::) are not checked here either
+      std::string BaseName = GetClassMangledName(Base.second);
+      llvm::Value *CheckedVTable = sd_isVtableName(BaseName) ?
+                  sd_getCheckedMemptrVTable(CGM, Builder, Base.second, VTable) :
+                  VTable;
+      CheckedVTables.push_back(std::make_pair(CheckedVTable, Builder.GetInsertBlock()));
+      Builder.CreateBr(CheckedBB);
+    }
+
+    CGF.EmitBlock(OtherAdjBB);
+    llvm::Value *ObjectVTable = CGF.GetVTablePtr(UnadjustedThis, VTableTy);
+    llvm::Value *CheckedObject = sd_getCheckedMemptrVTable(CGM, Builder, RD, ObjectVTable);
+    // the check is readnone, tie the adjusted vptr to its result to keep it
+    llvm::Value *ObjectOK = Builder.CreateIsNotNull(CheckedObject, "memptr.object.checked");
+    llvm::Value *OtherVTable = Builder.CreateSelect(ObjectOK, VTable,
+                                                    llvm::Constant::getNullValue(VTableTy));
+    CheckedVTables.push_back(std::make_pair(OtherVTable, Builder.GetInsertBlock()));
+    Builder.CreateBr(CheckedBB);
+
+    CGF.EmitBlock(CheckedBB);
+    llvm::PHINode *CheckedPN = Builder.CreatePHI(VTableTy, CheckedVTables.size(), "memptr.vtable");
+    for (auto &Checked : CheckedVTables)
+      CheckedPN->addIncoming(Checked.first, Checked.second);
+    VTable = CheckedPN;
+  }
+
   // Apply the offset.
   llvm::Value *VTableOffset = FnAsInt;
   if (!UseARMMethodPtrABI)
@@ -587,7 +688,6 @@ llvm::Value *ItaniumCXXABI::EmitLoadOfMemberFunctionPointer(
 
   llvm::GetElementPtrInst* vtableGepInst = dyn_cast<llvm::GetElementPtrInst>(VTable);
   assert(vtableGepInst);
-  std::string Name = CGM.getCXXABI().GetClassMangledName(RD);
 
   //Paul: used to set some metadata 
   if (sd_isVtableName(Name) && RD->isDynamicClass()) {
@@ -1768,7 +1868,8 @@ static llvm::Value* sd_getCheckedVTable2(CodeGenModule &CGM,
                                        CodeGenFunction &CGF, 
                                     const CXXMethodDecl *MD, 
                                      llvm::Value *&VTableAP, 
-                           const CXXRecordDecl *preciseType) {
+                           const CXXRecordDecl *preciseType,
+                                 llvm::MDNode *&callSiteMD) {
 
   assert(MD && "Non-null method decl");
   assert(MD->isInstance() && "Shouldn't see a static method");
@@ -1811,13 +1912,29 @@ static llvm::Value* sd_getCheckedVTable2(CodeGenModule &CGM,
   llvm::MDNode* functionMD = llvm::MDNode::get(C, functionName);
   llvm::Value* functionMDValue = llvm::MetadataAsValue::get(C, functionMD);
 
-  llvm::Value* intr = CGF.Builder.CreateCall4(
+  llvm::CallInst* intr = CGF.Builder.CreateCall4(
               CGM.getIntrinsic(llvm::Intrinsic::sd_get_checked_vptr), //Paul: see Intrinsics.td file
               castPointer,
               mdValue,
               preciseMDValue,
               functionMDValue);
 
+  // a final class can only be the dynamic type itself, and a final method
+  // is called whatever the dynamic type is, so the link time passes can
+  // check for a single vtable or call the method directly
+  llvm::SmallVector<llvm::Metadata*, 2> finalMDs;
+  if (MD->getParent()->hasAttr<FinalAttr>() || (preciseType && preciseType->hasAttr<FinalAttr>()))
+    finalMDs.push_back(llvm::MDString::get(C, "class"));
+  if (MD->hasAttr<FinalAttr>())
+    finalMDs.push_back(llvm::MDString::get(C, "method"));
+  if (!finalMDs.empty())
+    intr->setMetadata(SD_MD_FINAL, llvm::MDNode::get(C, finalMDs));
+
+  // a distinct node stays unique when the modules are linked, the call
+  // through the loaded function pointer gets the same one in EmitCall
+  callSiteMD = llvm::MDNode::getDistinct(C, None);
+  intr->setMetadata(SD_MD_CALL_SITE, callSiteMD);
+
   return CGF.Builder.CreatePointerCast(intr, VTableAP->getType());
 }
 
@@ -1839,8 +1956,9 @@ llvm::Value *ItaniumCXXABI::getVirtualFunctionPointer(CodeGenFunction &CGF,
   const CXXRecordDecl* RD = MD->getParent();
   std::string Name = this->GetClassMangledName(RD);
 
+  llvm::MDNode* callSiteMD = NULL;
   if (CGM.getCodeGenOpts().EmitVTBLChecks && sd_isVtableName(Name)) {
-    VTable = sd_getCheckedVTable2(CGM, CGF, MD, VTable, preciseType);
+    VTable = sd_getCheckedVTable2(CGM, CGF, MD, VTable, preciseType, callSiteMD);
   }
 
   if (CGF.SanOpts.has(SanitizerKind::CFIVCall))
@@ -1860,7 +1978,10 @@ llvm::Value *ItaniumCXXABI::getVirtualFunctionPointer(CodeGenFunction &CGF,
     VFuncPtr = CGF.Builder.CreateConstInBoundsGEP1_64(VTable, VTableIndex, "vfn");
   }
 
-  return CGF.Builder.CreateLoad(VFuncPtr);
+  llvm::Value* VFunc = CGF.Builder.CreateLoad(VFuncPtr);
+  if (callSiteMD)
+    CGF.SDVirtualCallSites[VFunc] = callSiteMD;
+  return VFunc;
 }
 
 llvm::Value *ItaniumCXXABI::EmitVirtualDestructorCall(
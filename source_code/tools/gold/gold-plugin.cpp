@@ -107,6 +107,10 @@ namespace options {
   static bool RunSDIVTBLPass = false;
   static bool RunSDOVTBLPass = false;
   static bool RunSDReturnPass = false;
+  static bool RunSDReturnRange = false;
+  static bool RunSDReturnTable = false;
+  static bool RunSDBitsetChecks = false;
+  static bool RunSDShadowStack = false;
 
   static void process_plugin_option(const char* opt_)
   {
@@ -130,8 +134,16 @@ namespace options {
       RunSDIVTBLPass = true;
     } else if (opt == "sd-return") {
       RunSDReturnPass = true;
+    } else if (opt == "sd-return-range") {
+      RunSDReturnRange = true;
+    } else if (opt == "sd-return-table") {
+      RunSDReturnTable = true;
     } else if (opt == "sd-ovtbl") {
       RunSDOVTBLPass = true;
+    } else if (opt == "sd-bitset") {
+      RunSDBitsetChecks = true;
+    } else if (opt == "sd-shadowstack") {
+      RunSDShadowStack = true;
     } else if (opt == "save-temps") {
       TheOutputType = OT_SAVE_TEMPS;
     } else if (opt == "disable-output") {
@@ -740,6 +752,10 @@ static void runLTOPasses(Module &M, TargetMachine &TM) {
   PMB.EmitIVTBLs = options::RunSDIVTBLPass;
   PMB.EmitOVTBLs = options::RunSDOVTBLPass;
   PMB.EmitReturnChecks = options::RunSDReturnPass;
+  PMB.EmitReturnRangeChecks = options::RunSDReturnRange;
+  PMB.EmitReturnTableChecks = options::RunSDReturnTable;
+  PMB.EmitBitsetChecks = options::RunSDBitsetChecks;
+  PMB.EmitShadowStack = options::RunSDShadowStack;
   PMB.OptLevel = options::OptLevel;
   PMB.populateLTOPassManager(passes);
   passes.run(M);
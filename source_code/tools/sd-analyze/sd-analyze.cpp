@@ -0,0 +1,264 @@
+//===- sd-analyze.cpp - SafeDispatch analysis of saved bitcode ------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Runs the SafeDispatch call site analysis (SDFix, SDBuildCHA, SDAnalysis)
+// on bitcode without a link, e.g. on the <output>.bc that the gold plugin
+// keeps with -plugin-opt=save-temps. The inputs go through the same LTO
+// pipeline as in the plugin with -plugin-opt=sd-return, so the analysis sees
+// the inlined and optimized program the link sees. -O and -mcpu have to
+// match the plugin options of the link:
+//
+//  sd-analyze main.bc
+//  sd-analyze a.bc b.bc c.bc -o SDOutput/program
+//  sd-analyze -separate prog1.bc prog2.bc prog3.bc
+//
+// The inputs are loaded lazily and linked into one program, or analysed one
+// by one with -separate. The results are written to SDOutput/<name>-*.csv
+// like in the link, where <name> is the -o name or the name of the (first)
+// input without .bc. The SDAnalysis options (-sd-analysis-threads,
+// -sd-analysis-compact, ...) work as in the plugin.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Linker/Linker.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/AutoUpgrade.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include <memory>
+using namespace llvm;
+
+static cl::list<std::string>
+InputFilenames(cl::Positional, cl::OneOrMore,
+               cl::desc("<input bitcode files>"));
+
+static cl::opt<std::string>
+OutputName("o", cl::desc("Name of the analysis results (default: SDOutput/<input name>)"),
+           cl::value_desc("name"));
+
+static cl::opt<bool>
+Separate("separate", cl::desc("Analyse every input as a program of its own"));
+
+static cl::opt<unsigned>
+OptLevel("O", cl::desc("LTO optimization level of the link (default 2, as in the plugin)"),
+         cl::Prefix, cl::ZeroOrMore, cl::init(2));
+
+static cl::opt<std::string>
+MCPU("mcpu", cl::desc("Target CPU of the link (-plugin-opt=mcpu=)"),
+     cl::value_desc("cpu-name"), cl::init(""));
+
+static cl::opt<bool>
+Verbose("v", cl::desc("Print information about actions taken"));
+
+static cl::opt<bool>
+SuppressWarnings("suppress-warnings", cl::desc("Suppress all linking warnings"),
+                 cl::init(false));
+
+static void diagnosticHandler(const DiagnosticInfo &DI) {
+  unsigned Severity = DI.getSeverity();
+  switch (Severity) {
+  case DS_Error:
+    errs() << "ERROR: ";
+    break;
+  case DS_Warning:
+    if (SuppressWarnings)
+      return;
+    errs() << "WARNING: ";
+    break;
+  case DS_Remark:
+  case DS_Note:
+    llvm_unreachable("Only expecting warnings and errors");
+  }
+
+  DiagnosticPrinterRawOStream DP(errs());
+  DI.print(DP);
+  errs() << '\n';
+}
+
+static std::unique_ptr<Module>
+loadFile(const char *argv0, const std::string &FN, LLVMContext &Context) {
+  SMDiagnostic Err;
+  if (Verbose) errs() << "Loading '" << FN << "'\n";
+  std::unique_ptr<Module> Result = getLazyIRFileModule(FN, Err, Context);
+  if (!Result) {
+    Err.print(argv0, errs());
+    return nullptr;
+  }
+
+  Result->materializeMetadata();
+  UpgradeDebugInfo(*Result);
+
+  return Result;
+}
+
+// Link the inputs into one module, only materializing what is linked in.
+static std::unique_ptr<Module>
+loadProgram(const char *argv0, LLVMContext &Context, ArrayRef<std::string> Files) {
+  auto Composite = make_unique<Module>("sd-analyze", Context);
+  Linker L(Composite.get(), diagnosticHandler);
+
+  for (const auto &File : Files) {
+    std::unique_ptr<Module> M = loadFile(argv0, File, Context);
+    if (!M.get()) {
+      errs() << argv0 << ": error loading file '" << File << "'\n";
+      return nullptr;
+    }
+
+    if (Composite->getTargetTriple().empty()) {
+      Composite->setTargetTriple(M->getTargetTriple());
+      Composite->setDataLayout(M->getDataLayout());
+    }
+
+    if (Verbose)
+      errs() << "Linking in '" << File << "'\n";
+
+    if (L.linkInModule(M.get()))
+      return nullptr;
+  }
+
+  if (verifyModule(*Composite, &errs())) {
+    errs() << argv0 << ": error: linked module is broken!\n";
+    return nullptr;
+  }
+
+  return Composite;
+}
+
+// The sd_filename and sd_output metadata the gold plugin adds, SDAnalysis
+// names its output after them.
+static void setOutputName(Module &M, StringRef Name) {
+  LLVMContext &Context = M.getContext();
+
+  if (NamedMDNode *Old = M.getNamedMetadata("sd_filename"))
+    M.eraseNamedMetadata(Old);
+  if (NamedMDNode *Old = M.getNamedMetadata("sd_output"))
+    M.eraseNamedMetadata(Old);
+
+  SmallString<128> FileName = sys::path::filename(Name);
+  M.getOrInsertNamedMetadata("sd_filename")->addOperand(
+      MDNode::get(Context, MDString::get(Context, FileName.c_str())));
+
+  SmallString<128> Output;
+  if (sys::path::has_parent_path(Name)) {
+    Output = Name;
+  } else {
+    sys::fs::create_directory("SDOutput", true);
+    sys::path::append(Output, "SDOutput", FileName);
+  }
+  M.getOrInsertNamedMetadata("sd_output")->addOperand(
+      MDNode::get(Context, MDString::get(Context, Output.c_str())));
+}
+
+static std::string defaultOutputName(StringRef InputFile) {
+  StringRef Name = sys::path::filename(InputFile);
+  if (Name.endswith(".opt.bc"))
+    return Name.drop_back(7);
+  if (Name.endswith(".bc"))
+    return Name.drop_back(3);
+  return Name;
+}
+
+static bool analyse(const char *argv0, LLVMContext &Context, ArrayRef<std::string> Files,
+                    StringRef Name) {
+  std::unique_ptr<Module> M = loadProgram(argv0, Context, Files);
+  if (!M)
+    return false;
+
+  setOutputName(*M, Name);
+
+  // the LTO pipeline of the plugin, SDAnalysis runs after the LTO
+  // optimizations. Nothing after it writes any output.
+  Triple TheTriple(M->getTargetTriple());
+  std::string Error;
+  std::unique_ptr<TargetMachine> TM;
+  if (const Target *TheTarget = TargetRegistry::lookupTarget(TheTriple.str(), Error))
+    TM.reset(TheTarget->createTargetMachine(TheTriple.str(), MCPU, "", TargetOptions()));
+  else
+    errs() << argv0 << ": warning: " << Error << ", the inlining costs may differ from the link\n";
+
+  legacy::PassManager Passes;
+  if (TM)
+    Passes.add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
+
+  PassManagerBuilder PMB;
+  PMB.LibraryInfo = new TargetLibraryInfoImpl(TheTriple);
+  PMB.Inliner = createFunctionInliningPass();
+  PMB.VerifyInput = true;
+  PMB.LoopVectorize = true;
+  PMB.SLPVectorize = true;
+  PMB.EmitReturnChecks = true;
+  PMB.OptLevel = OptLevel;
+  PMB.populateLTOPassManager(Passes);
+
+  if (Verbose)
+    errs() << "Analysing '" << Name << "'\n";
+  Passes.run(*M);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  // Print a stack trace if we signal out.
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+
+  LLVMContext &Context = getGlobalContext();
+  llvm_shutdown_obj Y;  // Call llvm_shutdown() on exit.
+
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeIPO(Registry);
+  initializeAnalysis(Registry);
+
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+
+  cl::ParseCommandLineOptions(argc, argv, "SafeDispatch call site analysis\n");
+
+  if (Separate && !OutputName.empty() && InputFilenames.size() > 1) {
+    errs() << argv[0] << ": error: -o names a single program, it cannot be used with -separate\n";
+    return 1;
+  }
+
+  if (Separate) {
+    for (const auto &File : InputFilenames) {
+      if (!analyse(argv[0], Context, File, defaultOutputName(File)))
+        return 1;
+    }
+    return 0;
+  }
+
+  std::string Name = OutputName.empty() ? defaultOutputName(InputFilenames[0]) : OutputName;
+  std::vector<std::string> Files(InputFilenames.begin(), InputFilenames.end());
+  return analyse(argv[0], Context, Files, Name) ? 0 : 1;
+}